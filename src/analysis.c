@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "analysis.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//decode an opcode the same way emulate_instruction does
+instruction_t decode_instruction(const uint16_t opcode) {
+    return (instruction_t) {
+            .opcode = opcode,
+            .NNN = opcode & 0x0FFF,
+            .NN = opcode & 0x00FF,
+            .N = opcode & 0x000F,
+            .X = (opcode >> 8) & 0x000F,
+            .Y = (opcode >> 4) & 0x000F,
+    };
+}
+
+bool is_skip(const instruction_t inst) {
+    switch (inst.opcode >> 12) {
+        case 0x03:
+        case 0x04:
+        case 0x05:
+        case 0x09:
+            return true;
+        case 0x0E:
+            return inst.NN == 0x9E || inst.NN == 0xA1;
+        default:
+            return false;
+    }
+}
+
+//instructions after which a block stops: control flow, draws (so the display wait sees them),
+//key waits (which loop on themselves) and RAM writes (which might rewrite the code that follows)
+bool ends_block(const instruction_t inst) {
+    switch (inst.opcode >> 12) {
+        case 0x0:
+            return inst.NN == 0xEE;
+        case 0x01:
+        case 0x02:
+        case 0x0B:
+        case 0x0D:
+            return true;
+        case 0x0F:
+            return inst.NN == 0x0A || inst.NN == 0x33 || inst.NN == 0x55;
+        default:
+            return is_skip(inst);
+    }
+}
+
+static uint16_t fetch(const uint8_t *ram, const uint16_t addr) {
+    return (ram[addr] << 8) | ram[addr + 1];
+}
+
+static void mark_leader(rom_analysis_t *analysis, const uint16_t addr, uint16_t *worklist, int *pending) {
+    if (addr < ANALYSIS_ENTRY_POINT || addr > sizeof(analysis->flags) - 2 || analysis->flags[addr] & ANALYSIS_LEADER)
+        return;
+    analysis->flags[addr] |= ANALYSIS_LEADER;
+    worklist[(*pending)++] = addr;
+}
+
+//recursive descent from the entry point, every branch target and fallthrough after a block end
+//becomes a leader. Code only reachable through BNNN is left to the interpreter.
+void analyze_rom(rom_analysis_t *analysis, const uint8_t *ram) {
+    uint16_t worklist[4096];
+    int pending = 0;
+
+    memset(analysis, 0, sizeof(*analysis));
+    analysis->magic = ANALYSIS_MAGIC;
+    analysis->version = ANALYSIS_VERSION;
+    analysis->rom_hash = hash_bytes(ram, sizeof(analysis->flags), 0);
+    mark_leader(analysis, ANALYSIS_ENTRY_POINT, worklist, &pending);
+
+    while (pending) {
+        uint16_t addr = worklist[--pending];
+        for (uint32_t count = 0;; count++) {
+            if (addr > sizeof(analysis->flags) - 2 || analysis->flags[addr] & ANALYSIS_REACHABLE)
+                break;
+            //long straight runs are cut into several blocks
+            if (count == ANALYSIS_MAX_BLOCK_INSTS) {
+                mark_leader(analysis, addr, worklist, &pending);
+                break;
+            }
+            analysis->flags[addr] |= ANALYSIS_REACHABLE;
+            const instruction_t inst = decode_instruction(fetch(ram, addr));
+
+            if (is_skip(inst)) {
+                mark_leader(analysis, addr + 2, worklist, &pending);
+                mark_leader(analysis, addr + 4, worklist, &pending);
+                break;
+            }
+            if (ends_block(inst)) {
+                switch (inst.opcode >> 12) {
+                    case 0x01:
+                        mark_leader(analysis, inst.NNN, worklist, &pending);
+                        break;
+                    case 0x02:
+                        mark_leader(analysis, inst.NNN, worklist, &pending);
+                        mark_leader(analysis, addr + 2, worklist, &pending);
+                        break;
+                    case 0x0:
+                    case 0x0B:
+                        break;
+                    default:
+                        mark_leader(analysis, addr + 2, worklist, &pending);
+                        break;
+                }
+                break;
+            }
+            addr += 2;
+        }
+    }
+
+    //a block runs until it ends itself, reaches the next leader or hits the length limit
+    for (uint16_t start = ANALYSIS_ENTRY_POINT; start < sizeof(analysis->flags) - 1; start++) {
+        if (!(analysis->flags[start] & ANALYSIS_LEADER))
+            continue;
+        uint16_t addr = start;
+        for (uint32_t count = 1;; count++) {
+            const instruction_t inst = decode_instruction(fetch(ram, addr));
+            addr += 2;
+            if (ends_block(inst) || count == ANALYSIS_MAX_BLOCK_INSTS || addr > sizeof(analysis->flags) - 2 ||
+                analysis->flags[addr] & ANALYSIS_LEADER)
+                break;
+        }
+        analysis->block_length[start] = addr - start;
+        analysis->blocks++;
+    }
+}
+
+//$CHIP8_CACHE_DIR, else chip8/ under the XDG cache directory, NULL if there is no home to put it in
+const char *default_cache_dir(void) {
+    static char path[4096];
+    const char *dir = getenv("CHIP8_CACHE_DIR");
+    if (dir && *dir)
+        return dir;
+    if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+        snprintf(path, sizeof(path), "%s/chip8", dir);
+    else if ((dir = getenv("HOME")) && *dir)
+        snprintf(path, sizeof(path), "%s/.cache/chip8", dir);
+    else
+        return NULL;
+    return path;
+}
+
+//a mapped file is only as good as the disk it came from, every block record is checked against what
+//analyze_rom() can produce before chip8_aot indexes RAM with it
+static bool valid_blocks(const rom_analysis_t *analysis) {
+    uint32_t blocks = 0;
+    for (uint32_t addr = 0; addr < sizeof(analysis->flags); addr++) {
+        const uint8_t flags = analysis->flags[addr];
+        const uint16_t length = analysis->block_length[addr];
+        if (flags & ~(ANALYSIS_REACHABLE | ANALYSIS_LEADER))
+            return false;
+        if (!(flags & ANALYSIS_LEADER)) {
+            if (length)
+                return false;
+            continue;
+        }
+        if (addr < ANALYSIS_ENTRY_POINT || !(flags & ANALYSIS_REACHABLE) || !length || length % 2 ||
+            length > ANALYSIS_MAX_BLOCK_INSTS * 2 || addr + length > sizeof(analysis->flags))
+            return false;
+        blocks++;
+    }
+    return blocks == analysis->blocks;
+}
+
+static bool valid_analysis(const rom_analysis_t *analysis, const uint64_t rom_hash) {
+    return analysis->magic == ANALYSIS_MAGIC && analysis->version == ANALYSIS_VERSION &&
+           analysis->rom_hash == rom_hash && valid_blocks(analysis);
+}
+
+#ifndef _WIN32
+
+static bool make_dirs(const char *dir) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", dir);
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST)
+            return false;
+        *p = '/';
+    }
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+static const rom_analysis_t *map_analysis(const char *path, const uint64_t rom_hash) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(rom_analysis_t))
+        map = mmap(NULL, sizeof(rom_analysis_t), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    if (!valid_analysis(map, rom_hash)) {
+        munmap(map, sizeof(rom_analysis_t));
+        return NULL;
+    }
+    return map;
+}
+
+//written under a temporary name and renamed, so concurrent chip8_aot runs never map a partial file
+static void store_analysis(const rom_analysis_t *analysis, const char *cache_dir, const char *path) {
+    char tmp[4096 + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+    if (!make_dirs(cache_dir))
+        return;
+
+    FILE *file = fopen(tmp, "wb");
+    if (!file)
+        return;
+    const bool written = fwrite(analysis, sizeof(*analysis), 1, file) == 1;
+    if (fclose(file) != 0 || !written || rename(tmp, path) != 0)
+        remove(tmp);
+}
+
+#endif
+
+//map the analysis of a loaded ram image from cache_dir, or compute it and store it there.
+//Without a cache_dir the analysis is only computed.
+bool open_analysis(analysis_t *analysis, const uint8_t *ram, const char *cache_dir) {
+    memset(analysis, 0, sizeof(*analysis));
+#ifndef _WIN32
+    char path[4096];
+    const uint64_t rom_hash = hash_bytes(ram, sizeof(((rom_analysis_t *) 0)->flags), 0);
+    if (cache_dir) {
+        snprintf(path, sizeof(path), "%s/%016llx-v%u.cfg", cache_dir, (unsigned long long) rom_hash,
+                 ANALYSIS_VERSION);
+        if ((analysis->cfg = map_analysis(path, rom_hash))) {
+            analysis->mapped = true;
+            analysis->cache_hit = true;
+            return true;
+        }
+    }
+#endif
+
+    rom_analysis_t *cfg = malloc(sizeof(rom_analysis_t));
+    if (!cfg)
+        return false;
+    analyze_rom(cfg, ram);
+#ifndef _WIN32
+    if (cache_dir)
+        store_analysis(cfg, cache_dir, path);
+#endif
+    analysis->cfg = cfg;
+    return true;
+}
+
+void close_analysis(analysis_t *analysis) {
+#ifndef _WIN32
+    if (analysis->mapped)
+        munmap((void *) analysis->cfg, sizeof(rom_analysis_t));
+    else
+#endif
+        free((void *) analysis->cfg);
+    analysis->cfg = NULL;
+}
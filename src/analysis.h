@@ -0,0 +1,43 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "chip8.h"
+
+//bump whenever analyze_rom or rom_analysis_t change, cache files of other versions are ignored
+#define ANALYSIS_VERSION 1
+#define ANALYSIS_MAGIC 0x47464338 // "8CFG"
+#define ANALYSIS_ENTRY_POINT 0x200
+#define ANALYSIS_MAX_BLOCK_INSTS 64
+
+#define ANALYSIS_REACHABLE 0x1 // first byte of an instruction reachable from the entry point
+#define ANALYSIS_LEADER 0x2    // first instruction of a basic block
+
+//The analysis is what chip8_aot compiles from, and chip8_aot is its only user: the interpreter, the
+//batch workers, the scheduler, chip8d and chip8_tas decode instructions as they run them and analyse
+//nothing when a ROM is loaded, so they have no launch cost to cache and do not open it.
+
+//control flow of a ROM, laid out flat so a cache file can be mapped straight into memory
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t rom_hash; // hash_bytes of the ram image the ROM was loaded into
+    uint32_t blocks;
+    uint8_t flags[4096];
+    uint16_t block_length[4096]; // bytes in the block starting at each leader
+} rom_analysis_t;
+
+typedef struct {
+    const rom_analysis_t *cfg;
+    bool mapped;    // cfg is a read-only mapping of the cache file rather than heap memory
+    bool cache_hit; // cfg was found in the cache instead of being computed
+} analysis_t;
+
+instruction_t decode_instruction(const uint16_t opcode);
+bool is_skip(const instruction_t inst);
+bool ends_block(const instruction_t inst);
+void analyze_rom(rom_analysis_t *analysis, const uint8_t *ram);
+const char *default_cache_dir(void);
+bool open_analysis(analysis_t *analysis, const uint8_t *ram, const char *cache_dir);
+void close_analysis(analysis_t *analysis);
+
+#endif
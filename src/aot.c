@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "analysis.h"
+
+//chip8_aot: recompiles a ROM into a C translation unit with one function per basic block.
+//The blocks work on the same chip8_t as the interpreter and chip8_aot_run() falls back to
+//emulate_instruction() for any PC it has no block for, so computed jumps (BNNN), code that is only
+//reachable through them and self-modified blocks (guarded by comparing their bytes) still run.
+//The block analysis is kept on disk in default_cache_dir(), or in --cache-dir, see analysis.h;
+//--no-cache always computes it.
+
+typedef struct {
+    uint8_t ram[4096];
+    analysis_t analysis;
+} program_t;
+
+uint16_t fetch(const program_t *program, const uint16_t addr) {
+    return (program->ram[addr] << 8) | program->ram[addr + 1];
+}
+
+//cycle cost of an instruction under both timing models, known at compile time
+void emit_cost(FILE *out, const instruction_t inst) {
+    const chip8_t machine = {.inst = inst};
+    const config_t vip = {.timing = TIMING_COSMAC_VIP};
+    fprintf(out, "    chip8->cycles += COST(%u);\n", instruction_cycles(&machine, vip));
+}
+
+//emit one instruction, returns false if it was left to the interpreter
+bool emit_instruction(FILE *out, const uint16_t addr, const instruction_t inst) {
+    const uint16_t next = addr + 2;
+    switch (inst.opcode >> 12) {
+        case 0x0:
+            if (inst.NN != 0xEE)
+                return false;
+            fprintf(out, "    chip8->PC = *--chip8->stackPtr;\n");
+            break;
+        case 0x01:
+            fprintf(out, "    chip8->PC = 0x%04X;\n", inst.NNN);
+            break;
+        case 0x02:
+            fprintf(out, "    *chip8->stackPtr++ = 0x%04X;\n", next);
+            fprintf(out, "    chip8->PC = 0x%04X;\n", inst.NNN);
+            break;
+        case 0x03:
+            fprintf(out, "    chip8->PC = chip8->V[0x%X] == 0x%02X ? 0x%04X : 0x%04X;\n", inst.X, inst.NN, next + 2,
+                    next);
+            break;
+        case 0x04:
+            fprintf(out, "    chip8->PC = chip8->V[0x%X] != 0x%02X ? 0x%04X : 0x%04X;\n", inst.X, inst.NN, next + 2,
+                    next);
+            break;
+        case 0x05:
+            fprintf(out, "    chip8->PC = chip8->V[0x%X] == chip8->V[0x%X] ? 0x%04X : 0x%04X;\n", inst.X, inst.Y,
+                    next + 2, next);
+            break;
+        case 0x06:
+            fprintf(out, "    chip8->V[0x%X] = 0x%02X;\n", inst.X, inst.NN);
+            break;
+        case 0x07:
+            fprintf(out, "    chip8->V[0x%X] += 0x%02X;\n", inst.X, inst.NN);
+            break;
+        case 0x08: {
+            static const char *logic_ops[] = {"=", "|=", "&=", "^="};
+            switch (inst.N) {
+                case 0x0:
+                case 0x1:
+                case 0x2:
+                case 0x3:
+                    fprintf(out, "    chip8->V[0x%X] %s chip8->V[0x%X];\n", inst.X, logic_ops[inst.N], inst.Y);
+                    if (inst.N != 0x0)
+                        fprintf(out, "    if (config.extension == CHIP8)\n        chip8->V[0xF] = 0;\n");
+                    break;
+                case 0x4:
+                    fprintf(out, "    {\n        const bool carry = (uint16_t) chip8->V[0x%X] + chip8->V[0x%X] > 0xFF;\n"
+                                 "        chip8->V[0x%X] += chip8->V[0x%X];\n        chip8->V[0xF] = carry;\n    }\n",
+                            inst.X, inst.Y, inst.X, inst.Y);
+                    break;
+                case 0x5:
+                    fprintf(out, "    {\n        const bool carry = chip8->V[0x%X] >= chip8->V[0x%X];\n"
+                                 "        chip8->V[0x%X] -= chip8->V[0x%X];\n        chip8->V[0xF] = carry;\n    }\n",
+                            inst.X, inst.Y, inst.X, inst.Y);
+                    break;
+                case 0x7:
+                    fprintf(out, "    {\n        const bool carry = chip8->V[0x%X] <= chip8->V[0x%X];\n"
+                                 "        chip8->V[0x%X] = chip8->V[0x%X] - chip8->V[0x%X];\n"
+                                 "        chip8->V[0xF] = carry;\n    }\n",
+                            inst.X, inst.Y, inst.X, inst.Y, inst.X);
+                    break;
+                default:
+                    return false;
+            }
+            break;
+        }
+        case 0x09:
+            fprintf(out, "    chip8->PC = chip8->V[0x%X] != chip8->V[0x%X] ? 0x%04X : 0x%04X;\n", inst.X, inst.Y,
+                    next + 2, next);
+            break;
+        case 0x0A:
+            fprintf(out, "    chip8->I = 0x%04X;\n", inst.NNN);
+            break;
+        case 0x0F:
+            switch (inst.NN) {
+                case 0x07:
+                    fprintf(out, "    chip8->V[0x%X] = chip8->delayTimer;\n", inst.X);
+                    break;
+                case 0x15:
+                    fprintf(out, "    chip8->delayTimer = chip8->V[0x%X];\n", inst.X);
+                    break;
+                case 0x18:
+                    fprintf(out, "    chip8->soundTimer = chip8->V[0x%X];\n", inst.X);
+                    break;
+                case 0x1E:
+                    fprintf(out, "    chip8->I += chip8->V[0x%X];\n", inst.X);
+                    break;
+                case 0x29:
+                    fprintf(out, "    chip8->I = chip8->V[0x%X] * 5;\n", inst.X);
+                    break;
+                default:
+                    return false;
+            }
+            break;
+        default:
+            return false;
+    }
+    emit_cost(out, inst);
+    return true;
+}
+
+//emit the block starting at a leader. Like the interpreter loop, a block stops after any instruction
+//that reaches the caller's cycle limit, so slices and key changes land on the same instruction.
+void emit_block(FILE *out, const program_t *program, const uint16_t start) {
+    const uint16_t end = start + program->analysis.cfg->block_length[start];
+    fprintf(out, "static uint32_t block_%04X(chip8_t *chip8, const config_t config, const uint64_t limit) {\n",
+            start);
+    instruction_t inst;
+    bool interpreted = false;
+
+    for (uint16_t addr = start; addr < end; addr += 2) {
+        inst = decode_instruction(fetch(program, addr));
+        fprintf(out, "    // 0x%04X: %04X\n", addr, inst.opcode);
+        interpreted = !emit_instruction(out, addr, inst);
+        if (interpreted)
+            fprintf(out, "    chip8->PC = 0x%04X;\n    emulate_instruction(chip8, config);\n", addr);
+        //the rest of the block runs interpreted until the next leader
+        if (addr + 2 < end) {
+            fprintf(out, "    if (chip8->cycles >= limit) {\n        chip8->PC = 0x%04X;\n", addr + 2);
+            if (!interpreted)
+                fprintf(out, "        chip8->inst.opcode = 0x%04X;\n", inst.opcode);
+            fprintf(out, "        return %u;\n    }\n", (addr + 2 - start) / 2);
+        }
+    }
+    if (!ends_block(inst))
+        fprintf(out, "    chip8->PC = 0x%04X;\n", end);
+    //the display wait looks at the last opcode, interpreted instructions have already set it
+    if (!interpreted)
+        fprintf(out, "    chip8->inst.opcode = 0x%04X;\n", inst.opcode);
+    fprintf(out, "    return %u;\n}\n\n", (end - start) / 2);
+}
+
+bool load_rom(program_t *program, const char *romName, const char *cache_dir) {
+    static chip8_t chip8;
+    config_t config;
+    set_config(&config, 0, NULL);
+    if (!init_chip8(&chip8, config, romName))
+        return false;
+    memcpy(program->ram, chip8.ram, sizeof(program->ram));
+    return open_analysis(&program->analysis, program->ram, cache_dir);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <rom-path> <output.c> [--cache-dir <dir> | --no-cache]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const char *cache_dir = default_cache_dir();
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc)
+            cache_dir = argv[i + 1];
+        else if (strcmp(argv[i], "--no-cache") == 0)
+            cache_dir = NULL;
+    }
+
+    static program_t program;
+    if (!load_rom(&program, argv[1], cache_dir))
+        exit(EXIT_FAILURE);
+    const rom_analysis_t *cfg = program.analysis.cfg;
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out) {
+        fprintf(stderr, "Could not open %s for writing\n", argv[2]);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(out, "//Generated by chip8_aot from %s, do not edit\n", argv[1]);
+    fprintf(out, "#include <string.h>\n#include \"chip8.h\"\n\n");
+    fprintf(out, "#define COST(vip_cycles) (config.timing == TIMING_COSMAC_VIP ? (vip_cycles) : 1)\n\n");
+
+    for (uint16_t addr = ANALYSIS_ENTRY_POINT; addr < sizeof(program.ram) - 1; addr++) {
+        if (!(cfg->flags[addr] & ANALYSIS_LEADER))
+            continue;
+        emit_block(out, &program, addr);
+        fprintf(out, "static const uint8_t code_%04X[] = {", addr);
+        for (uint16_t i = 0; i < cfg->block_length[addr]; i++)
+            fprintf(out, "%s0x%02X", i ? ", " : "", program.ram[addr + i]);
+        fprintf(out, "};\n\n");
+    }
+
+    fprintf(out, "uint32_t chip8_aot_run(chip8_t *chip8, const config_t config, const uint64_t limit) {\n");
+    //only the interpreter prints the trace
+    fprintf(out, "    if (config.trace)\n        return 0;\n");
+    fprintf(out, "    switch (chip8->PC) {\n");
+    for (uint16_t addr = ANALYSIS_ENTRY_POINT; addr < sizeof(program.ram) - 1; addr++) {
+        if (!(cfg->flags[addr] & ANALYSIS_LEADER))
+            continue;
+        fprintf(out, "        case 0x%04X:\n", addr);
+        fprintf(out, "            if (memcmp(&chip8->ram[0x%04X], code_%04X, sizeof(code_%04X)) != 0)\n"
+                     "                return 0;\n", addr, addr, addr);
+        fprintf(out, "            return block_%04X(chip8, config, limit);\n", addr);
+    }
+    fprintf(out, "        default:\n            return 0;\n    }\n}\n");
+    fclose(out);
+
+    printf("%s: %u blocks written to %s (analysis %s)\n", argv[1], cfg->blocks, argv[2],
+           program.analysis.cache_hit ? "from cache" : "computed");
+    close_analysis(&program.analysis);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,78 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define ARENA_HUGE_PAGE (2u << 20)
+
+static size_t round_up(const size_t size, const size_t to) {
+    return (size + to - 1) / to * to;
+}
+
+#ifndef _WIN32
+//explicit huge pages if some are reserved (vm.nr_hugepages), otherwise ordinary pages the kernel is
+//asked to merge into transparent huge ones. False when neither mapping could be made.
+static bool map_huge(arena_t *arena) {
+    arena->bytes = round_up(arena->bytes, ARENA_HUGE_PAGE);
+    void *memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    memory = mmap(NULL, arena->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    arena->huge_pages = memory != MAP_FAILED;
+#endif
+    if (memory == MAP_FAILED) {
+        memory = mmap(NULL, arena->bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return false;
+#ifdef MADV_HUGEPAGE
+        arena->huge_pages = madvise(memory, arena->bytes, MADV_HUGEPAGE) == 0;
+#endif
+    }
+    arena->base = memory;
+    return true;
+}
+#endif
+
+bool init_arena(arena_t *arena, const size_t element_size, const uint32_t capacity, const bool huge_pages) {
+    memset(arena, 0, sizeof(*arena));
+    arena->stride = round_up(element_size ? element_size : 1, CHIP8_CACHE_LINE);
+    arena->capacity = capacity;
+    arena->bytes = arena->stride * (capacity ? capacity : 1);
+
+#ifndef _WIN32
+    if (huge_pages) {
+        if (map_huge(arena)) {
+            arena->mapped = true;
+            return true;
+        }
+        fprintf(stderr, "Could not map %zu bytes, falling back to the heap\n", arena->bytes);
+        arena->bytes = arena->stride * (capacity ? capacity : 1);
+    }
+    arena->base = aligned_alloc(CHIP8_CACHE_LINE, arena->bytes);
+#else
+    (void) huge_pages;
+    arena->base = _aligned_malloc(arena->bytes, CHIP8_CACHE_LINE);
+#endif
+    if (!arena->base)
+        return false;
+    memset(arena->base, 0, arena->bytes);
+    return true;
+}
+
+void free_arena(arena_t *arena) {
+    if (!arena->base)
+        return;
+#ifndef _WIN32
+    if (arena->mapped)
+        munmap(arena->base, arena->bytes);
+    else
+        free(arena->base);
+#else
+    _aligned_free(arena->base);
+#endif
+    arena->base = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "chip8.h"
+
+//One allocation holding capacity fixed size elements back to back, each starting on its own cache
+//line so instances stepped by different threads never share one. base is used as a plain array of
+//stride-byte elements; for chip8_t and structs embedding it stride is sizeof, as they are already
+//cache line aligned. The memory starts zeroed.
+typedef struct {
+    uint8_t *base;
+    size_t stride;    // element size rounded up to whole cache lines
+    uint32_t capacity;
+    size_t bytes;     // size of the allocation, whole (huge) pages when mapped
+    bool mapped;      // came from mmap rather than the aligned heap
+    bool huge_pages;  // explicit huge pages, or transparent ones the kernel agreed to use
+} arena_t;
+
+bool init_arena(arena_t *arena, const size_t element_size, const uint32_t capacity, const bool huge_pages);
+void free_arena(arena_t *arena);
+
+#endif
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "batch.h"
+
+static void load_initial(batch_t *batch, const uint32_t env) {
+    chip8_t *chip8 = &batch->machines[env];
+    copy_chip8(chip8, &batch->initial);
+    prime_condition(&batch->rewards[env], chip8);
+    prime_condition(&batch->dones[env], chip8);
+    batch->done[env] = false;
+}
+
+//the envs of a batch whose ROM was loaded into batch->initial
+static bool init_envs(batch_t *batch, const char *reward, const char *done, char *error, const size_t error_size) {
+    const uint32_t size = batch->size;
+    condition_t reward_condition;
+    condition_t done_condition;
+    if (!compile_condition(&reward_condition, reward ? reward : "0", error, error_size) ||
+        !compile_condition(&done_condition, done ? done : "0", error, error_size))
+        return false;
+
+    const bool arena = init_arena(&batch->arena, sizeof(chip8_t), size, batch->config.huge_pages);
+    batch->machines = (chip8_t *) batch->arena.base;
+    batch->rewards = malloc(sizeof(condition_t) * size);
+    batch->dones = malloc(sizeof(condition_t) * size);
+    batch->done = malloc(sizeof(bool) * size);
+    if (!arena || !batch->rewards || !batch->dones || !batch->done) {
+        snprintf(error, error_size, "out of memory for %u environments", size);
+        free_batch(batch);
+        return false;
+    }
+    for (uint32_t env = 0; env < size; env++) {
+        batch->rewards[env] = reward_condition;
+        batch->dones[env] = done_condition;
+        load_initial(batch, env);
+    }
+    return true;
+}
+
+static void init_fields(batch_t *batch, const config_t config, const uint32_t size, const uint32_t frame_skip,
+                        const observation_format_t format) {
+    memset(batch, 0, sizeof(*batch));
+    batch->config = config;
+    batch->size = size;
+    batch->frame_skip = frame_skip ? frame_skip : 1;
+    batch->format = format;
+}
+
+bool init_batch(batch_t *batch, const config_t config, const char *romName, const uint32_t size,
+                const uint32_t frame_skip, const observation_format_t format, const char *reward,
+                const char *done, char *error, const size_t error_size) {
+    init_fields(batch, config, size, frame_skip, format);
+    if (!init_chip8(&batch->initial, config, romName)) {
+        snprintf(error, error_size, "could not load %s", romName);
+        return false;
+    }
+    return init_envs(batch, reward, done, error, error_size);
+}
+
+//a batch of the ROM with that ID in an open corpus pack, loaded straight from the mapping. The ROM's
+//name points into the pack, which has to stay open for as long as the batch is used.
+bool init_batch_corpus(batch_t *batch, const config_t config, const corpus_t *corpus, const uint32_t id,
+                       const uint32_t size, const uint32_t frame_skip, const observation_format_t format,
+                       const char *reward, const char *done, char *error, const size_t error_size) {
+    init_fields(batch, config, size, frame_skip, format);
+    size_t rom_size;
+    const uint8_t *rom = id < corpus->count ? corpus_rom(corpus, id, &rom_size) : NULL;
+    if (!rom || !init_chip8_rom(&batch->initial, config, corpus_name(corpus, id), rom, rom_size)) {
+        snprintf(error, error_size, "could not load ROM %u of the corpus", id);
+        return false;
+    }
+    return init_envs(batch, reward, done, error, error_size);
+}
+
+void free_batch(batch_t *batch) {
+#ifndef _WIN32
+    stop_batch_workers(batch);
+#endif
+    free_arena(&batch->arena);
+    free(batch->rewards);
+    free(batch->dones);
+    free(batch->done);
+    batch->machines = NULL;
+    batch->rewards = batch->dones = NULL;
+    batch->done = NULL;
+}
+
+void reset_batch_env(batch_t *batch, const uint32_t env) {
+    load_initial(batch, env);
+}
+
+//steps the envs [first, last), returns the frames emulated
+static uint64_t step_envs(batch_t *batch, const uint32_t first, const uint32_t last, const uint16_t *actions,
+                          uint8_t *observations, int32_t *rewards, bool *dones) {
+    const size_t stride = observation_size(batch->format);
+    uint64_t frames = 0;
+    for (uint32_t env = first; env < last; env++) {
+        chip8_t *chip8 = &batch->machines[env];
+        packed_display_t pooled_display;
+        packed_display_t *observation = &pooled_display;
+        rewards[env] = 0;
+        if (batch->done[env]) {
+            dones[env] = true;
+            pack_display(chip8, observation);
+            write_observation(observation, batch->format, &observations[env * stride]);
+            continue;
+        }
+        for (uint8_t key = 0; key < sizeof(chip8->keypad); key++)
+            chip8->keypad[key] = actions[env] >> key & 1;
+
+        bool pooled = false;
+        for (uint32_t frame = 0; frame < batch->frame_skip; frame++) {
+            run_frame(chip8, batch->config);
+            frames++;
+            rewards[env] += evaluate_condition(&batch->rewards[env], chip8);
+            batch->done[env] = evaluate_condition(&batch->dones[env], chip8) != 0;
+            if (frame + 2 == batch->frame_skip) {
+                pack_display(chip8, observation);
+                pooled = true;
+            }
+            if (batch->done[env] || frame + 1 == batch->frame_skip) {
+                packed_display_t last;
+                pack_display(chip8, pooled ? &last : observation);
+                for (uint8_t y = 0; pooled && y < 32; y++)
+                    observation->rows[y] |= last.rows[y];
+                break;
+            }
+        }
+        write_observation(observation, batch->format, &observations[env * stride]);
+        dones[env] = batch->done[env];
+    }
+    return frames;
+}
+
+//one action per env, results go into the caller's arrays of batch->size entries, observations holds
+//observation_size(batch->format) bytes per env. The observation is the OR of the last two frames so
+//sprites drawn on alternate frames are not lost; an env that ends before its second to last frame
+//returns only its final frame.
+void step_batch(batch_t *batch, const uint16_t *actions, uint8_t *observations, int32_t *rewards, bool *dones) {
+#ifndef _WIN32
+    if (batch->worker_count) {
+        pthread_mutex_lock(&batch->lock);
+        batch->step_actions = actions;
+        batch->step_observations = observations;
+        batch->step_rewards = rewards;
+        batch->step_dones = dones;
+        batch->running = batch->worker_count;
+        batch->generation++;
+        pthread_cond_broadcast(&batch->start);
+        while (batch->running)
+            pthread_cond_wait(&batch->finished, &batch->lock);
+        pthread_mutex_unlock(&batch->lock);
+        return;
+    }
+#endif
+    step_envs(batch, 0, batch->size, actions, observations, rewards, dones);
+}
+
+#ifndef _WIN32
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//counts a worker out of the current step (or out of starting up) and wakes step_batch() after the last
+static void finish_step(batch_t *batch) {
+    pthread_mutex_lock(&batch->lock);
+    if (--batch->running == 0)
+        pthread_cond_signal(&batch->finished);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static void *batch_worker(void *data) {
+    batch_worker_t *worker = (batch_worker_t *) data;
+    batch_t *batch = worker->batch;
+    //settle on the CPU first, so the pages moved to its node are the ones it will use
+    if (worker->cpu >= 0 && pin_thread((uint16_t) worker->cpu)) {
+        chip8_t *machines = &batch->machines[worker->first];
+        if (worker->bind)
+            worker->bound = bind_memory(machines, sizeof(chip8_t) * (worker->last - worker->first), worker->node);
+    } else {
+        worker->cpu = -1;
+    }
+    uint64_t seen = 0;
+    finish_step(batch);
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        while (batch->generation == seen && !batch->stopping)
+            pthread_cond_wait(&batch->start, &batch->lock);
+        seen = batch->generation;
+        const bool stopping = batch->stopping;
+        pthread_mutex_unlock(&batch->lock);
+        if (stopping)
+            return NULL;
+
+        const uint64_t start = now_ns();
+        worker->frames += step_envs(batch, worker->first, worker->last, batch->step_actions,
+                                    batch->step_observations, batch->step_rewards, batch->step_dones);
+        worker->busy_ns += now_ns() - start;
+        finish_step(batch);
+    }
+}
+
+//splits the envs over threads workers. With pin every worker is kept on its own CPU, the workers spread
+//over the NUMA nodes, and the machines it steps are moved to its node. A single node only gets the
+//pinning; a system that refuses either keeps running the workers unpinned or unbound.
+bool start_batch_workers(batch_t *batch, const uint32_t threads, const bool pin) {
+    stop_batch_workers(batch);
+    if (!threads)
+        return true;
+    batch->workers = calloc(threads, sizeof(batch_worker_t));
+    if (!batch->workers)
+        return false;
+    topology_t topology;
+    read_topology(&topology);
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->start, NULL);
+    pthread_cond_init(&batch->finished, NULL);
+    batch->stopping = false;
+    batch->generation = 0;
+    batch->running = threads;
+
+    for (uint32_t i = 0; i < threads; i++) {
+        batch_worker_t *worker = &batch->workers[i];
+        const uint32_t cpu = worker_cpu(&topology, i, threads);
+        worker->batch = batch;
+        worker->first = (uint32_t) ((uint64_t) batch->size * i / threads);
+        worker->last = (uint32_t) ((uint64_t) batch->size * (i + 1) / threads);
+        worker->cpu = pin ? topology.cpus[cpu] : -1;
+        worker->node = topology.nodes[cpu];
+        worker->bind = pin && topology.node_count > 1;
+        if (pthread_create(&worker->thread, NULL, batch_worker, worker) != 0) {
+            //the workers already running still count themselves out of starting up
+            pthread_mutex_lock(&batch->lock);
+            batch->running -= threads - i;
+            pthread_mutex_unlock(&batch->lock);
+            batch->worker_count = i;
+            stop_batch_workers(batch);
+            return false;
+        }
+        batch->worker_count = i + 1;
+    }
+    //every worker is placed before the first step
+    pthread_mutex_lock(&batch->lock);
+    while (batch->running)
+        pthread_cond_wait(&batch->finished, &batch->lock);
+    pthread_mutex_unlock(&batch->lock);
+    for (uint32_t i = 0; i < threads; i++) {
+        if (batch->workers[i].bind && !batch->workers[i].bound) {
+            fprintf(stderr, "Could not bind the machines of every worker to its node\n");
+            break;
+        }
+    }
+    return true;
+}
+
+void stop_batch_workers(batch_t *batch) {
+    if (!batch->workers)
+        return;
+    pthread_mutex_lock(&batch->lock);
+    batch->stopping = true;
+    pthread_cond_broadcast(&batch->start);
+    pthread_mutex_unlock(&batch->lock);
+    for (uint32_t i = 0; i < batch->worker_count; i++)
+        pthread_join(batch->workers[i].thread, NULL);
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->start);
+    pthread_cond_destroy(&batch->finished);
+    free(batch->workers);
+    batch->workers = NULL;
+    batch->worker_count = 0;
+}
+#endif
@@ -0,0 +1,78 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "arena.h"
+#include "condition.h"
+#include "corpus.h"
+#include "observation.h"
+#ifndef _WIN32
+#include <pthread.h>
+#include "placement.h"
+#endif
+
+//a batch of identical environments stepped headless for training. An action is the mask of keys held
+//(bit k for key k) for frame_skip frames; only the last two of those frames are packed and pooled into
+//the observation, which is written in the batch's format, nothing is rendered. Reward and done are
+//condition.h expressions summed and ORed over the skipped frames. An env that is done stays done until
+//reset_batch_env().
+typedef struct batch batch_t;
+
+#ifndef _WIN32
+//a thread stepping the envs [first, last) of every step_batch(), optionally pinned to a CPU with
+//the memory of its machines bound to that CPU's node
+typedef struct {
+    pthread_t thread;
+    batch_t *batch;
+    uint32_t first;
+    uint32_t last;
+    int32_t cpu;      // -1 when not pinned
+    uint8_t node;
+    bool bind;        // move the slice of the arena to node once pinned
+    bool bound;       // it was moved
+    uint64_t frames;  // frames emulated so far
+    uint64_t busy_ns; // time spent stepping its envs
+} batch_worker_t;
+#endif
+
+struct batch {
+    config_t config;
+    uint32_t size;
+    uint32_t frame_skip;
+    observation_format_t format;
+    arena_t arena;
+    chip8_t *machines; // in arena, each machine on its own cache lines
+    chip8_t initial; // machine right after loading the ROM, envs reset to it without touching the file
+    condition_t *rewards;
+    condition_t *dones;
+    bool *done;
+#ifndef _WIN32
+    batch_worker_t *workers; // none until start_batch_workers(), step_batch() then runs on them
+    uint32_t worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t start;    // a new step (generation) or stopping
+    pthread_cond_t finished; // running dropped to 0
+    uint64_t generation;
+    uint32_t running;
+    bool stopping;
+    const uint16_t *step_actions; // arguments of the step being run
+    uint8_t *step_observations;
+    int32_t *step_rewards;
+    bool *step_dones;
+#endif
+};
+
+bool init_batch(batch_t *batch, const config_t config, const char *romName, const uint32_t size,
+                const uint32_t frame_skip, const observation_format_t format, const char *reward,
+                const char *done, char *error, const size_t error_size);
+bool init_batch_corpus(batch_t *batch, const config_t config, const corpus_t *corpus, const uint32_t id,
+                       const uint32_t size, const uint32_t frame_skip, const observation_format_t format,
+                       const char *reward, const char *done, char *error, const size_t error_size);
+void free_batch(batch_t *batch);
+void reset_batch_env(batch_t *batch, const uint32_t env);
+void step_batch(batch_t *batch, const uint16_t *actions, uint8_t *observations, int32_t *rewards, bool *dones);
+#ifndef _WIN32
+bool start_batch_workers(batch_t *batch, const uint32_t threads, const bool pin);
+void stop_batch_workers(batch_t *batch);
+#endif
+
+#endif
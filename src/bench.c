@@ -0,0 +1,683 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "arena.h"
+#include "batch.h"
+#include "corpus.h"
+#include "savestate.h"
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "scheduler.h"
+#endif
+
+//chip8_bench: micro benchmarks for the core, run headless on a ROM.
+//  hash <rom> [steps]   incremental state_hash() against rehashing RAM, display and registers every step
+//  batch <rom> [envs] [steps] [frame skip]
+//                       step_batch() with frame skip against one step, and observation, per frame
+//  observe <rom> [count]
+//                       every observation format written from a packed display, against a plain loop
+//  schedule <rom> [instances] [threads] [seconds]
+//                       instances paced at 60Hz on a few threads with random key taps, CPU used and
+//                       scheduler statistics
+//  corpus <pack> [dir]   every ROM of a corpus pack loaded from the mapped pack, through "<pack>#<ID>"
+//                       (mapping it per ROM), and from the files unpacked under dir; then a batch of
+//                       every ROM, by ID from the mapped pack against through "<pack>#<ID>"
+//  placement <rom> [envs] [steps] [threads]
+//                       step_batch() on worker threads left to float against pinned ones with their
+//                       machines on the local NUMA node, throughput per node
+//  arena <rom> [frames]
+//                       1k and 10k instances run frame by frame, allocated one by one against an
+//                       arena, with and without huge pages
+//  savestate <rom> [frames]
+//                       a save state of every frame, raw and compressed: size, save and load time
+//  checkpoint <rom> <dir> [envs] [steps] [every]
+//                       a batch checkpointed into dir every few steps, waiting for each checkpoint to
+//                       be written against the background writer, then resumed from the newest one
+//                       and, once it is cut short, from the one before
+
+static double seconds(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//what a search would have to do without the incremental hash: one fast hash over the whole state
+static uint64_t full_hash(const chip8_t *chip8) {
+    uint64_t hash = hash_bytes(chip8->ram, sizeof(chip8->ram), 0);
+    hash = hash_bytes(chip8->display, sizeof(chip8->display), hash);
+    hash = hash_bytes(chip8->V, sizeof(chip8->V), hash);
+    hash = hash_bytes(chip8->stack, sizeof(chip8->stack), hash);
+    const uint16_t registers[] = {chip8->I, chip8->PC, chip8->stackPtr - chip8->stack, chip8->delayTimer,
+                                  chip8->soundTimer};
+    hash = hash_bytes(registers, sizeof(registers), hash);
+    return hash_bytes(chip8->keypad, sizeof(chip8->keypad), hash);
+}
+
+//steps the ROM once per pass, hashing after every instruction, returns the seconds spent
+static double run_hash(const config_t config, const char *romName, const uint32_t steps, const int mode,
+                       uint64_t *sink) {
+    static chip8_t chip8;
+    init_chip8(&chip8, config, romName);
+    uint64_t hash = 0;
+    const double start = seconds();
+    for (uint32_t step = 0; step < steps; step++) {
+        emulate_instruction(&chip8, config);
+        if (step % 16 == 15)
+            update_timers(&chip8);
+        if (mode == 1)
+            hash ^= state_hash(&chip8);
+        else if (mode == 2)
+            hash ^= full_hash(&chip8);
+    }
+    *sink ^= hash;
+    return seconds() - start;
+}
+
+static int bench_hash(const char *romName, const uint32_t steps) {
+    config_t config;
+    set_config(&config, 0, NULL);
+
+    static chip8_t chip8;
+    if (!init_chip8(&chip8, config, romName))
+        return EXIT_FAILURE;
+    //the incremental hash has to agree with a recomputation wherever the run ends up
+    for (uint32_t step = 0; step < steps && step < 100000; step++) {
+        emulate_instruction(&chip8, config);
+        if (state_hash(&chip8) != rehash_state(&chip8)) {
+            fprintf(stderr, "Incremental hash diverged after %u instructions at 0x%04X\n", step + 1, chip8.PC);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t sink = 0;
+    const double baseline = run_hash(config, romName, steps, 0, &sink);
+    const double incremental = run_hash(config, romName, steps, 1, &sink) - baseline;
+    const double full = run_hash(config, romName, steps, 2, &sink) - baseline;
+    printf("%u instructions, emulation alone %.3fs\n", steps, baseline);
+    printf("incremental state_hash: %8.2f ns/hash\n", incremental * 1e9 / steps);
+    printf("full rehash:            %8.2f ns/hash (%.1fx)\n", full * 1e9 / steps,
+           incremental > 0 ? full / incremental : 0.0);
+    printf("(checksum %016llX)\n", (unsigned long long) sink);
+    return EXIT_SUCCESS;
+}
+
+//seconds for steps batch steps with every env holding a key that changes every step
+static double run_batch(batch_t *batch, const uint32_t steps, uint16_t *actions, uint8_t *observations,
+                        int32_t *rewards, bool *dones) {
+    const double start = seconds();
+    for (uint32_t step = 0; step < steps; step++) {
+        for (uint32_t env = 0; env < batch->size; env++)
+            actions[env] = 1 << ((step + env) % 16);
+        step_batch(batch, actions, observations, rewards, dones);
+    }
+    return seconds() - start;
+}
+
+static int bench_batch(const char *romName, const uint32_t envs, const uint32_t steps, const uint32_t frame_skip) {
+    config_t config;
+    set_config(&config, 0, NULL);
+    char error[128];
+    batch_t skipping;
+    batch_t every_frame;
+    if (!init_batch(&skipping, config, romName, envs, frame_skip, OBSERVATION_PACKED, "delta(V0)", NULL, error,
+                    sizeof(error)) ||
+        !init_batch(&every_frame, config, romName, envs, 1, OBSERVATION_PACKED, "delta(V0)", NULL, error,
+                    sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        return EXIT_FAILURE;
+    }
+    uint16_t *actions = malloc(sizeof(uint16_t) * envs);
+    uint8_t *observations = malloc(observation_size(OBSERVATION_PACKED) * envs);
+    int32_t *rewards = malloc(sizeof(int32_t) * envs);
+    bool *dones = malloc(sizeof(bool) * envs);
+
+    const double skipped = run_batch(&skipping, steps, actions, observations, rewards, dones);
+    const double single = run_batch(&every_frame, steps * frame_skip, actions, observations, rewards, dones);
+    const double frames = (double) envs * steps * frame_skip;
+    printf("%u envs, %u steps of %u frames\n", envs, steps, frame_skip);
+    printf("frame skip %u, pooled:  %8.0f env steps/s, %10.0f frames/s\n", frame_skip, envs * steps / skipped,
+           frames / skipped);
+    printf("observation per frame: %8.0f env steps/s, %10.0f frames/s (%.2fx)\n", envs * steps / single,
+           frames / single, skipped > 0 ? single / skipped : 0.0);
+    free(actions);
+    free(observations);
+    free(rewards);
+    free(dones);
+    free_batch(&skipping);
+    free_batch(&every_frame);
+    return EXIT_SUCCESS;
+}
+
+//what the kernels replace: one pass over display per format, a byte at a time
+static void naive_observation(const chip8_t *chip8, const observation_format_t format, uint8_t *out) {
+    memset(out, 0, observation_size(format));
+    for (uint8_t y = 0; y < 32; y++) {
+        for (uint8_t x = 0; x < 64; x++) {
+            const bool lit = chip8->display[y * 64 + x];
+            if (format == OBSERVATION_PACKED)
+                out[y * 8 + x / 8] |= lit << (x % 8);
+            else if (format == OBSERVATION_GRAY)
+                out[y * 64 + x] = lit ? 255 : 0;
+            else
+                out[(y / 2) * 32 + x / 2] += lit;
+        }
+    }
+    static const uint8_t shades[5] = {0, 64, 128, 191, 255};
+    for (size_t i = 0; format == OBSERVATION_GRAY_HALF && i < observation_size(format); i++)
+        out[i] = shades[out[i]];
+}
+
+static int bench_observe(const char *romName, const uint32_t count) {
+    config_t config;
+    set_config(&config, 0, NULL);
+    static chip8_t chip8;
+    if (!init_chip8(&chip8, config, romName))
+        return EXIT_FAILURE;
+    for (uint32_t frame = 0; frame < 120; frame++)
+        run_frame(&chip8, config);
+
+    static const char *names[] = {"packed", "gray", "gray-half"};
+    static uint8_t fast[64 * 32];
+    static uint8_t naive[64 * 32];
+    packed_display_t packed;
+    for (observation_format_t format = OBSERVATION_PACKED; format <= OBSERVATION_GRAY_HALF; format++) {
+        pack_display(&chip8, &packed);
+        write_observation(&packed, format, fast);
+        naive_observation(&chip8, format, naive);
+        if (memcmp(fast, naive, observation_size(format)) != 0) {
+            fprintf(stderr, "%s observation differs from the plain loop\n", names[format]);
+            return EXIT_FAILURE;
+        }
+
+        double start = seconds();
+        for (uint32_t i = 0; i < count; i++) {
+            chip8.display[i % sizeof(chip8.display)] ^= 1;
+            pack_display(&chip8, &packed);
+            write_observation(&packed, format, fast);
+        }
+        const double kernels = seconds() - start;
+        start = seconds();
+        for (uint32_t i = 0; i < count; i++) {
+            chip8.display[i % sizeof(chip8.display)] ^= 1;
+            naive_observation(&chip8, format, naive);
+        }
+        const double loop = seconds() - start;
+        printf("%-9s %4zu bytes: %7.1f ns/observation (%6.0f MB/s), plain loop %7.1f ns (%.1fx)\n", names[format],
+               observation_size(format), kernels * 1e9 / count, observation_size(format) * count / kernels / 1e6,
+               loop * 1e9 / count, kernels > 0 ? loop / kernels : 0.0);
+    }
+    return EXIT_SUCCESS;
+}
+
+//seconds to run frames frames on every machine, each holding a key that changes every frame
+static double run_instances(chip8_t **machines, const uint32_t count, const config_t config, const uint32_t frames) {
+    const double start = seconds();
+    for (uint32_t frame = 0; frame < frames; frame++) {
+        for (uint32_t i = 0; i < count; i++) {
+            chip8_t *chip8 = machines[i];
+            memset(chip8->keypad, 0, sizeof(chip8->keypad));
+            chip8->keypad[(frame + i) % 16] = true;
+            run_frame(chip8, config);
+        }
+    }
+    return seconds() - start;
+}
+
+//count copies of initial allocated one by one (layout 0) or in an arena without (1) and with huge
+//pages (2), returns the seconds frames frames took or a negative number if allocation failed
+static double run_layout(const chip8_t *initial, const uint32_t count, const config_t config, const uint32_t frames,
+                         const uint8_t layout, bool *huge_pages) {
+    chip8_t **machines = malloc(sizeof(chip8_t *) * count);
+    arena_t arena = {0};
+    if (!machines || (layout && !init_arena(&arena, sizeof(chip8_t), count, layout == 2))) {
+        free(machines);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        machines[i] = layout ? (chip8_t *) (arena.base + arena.stride * i)
+                             : aligned_alloc(CHIP8_CACHE_LINE, sizeof(chip8_t));
+        copy_chip8(machines[i], initial);
+    }
+    const double elapsed = run_instances(machines, count, config, frames);
+    *huge_pages = arena.huge_pages;
+    if (layout) {
+        free_arena(&arena);
+    } else {
+        for (uint32_t i = 0; i < count; i++)
+            free(machines[i]);
+    }
+    free(machines);
+    return elapsed;
+}
+
+static int bench_arena(const char *romName, const uint32_t frames) {
+    config_t config;
+    set_config(&config, 0, NULL);
+    static chip8_t initial;
+    if (!init_chip8(&initial, config, romName))
+        return EXIT_FAILURE;
+    printf("chip8_t is %zu bytes, registers and stack in the first %zu\n", sizeof(chip8_t),
+           offsetof(chip8_t, ram));
+
+    static const char *layouts[] = {"separate allocations:", "arena:", "arena, huge pages:"};
+    const uint32_t counts[] = {1000, 10000};
+    for (uint8_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        //best of three rounds, the layouts take turns so none gets a quieter machine
+        double best[3] = {0};
+        bool huge_pages = false;
+        for (uint8_t round = 0; round < 3; round++) {
+            for (uint8_t layout = 0; layout < 3; layout++) {
+                const double elapsed = run_layout(&initial, counts[c], config, frames, layout, &huge_pages);
+                if (elapsed < 0) {
+                    fprintf(stderr, "Could not allocate %u instances\n", counts[c]);
+                    return EXIT_FAILURE;
+                }
+                if (!round || elapsed < best[layout])
+                    best[layout] = elapsed;
+            }
+        }
+        printf("%u instances, %u frames\n", counts[c], frames);
+        for (uint8_t layout = 0; layout < 3; layout++) {
+            printf("  %-22s %10.0f frames/s (%.2fx)%s\n", layouts[layout], (double) counts[c] * frames / best[layout],
+                   best[0] / best[layout], layout == 2 && !huge_pages ? ", none were available" : "");
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static int bench_corpus(const char *path, const char *dir) {
+    config_t config;
+    set_config(&config, 0, NULL);
+    corpus_t corpus;
+    if (!open_corpus(&corpus, path))
+        return EXIT_FAILURE;
+    static chip8_t chip8;
+    uint64_t sink = 0;
+    double elapsed[3] = {0};
+    for (uint8_t source = 0; source < (dir ? 3 : 2); source++) {
+        const double start = seconds();
+        for (uint32_t id = 0; id < corpus.count; id++) {
+            char reference[4096];
+            bool loaded;
+            if (source == 0) {
+                size_t size;
+                const uint8_t *rom = corpus_rom(&corpus, id, &size);
+                loaded = init_chip8_rom(&chip8, config, corpus_name(&corpus, id), rom, size);
+            } else {
+                if (source == 1)
+                    snprintf(reference, sizeof(reference), "%s#%u", path, id);
+                else
+                    snprintf(reference, sizeof(reference), "%s/%s", dir, corpus_name(&corpus, id));
+                loaded = init_chip8(&chip8, config, reference);
+            }
+            if (!loaded) {
+                close_corpus(&corpus);
+                return EXIT_FAILURE;
+            }
+            sink ^= chip8.ram_hash;
+        }
+        elapsed[source] = seconds() - start;
+    }
+    static const char *sources[] = {"mapped pack:", "pack mapped per ROM:", "unpacked files:"};
+    printf("%u ROMs\n", corpus.count);
+    for (uint8_t source = 0; source < (dir ? 3 : 2); source++) {
+        printf("%-21s %8.2f us/ROM (%.1fx)\n", sources[source], elapsed[source] * 1e6 / (corpus.count ? corpus.count : 1),
+               elapsed[0] > 0 ? elapsed[source] / elapsed[0] : 0.0);
+    }
+
+    //a small batch of every ROM, by ID from the mapped pack against through "<pack>#<ID>"
+    double batch_elapsed[2] = {0};
+    for (uint8_t source = 0; source < 2; source++) {
+        const double start = seconds();
+        for (uint32_t id = 0; id < corpus.count; id++) {
+            char reference[4096];
+            char error[128];
+            batch_t batch;
+            snprintf(reference, sizeof(reference), "%s#%u", path, id);
+            const bool loaded = source == 0 ? init_batch_corpus(&batch, config, &corpus, id, 8, 1, OBSERVATION_PACKED,
+                                                                NULL, NULL, error, sizeof(error))
+                                            : init_batch(&batch, config, reference, 8, 1, OBSERVATION_PACKED, NULL,
+                                                         NULL, error, sizeof(error));
+            if (!loaded) {
+                fprintf(stderr, "%s\n", error);
+                close_corpus(&corpus);
+                return EXIT_FAILURE;
+            }
+            sink ^= batch.initial.ram_hash;
+            free_batch(&batch);
+        }
+        batch_elapsed[source] = seconds() - start;
+    }
+    static const char *batch_sources[] = {"batch, by ID:", "batch, <pack>#<ID>:"};
+    for (uint8_t source = 0; source < 2; source++) {
+        printf("%-21s %8.2f us/ROM (%.1fx)\n", batch_sources[source],
+               batch_elapsed[source] * 1e6 / (corpus.count ? corpus.count : 1),
+               batch_elapsed[0] > 0 ? batch_elapsed[source] / batch_elapsed[0] : 0.0);
+    }
+    printf("(checksum %016llX)\n", (unsigned long long) sink);
+    close_corpus(&corpus);
+    return EXIT_SUCCESS;
+}
+
+#ifndef _WIN32
+//frames per second of a batch stepped on threads workers, printed per node
+static bool run_placement(batch_t *batch, const uint32_t threads, const bool pin, const uint32_t steps,
+                          uint16_t *actions, uint8_t *observations, int32_t *rewards, bool *dones) {
+    if (!start_batch_workers(batch, threads, pin)) {
+        fprintf(stderr, "Could not start %u workers\n", threads);
+        return false;
+    }
+    const double wall = run_batch(batch, steps, actions, observations, rewards, dones);
+    uint64_t frames[PLACEMENT_MAX_NODES] = {0};
+    uint64_t busy_ns[PLACEMENT_MAX_NODES] = {0};
+    uint32_t workers[PLACEMENT_MAX_NODES] = {0};
+    uint32_t pinned = 0;
+    uint32_t bound = 0;
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < batch->worker_count; i++) {
+        const batch_worker_t *worker = &batch->workers[i];
+        frames[worker->node] += worker->frames;
+        busy_ns[worker->node] += worker->busy_ns;
+        workers[worker->node]++;
+        pinned += worker->cpu >= 0;
+        bound += worker->bound;
+        total += worker->frames;
+    }
+    printf("%s: %10.0f frames/s, %u/%u workers pinned, %u bound to their node\n", pin ? "pinned  " : "floating",
+           total / wall, pinned, batch->worker_count, bound);
+    for (uint8_t node = 0; node < PLACEMENT_MAX_NODES; node++) {
+        if (!workers[node])
+            continue;
+        printf("  node %u: %u workers, %10.0f frames/s, %3.0f%% busy\n", node, workers[node], frames[node] / wall,
+               busy_ns[node] / 1e9 / wall / workers[node] * 100);
+    }
+    stop_batch_workers(batch);
+    return true;
+}
+
+static int bench_placement(const char *romName, const uint32_t envs, const uint32_t steps, const uint32_t threads) {
+    config_t config;
+    set_config(&config, 0, NULL);
+    topology_t topology;
+    read_topology(&topology);
+    printf("%u CPUs on %u NUMA nodes, %u workers, %u envs, %u steps\n", topology.cpu_count, topology.node_count,
+           threads, envs, steps);
+
+    char error[128];
+    batch_t batch;
+    if (!init_batch(&batch, config, romName, envs, 4, OBSERVATION_PACKED, "delta(V0)", NULL, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        return EXIT_FAILURE;
+    }
+    uint16_t *actions = malloc(sizeof(uint16_t) * envs);
+    uint8_t *observations = malloc(observation_size(OBSERVATION_PACKED) * envs);
+    int32_t *rewards = malloc(sizeof(int32_t) * envs);
+    bool *dones = malloc(sizeof(bool) * envs);
+    const bool ran = run_placement(&batch, threads, false, steps, actions, observations, rewards, dones) &&
+                     run_placement(&batch, threads, true, steps, actions, observations, rewards, dones);
+    free(actions);
+    free(observations);
+    free(rewards);
+    free(dones);
+    free_batch(&batch);
+    return ran ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int bench_schedule(const char *romName, const uint32_t instances, const uint32_t threads,
+                          const uint32_t duration) {
+    config_t config;
+    set_config(&config, 0, NULL);
+    static scheduler_t scheduler;
+    if (!init_scheduler(&scheduler, config, romName, instances, threads, 1000000000ULL / 60) ||
+        !start_scheduler(&scheduler)) {
+        fprintf(stderr, "Could not start the scheduler\n");
+        return EXIT_FAILURE;
+    }
+    //one tap a millisecond on a random instance, released the next millisecond
+    const clock_t cpu_start = clock();
+    const double start = seconds();
+    uint32_t tapped = 0;
+    uint8_t key = 0;
+    for (uint32_t ms = 0; seconds() - start < duration; ms++) {
+        if (ms % 2 == 0) {
+            tapped = (uint32_t) rand() % instances;
+            key = (uint8_t) (rand() % 16);
+        }
+        scheduler_key(&scheduler, tapped, key, ms % 2 == 0);
+        const struct timespec millisecond = {.tv_nsec = 1000000};
+        nanosleep(&millisecond, NULL);
+    }
+    scheduler_stats_t stats;
+    scheduler_stats(&scheduler, &stats);
+    stop_scheduler(&scheduler);
+    const double cpu = (double) (clock() - cpu_start) / CLOCKS_PER_SEC;
+    const double wall = seconds() - start;
+
+    printf("%u instances on %u threads for %.1fs, %.2f cores busy\n", instances, threads, wall, cpu / wall);
+    printf("frames: %llu run (%.0f/s), %llu fast-forwarded on the delay timer\n", (unsigned long long) stats.frames,
+           stats.frames / wall, (unsigned long long) stats.skipped_frames);
+    printf("parked now: %u on FX0A, %u on the delay timer; %llu parks, %llu woken by keys\n", stats.waiting_key,
+           stats.waiting_timer, (unsigned long long) stats.parks, (unsigned long long) stats.wakes);
+    printf("start latency: mean %.1f us, p99 < %.1f us, max %.1f us; fairness %.3f\n", stats.latency_mean_us,
+           stats.latency_p99_us, stats.latency_max_us, stats.fairness);
+    free_scheduler(&scheduler);
+    return EXIT_SUCCESS;
+}
+#endif
+
+static int bench_savestate(const char *romName, const uint32_t frames) {
+    config_t config;
+    set_config(&config, 0, NULL);
+    static chip8_t chip8;
+    if (!init_chip8(&chip8, config, romName))
+        return EXIT_FAILURE;
+    uint8_t *states = malloc((size_t) frames * SAVESTATE_MAX_SIZE);
+    size_t *sizes = malloc(sizeof(size_t) * frames);
+    uint64_t *hashes = malloc(sizeof(uint64_t) * frames);
+    if (!states || !sizes || !hashes) {
+        free(states);
+        free(sizes);
+        free(hashes);
+        return EXIT_FAILURE;
+    }
+
+    //the same run saved both ways, a key held now and then so the display keeps changing
+    static const char *formats[] = {"raw:", "compressed:"};
+    int status = EXIT_SUCCESS;
+    for (uint8_t compress = 0; compress < 2 && status == EXIT_SUCCESS; compress++) {
+        init_chip8(&chip8, config, romName);
+        size_t total = 0;
+        double save = 0;
+        for (uint32_t frame = 0; frame < frames; frame++) {
+            memset(chip8.keypad, 0, sizeof(chip8.keypad));
+            chip8.keypad[frame / 30 % 16] = frame % 30 < 10;
+            run_frame(&chip8, config);
+            hashes[frame] = state_hash(&chip8);
+            const double start = seconds();
+            sizes[frame] = save_state(&chip8, states + (size_t) frame * SAVESTATE_MAX_SIZE, SAVESTATE_MAX_SIZE,
+                                      compress);
+            save += seconds() - start;
+            total += sizes[frame];
+        }
+
+        const double start = seconds();
+        for (uint32_t frame = 0; frame < frames; frame++) {
+            if (!load_state(&chip8, states + (size_t) frame * SAVESTATE_MAX_SIZE, sizes[frame]) ||
+                state_hash(&chip8) != hashes[frame]) {
+                fprintf(stderr, "Frame %u did not load back\n", frame);
+                status = EXIT_FAILURE;
+                break;
+            }
+        }
+        const double load = seconds() - start;
+        printf("  %-12s %7.0f bytes/state (%5.1f%% of raw), save %6.2f us, load %6.2f us\n", formats[compress],
+               (double) total / frames, 100.0 * total / ((double) frames * SAVESTATE_MAX_SIZE), save * 1e6 / frames,
+               load * 1e6 / frames);
+    }
+    free(states);
+    free(sizes);
+    free(hashes);
+    return status;
+}
+
+#ifndef _WIN32
+static uint64_t batch_hash(const batch_t *batch) {
+    uint64_t hash = 0;
+    for (uint32_t env = 0; env < batch->size; env++) {
+        const uint64_t state = state_hash(&batch->machines[env]);
+        hash = hash_bytes(&state, sizeof(state), hash);
+    }
+    return hash;
+}
+
+//steps the batch with random key presses and checkpoints it every few steps. With wait every
+//checkpoint is written and synced before the run goes on, as it would be without the writer thread.
+//hashes gets the batch_hash() of the last two checkpoints, newest first.
+static double run_checkpointed(batch_t *batch, checkpoint_writer_t *writer, const uint32_t steps,
+                               const uint32_t every, const bool wait, uint64_t hashes[2]) {
+    uint16_t *actions = malloc(sizeof(uint16_t) * batch->size);
+    uint8_t *observations = malloc(observation_size(batch->format) * batch->size);
+    int32_t *rewards = malloc(sizeof(int32_t) * batch->size);
+    bool *dones = malloc(sizeof(bool) * batch->size);
+    for (uint32_t env = 0; env < batch->size; env++)
+        reset_batch_env(batch, env);
+    srand(1);
+    const double start = seconds();
+    for (uint32_t step = 1; step <= steps; step++) {
+        for (uint32_t env = 0; env < batch->size; env++)
+            actions[env] = (uint16_t) (1 << (rand() % 16));
+        step_batch(batch, actions, observations, rewards, dones);
+        if (step % every == 0) {
+            hashes[1] = hashes[0];
+            hashes[0] = batch_hash(batch);
+            checkpoint_batch(writer, batch, step);
+            if (wait)
+                flush_checkpoints(writer);
+        }
+    }
+    flush_checkpoints(writer);
+    const double elapsed = seconds() - start;
+    free(actions);
+    free(observations);
+    free(rewards);
+    free(dones);
+    return elapsed;
+}
+
+static int bench_checkpoint(const char *romName, const char *dir, const uint32_t envs, const uint32_t steps,
+                            const uint32_t every) {
+    config_t config;
+    set_config(&config, 0, NULL);
+    char error[128];
+    batch_t batch;
+    if (!init_batch(&batch, config, romName, envs, 4, OBSERVATION_PACKED, "delta(V0)", NULL, error, sizeof(error))) {
+        fprintf(stderr, "%s\n", error);
+        return EXIT_FAILURE;
+    }
+    printf("%u envs, %u steps, a checkpoint every %u, synced\n", envs, steps, every);
+    static const char *modes[] = {"written in the run:", "writer thread:"};
+    uint64_t hashes[2] = {0};
+    for (uint8_t mode = 0; mode < 2; mode++) {
+        checkpoint_writer_t writer;
+        if (!init_checkpoint_writer(&writer, dir, 8, 1 << 20, 1, 2)) {
+            free_batch(&batch);
+            return EXIT_FAILURE;
+        }
+        const double elapsed = run_checkpointed(&batch, &writer, steps, every, mode == 0, hashes);
+        checkpoint_stats_t stats;
+        checkpoint_stats(&writer, &stats);
+        free_checkpoint_writer(&writer);
+        printf("  %-20s %8.0f env steps/s, %llu checkpoints of %.0f KB in %llu writes, run stalled %.1f ms, "
+               "writer busy %.1f ms\n", modes[mode], envs * steps / elapsed, (unsigned long long) stats.checkpoints,
+               stats.checkpoints ? stats.bytes / 1024.0 / stats.checkpoints : 0.0, (unsigned long long) stats.writes,
+               mode == 0 ? stats.write_ms : stats.stall_ms, stats.write_ms);
+    }
+
+    //the newest checkpoint, then the one before once the newest lost its end as in a crash
+    const uint64_t last = steps / every * every;
+    int status = EXIT_SUCCESS;
+    for (uint8_t crashed = 0; crashed < 2 && last >= every * (crashed + 1u); crashed++) {
+        if (crashed) {
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/checkpoint-%020llu.ckpt", dir, (unsigned long long) last);
+            struct stat file;
+            if (stat(path, &file) != 0 || truncate(path, file.st_size / 2) != 0) {
+                fprintf(stderr, "Could not cut %s short\n", path);
+                break;
+            }
+        }
+        uint64_t step = 0;
+        const double start = seconds();
+        const bool resumed = resume_batch(&batch, dir, &step);
+        const double elapsed = seconds() - start;
+        const bool intact = resumed && step == last - crashed * every && batch_hash(&batch) == hashes[crashed];
+        printf("  resumed at step %llu in %.1f ms, %s\n", (unsigned long long) step, elapsed * 1e3,
+               intact ? "every env as checkpointed" : "NOT as checkpointed");
+        if (!intact)
+            status = EXIT_FAILURE;
+    }
+    free_batch(&batch);
+    return status;
+}
+#endif
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "hash") == 0) {
+        const uint32_t steps = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000000;
+        exit(bench_hash(argv[2], steps));
+    }
+    if (argc >= 3 && strcmp(argv[1], "batch") == 0) {
+        const uint32_t envs = argc > 3 ? strtoul(argv[3], NULL, 10) : 64;
+        const uint32_t steps = argc > 4 ? strtoul(argv[4], NULL, 10) : 1000;
+        const uint32_t frame_skip = argc > 5 ? strtoul(argv[5], NULL, 10) : 4;
+        exit(bench_batch(argv[2], envs, steps, frame_skip));
+    }
+    if (argc >= 3 && strcmp(argv[1], "observe") == 0) {
+        const uint32_t count = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000000;
+        exit(bench_observe(argv[2], count));
+    }
+    if (argc >= 3 && strcmp(argv[1], "corpus") == 0)
+        exit(bench_corpus(argv[2], argc > 3 ? argv[3] : NULL));
+    if (argc >= 3 && strcmp(argv[1], "arena") == 0) {
+        const uint32_t frames = argc > 3 ? strtoul(argv[3], NULL, 10) : 600;
+        exit(bench_arena(argv[2], frames));
+    }
+    if (argc >= 3 && strcmp(argv[1], "savestate") == 0) {
+        const uint32_t frames = argc > 3 ? strtoul(argv[3], NULL, 10) : 600;
+        exit(bench_savestate(argv[2], frames ? frames : 1));
+    }
+#ifndef _WIN32
+    if (argc >= 3 && strcmp(argv[1], "placement") == 0) {
+        const uint32_t envs = argc > 3 ? strtoul(argv[3], NULL, 10) : 10000;
+        const uint32_t steps = argc > 4 ? strtoul(argv[4], NULL, 10) : 100;
+        const uint32_t threads = argc > 5 ? strtoul(argv[5], NULL, 10) : 4;
+        exit(bench_placement(argv[2], envs, steps, threads ? threads : 1));
+    }
+    if (argc >= 3 && strcmp(argv[1], "schedule") == 0) {
+        const uint32_t instances = argc > 3 ? strtoul(argv[3], NULL, 10) : 10000;
+        const uint32_t threads = argc > 4 ? strtoul(argv[4], NULL, 10) : 4;
+        const uint32_t duration = argc > 5 ? strtoul(argv[5], NULL, 10) : 5;
+        exit(bench_schedule(argv[2], instances ? instances : 1, threads, duration));
+    }
+    if (argc >= 4 && strcmp(argv[1], "checkpoint") == 0) {
+        const uint32_t envs = argc > 4 ? strtoul(argv[4], NULL, 10) : 1000;
+        const uint32_t steps = argc > 5 ? strtoul(argv[5], NULL, 10) : 1000;
+        const uint32_t every = argc > 6 ? strtoul(argv[6], NULL, 10) : 100;
+        exit(bench_checkpoint(argv[2], argv[3], envs ? envs : 1, steps, every ? every : 1));
+    }
+#endif
+    fprintf(stderr, "Usage: %s hash <rom-path> [steps]\n"
+                    "       %s batch <rom-path> [envs] [steps] [frame skip]\n"
+                    "       %s observe <rom-path> [count]\n"
+                    "       %s schedule <rom-path> [instances] [threads] [seconds]\n"
+                    "       %s arena <rom-path> [frames]\n"
+                    "       %s corpus <pack> [unpacked-dir]\n"
+                    "       %s placement <rom-path> [envs] [steps] [threads]\n"
+                    "       %s savestate <rom-path> [frames]\n"
+                    "       %s checkpoint <rom-path> <dir> [envs] [steps] [every]\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ram_search.h"
+
+//chip8_cheat: headless RAM search, for finding e.g. score and lives addresses. Reads commands from
+//a script or stdin, so it can be typed at interactively or driven by a config:
+//  run <frames> [keys]   run frames holding the given keys (hex digits, e.g. 5 or 46)
+//  equal | changed | increased | decreased | value <n>
+//                        keep the candidates whose byte relates to the last filter (or start) as given
+//  list [n]              print up to n candidates with their current values
+//  restart               every address is a candidate again
+//  quit
+
+#define LIST_DEFAULT 32
+
+void list_candidates(const ram_search_t *search, const chip8_t *chip8, const uint32_t max) {
+    static uint16_t addresses[RAM_SEARCH_SIZE];
+    const uint32_t count = ram_candidates(search, addresses, max < RAM_SEARCH_SIZE ? max : RAM_SEARCH_SIZE);
+    for (uint32_t i = 0; i < count; i++)
+        printf("0x%03X = %3u (0x%02X)\n", addresses[i], chip8->ram[addresses[i]], chip8->ram[addresses[i]]);
+    if (search->count > count)
+        printf("... %u more\n", search->count - count);
+}
+
+bool run_frames(chip8_t *chip8, const config_t config, const uint32_t frames, const char *keys) {
+    memset(chip8->keypad, false, sizeof(chip8->keypad));
+    for (const char *key = keys; key && *key; key++) {
+        const char digit[] = {*key, '\0'};
+        char *end;
+        const unsigned long value = strtoul(digit, &end, 16);
+        if (*end != '\0') {
+            fprintf(stderr, "Invalid key %c\n", *key);
+            return false;
+        }
+        chip8->keypad[value] = true;
+    }
+    for (uint32_t frame = 0; frame < frames; frame++)
+        run_frame(chip8, config);
+    memset(chip8->keypad, false, sizeof(chip8->keypad));
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <rom-path> [script] [--seed N]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    config_t config;
+    set_config(&config, argc, argv);
+    static chip8_t chip8;
+    if (!init_chip8(&chip8, config, argv[1]))
+        exit(EXIT_FAILURE);
+    FILE *script = stdin;
+    if (argc > 2 && strncmp(argv[2], "--", 2) != 0) {
+        script = fopen(argv[2], "r");
+        if (!script) {
+            fprintf(stderr, "Could not open %s\n", argv[2]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    static ram_search_t search;
+    start_ram_search(&search, &chip8);
+    char line[256];
+    while (fgets(line, sizeof(line), script)) {
+        char command[32] = "";
+        char argument[32] = "";
+        char keys[32] = "";
+        if (sscanf(line, "%31s %31s %31s", command, argument, keys) < 1 || command[0] == '#')
+            continue;
+        ram_relation_t relation;
+        if (strcmp(command, "quit") == 0) {
+            break;
+        } else if (strcmp(command, "run") == 0) {
+            if (!run_frames(&chip8, config, (uint32_t) strtoul(argument, NULL, 10), keys))
+                continue;
+        } else if (strcmp(command, "restart") == 0) {
+            start_ram_search(&search, &chip8);
+            printf("%u candidates\n", search.count);
+        } else if (strcmp(command, "list") == 0) {
+            list_candidates(&search, &chip8, argument[0] ? (uint32_t) strtoul(argument, NULL, 0) : LIST_DEFAULT);
+        } else if (parse_ram_relation(command, &relation)) {
+            const uint8_t value = (uint8_t) strtoul(argument, NULL, 0);
+            printf("%u candidates\n", filter_ram_search(&search, &chip8, relation, value));
+        } else {
+            fprintf(stderr, "Unknown command %s\n", command);
+        }
+    }
+    if (script != stdin)
+        fclose(script);
+    exit(EXIT_SUCCESS);
+}
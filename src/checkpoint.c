@@ -0,0 +1,497 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+#define CHECKPOINT_PREFIX "checkpoint-"
+#define CHECKPOINT_SUFFIX ".ckpt"
+#define CHECKPOINT_TMP_SUFFIX ".ckpt.tmp"
+//buffers the writer takes off the queue at once, the most one writev() gathers
+#define CHECKPOINT_WRITE_BATCH 64
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void checkpoint_path(char *path, const size_t size, const char *dir, const uint64_t step, const bool tmp) {
+    snprintf(path, size, "%s/" CHECKPOINT_PREFIX "%020llu%s", dir, (unsigned long long) step,
+             tmp ? CHECKPOINT_TMP_SUFFIX : CHECKPOINT_SUFFIX);
+}
+
+//the step of a file named like a checkpoint, ending in suffix
+static bool parse_checkpoint_name(const char *name, const char *suffix, uint64_t *step) {
+    const size_t prefix_length = strlen(CHECKPOINT_PREFIX);
+    if (strncmp(name, CHECKPOINT_PREFIX, prefix_length) != 0 || name[prefix_length] < '0' ||
+        name[prefix_length] > '9')
+        return false;
+    char *end;
+    *step = strtoull(name + prefix_length, &end, 10);
+    return strcmp(end, suffix) == 0;
+}
+
+static int compare_steps(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *) a;
+    const uint64_t y = *(const uint64_t *) b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+//steps of the files in dir ending in suffix, newest first. The caller frees *steps.
+static bool list_checkpoints(const char *dir, const char *suffix, uint64_t **steps, uint32_t *count) {
+    *steps = NULL;
+    *count = 0;
+    DIR *listing = opendir(dir);
+    if (!listing)
+        return false;
+    uint32_t capacity = 0;
+    bool ok = true;
+    const struct dirent *entry;
+    while (ok && (entry = readdir(listing))) {
+        uint64_t step;
+        if (!parse_checkpoint_name(entry->d_name, suffix, &step))
+            continue;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            uint64_t *grown = realloc(*steps, sizeof(uint64_t) * capacity);
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            *steps = grown;
+        }
+        (*steps)[(*count)++] = step;
+    }
+    closedir(listing);
+    if (ok && *count)
+        qsort(*steps, *count, sizeof(uint64_t), compare_steps);
+    return ok;
+}
+
+//deletes every checkpoint but the newest keep
+static void prune_checkpoints(checkpoint_writer_t *writer) {
+    uint64_t *steps;
+    uint32_t count;
+    if (!list_checkpoints(writer->dir, CHECKPOINT_SUFFIX, &steps, &count)) {
+        free(steps);
+        return;
+    }
+    for (uint32_t i = writer->keep; i < count; i++) {
+        char path[4096];
+        checkpoint_path(path, sizeof(path), writer->dir, steps[i], false);
+        unlink(path);
+    }
+    free(steps);
+}
+
+static void fail_checkpoint(checkpoint_writer_t *writer, const char *what) {
+    fprintf(stderr, "Could not %s checkpoint %llu in %s: %s\n", what, (unsigned long long) writer->fd_step,
+            writer->dir, strerror(errno));
+    writer->discarding = true;
+    pthread_mutex_lock(&writer->lock);
+    writer->failures++;
+    pthread_mutex_unlock(&writer->lock);
+}
+
+static void begin_file(checkpoint_writer_t *writer, const uint64_t step) {
+    char path[4096];
+    if (writer->fd >= 0) {
+        close(writer->fd);
+        checkpoint_path(path, sizeof(path), writer->dir, writer->fd_step, true);
+        unlink(path);
+    }
+    writer->fd_step = step;
+    writer->discarding = false;
+    writer->started++;
+    checkpoint_path(path, sizeof(path), writer->dir, step, true);
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0)
+        fail_checkpoint(writer, "create");
+}
+
+static bool write_all(const int fd, struct iovec *iov, uint32_t count) {
+    while (count) {
+        const ssize_t written = writev(fd, iov, (int) count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        //a short write continues where it stopped
+        size_t left = (size_t) written;
+        while (count && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count) {
+            iov->iov_base = (uint8_t *) iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+//syncs the file as the policy asks and renames it into place, or drops it if writing it failed
+static void finish_file(checkpoint_writer_t *writer) {
+    char tmp[4096];
+    char path[4096];
+    checkpoint_path(tmp, sizeof(tmp), writer->dir, writer->fd_step, true);
+    checkpoint_path(path, sizeof(path), writer->dir, writer->fd_step, false);
+    const bool sync = !writer->discarding && writer->sync_every && writer->started % writer->sync_every == 0;
+    if (!writer->discarding && sync && fsync(writer->fd) != 0)
+        fail_checkpoint(writer, "sync");
+    if (writer->fd >= 0 && close(writer->fd) != 0 && !writer->discarding)
+        fail_checkpoint(writer, "close");
+    writer->fd = -1;
+    if (writer->discarding) {
+        unlink(tmp);
+        writer->discarding = false;
+        return;
+    }
+    if (rename(tmp, path) != 0) {
+        fail_checkpoint(writer, "rename");
+        unlink(tmp);
+        writer->discarding = false;
+        return;
+    }
+    //the rename is only durable once the directory is
+    if (sync) {
+        const int dir = open(writer->dir, O_RDONLY | O_CLOEXEC);
+        if (dir >= 0) {
+            fsync(dir);
+            close(dir);
+        }
+    }
+    //only a synced checkpoint is sure to survive a crash, so older ones are only deleted once the newest
+    //is synced; with sync_every the unsynced ones in between pile up until then
+    if (sync || !writer->sync_every)
+        prune_checkpoints(writer);
+    pthread_mutex_lock(&writer->lock);
+    writer->checkpoints++;
+    writer->syncs += sync;
+    pthread_mutex_unlock(&writer->lock);
+}
+
+//writes the buffers taken off the queue, the ones belonging to one checkpoint with one writev()
+static void write_buffers(checkpoint_writer_t *writer, const uint32_t *ids, const uint32_t count) {
+    uint32_t i = 0;
+    while (i < count) {
+        if (writer->buffers[ids[i]].first)
+            begin_file(writer, writer->buffers[ids[i]].step);
+        struct iovec iov[CHECKPOINT_WRITE_BATCH];
+        uint32_t gathered = 0;
+        size_t bytes = 0;
+        bool last = false;
+        for (; i < count && !last; i++) {
+            const checkpoint_buffer_t *buffer = &writer->buffers[ids[i]];
+            if (gathered && buffer->first)
+                break;
+            iov[gathered++] = (struct iovec) {.iov_base = buffer->data, .iov_len = buffer->used};
+            bytes += buffer->used;
+            last = buffer->last;
+        }
+        if (!writer->discarding) {
+            if (write_all(writer->fd, iov, gathered)) {
+                pthread_mutex_lock(&writer->lock);
+                writer->bytes += bytes;
+                writer->writes++;
+                pthread_mutex_unlock(&writer->lock);
+            } else {
+                fail_checkpoint(writer, "write");
+            }
+        }
+        if (last)
+            finish_file(writer);
+    }
+}
+
+static void *checkpoint_thread(void *data) {
+    checkpoint_writer_t *writer = (checkpoint_writer_t *) data;
+    uint32_t ids[CHECKPOINT_WRITE_BATCH];
+    for (;;) {
+        pthread_mutex_lock(&writer->lock);
+        while (!writer->queue_count && !writer->stopping)
+            pthread_cond_wait(&writer->filled, &writer->lock);
+        //whatever is queued is still written when stopping
+        if (!writer->queue_count) {
+            pthread_mutex_unlock(&writer->lock);
+            return NULL;
+        }
+        const uint32_t count = writer->queue_count < CHECKPOINT_WRITE_BATCH ? writer->queue_count
+                                                                            : CHECKPOINT_WRITE_BATCH;
+        for (uint32_t i = 0; i < count; i++)
+            ids[i] = writer->queue[(writer->queue_head + i) % writer->buffer_count];
+        writer->queue_head = (writer->queue_head + count) % writer->buffer_count;
+        writer->queue_count -= count;
+        writer->writing += count;
+        pthread_mutex_unlock(&writer->lock);
+
+        const uint64_t start = now_ns();
+        write_buffers(writer, ids, count);
+        const uint64_t elapsed = now_ns() - start;
+
+        pthread_mutex_lock(&writer->lock);
+        writer->write_ns += elapsed;
+        for (uint32_t i = 0; i < count; i++)
+            writer->free_buffers[writer->free_count++] = ids[i];
+        writer->writing -= count;
+        pthread_cond_broadcast(&writer->emptied);
+        pthread_mutex_unlock(&writer->lock);
+    }
+}
+
+//checkpoints batches into dir, created if missing, through buffers of buffer_size bytes. Temporary
+//files a crashed run left behind are removed.
+bool init_checkpoint_writer(checkpoint_writer_t *writer, const char *dir, const uint32_t buffers,
+                            const size_t buffer_size, const uint32_t sync_every, const uint32_t keep) {
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+    if (buffers < 2 || buffer_size < CHECKPOINT_MIN_BUFFER) {
+        fprintf(stderr, "Checkpoints need at least 2 buffers of %zu bytes\n", (size_t) CHECKPOINT_MIN_BUFFER);
+        return false;
+    }
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create %s: %s\n", dir, strerror(errno));
+        return false;
+    }
+    uint64_t *steps;
+    uint32_t count;
+    if (list_checkpoints(dir, CHECKPOINT_TMP_SUFFIX, &steps, &count)) {
+        for (uint32_t i = 0; i < count; i++) {
+            char path[4096];
+            checkpoint_path(path, sizeof(path), dir, steps[i], true);
+            unlink(path);
+        }
+    }
+    free(steps);
+
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->filled, NULL);
+    pthread_cond_init(&writer->emptied, NULL);
+    writer->sync_every = sync_every;
+    writer->keep = keep ? keep : 1;
+    writer->buffer_count = buffers;
+    writer->buffer_size = buffer_size;
+    writer->dir = strdup(dir);
+    writer->buffers = calloc(buffers, sizeof(checkpoint_buffer_t));
+    writer->free_buffers = malloc(sizeof(uint32_t) * buffers);
+    writer->queue = malloc(sizeof(uint32_t) * buffers);
+    bool ok = writer->dir && writer->buffers && writer->free_buffers && writer->queue;
+    for (uint32_t i = 0; ok && i < buffers; i++) {
+        writer->buffers[i].data = malloc(buffer_size);
+        ok = writer->buffers[i].data != NULL;
+        writer->free_buffers[writer->free_count++] = i;
+    }
+    if (!ok || pthread_create(&writer->thread, NULL, checkpoint_thread, writer) != 0) {
+        fprintf(stderr, "Could not start the checkpoint writer\n");
+        writer->stopping = true;
+        free_checkpoint_writer(writer);
+        return false;
+    }
+
+    return true;
+}
+
+static uint32_t take_buffer(checkpoint_writer_t *writer, const uint64_t step) {
+    pthread_mutex_lock(&writer->lock);
+    if (!writer->free_count) {
+        const uint64_t start = now_ns();
+        while (!writer->free_count)
+            pthread_cond_wait(&writer->emptied, &writer->lock);
+        writer->stall_ns += now_ns() - start;
+    }
+    const uint32_t id = writer->free_buffers[--writer->free_count];
+    pthread_mutex_unlock(&writer->lock);
+    writer->buffers[id] = (checkpoint_buffer_t) {.data = writer->buffers[id].data, .step = step};
+    return id;
+}
+
+static void queue_buffer(checkpoint_writer_t *writer, const uint32_t id) {
+    pthread_mutex_lock(&writer->lock);
+    writer->queue[(writer->queue_head + writer->queue_count) % writer->buffer_count] = id;
+    writer->queue_count++;
+    pthread_cond_signal(&writer->filled);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+//copies bytes to the end of the checkpoint, queueing the buffer and taking the next when it is full
+static void append(checkpoint_writer_t *writer, uint32_t *id, const void *bytes, const size_t size) {
+    checkpoint_buffer_t *buffer = &writer->buffers[*id];
+    if (writer->buffer_size - buffer->used < size) {
+        queue_buffer(writer, *id);
+        *id = take_buffer(writer, buffer->step);
+        buffer = &writer->buffers[*id];
+    }
+    memcpy(buffer->data + buffer->used, bytes, size);
+    buffer->used += size;
+}
+
+//serializes every env of batch as the checkpoint of step. Returns once the envs are copied, the
+//writer thread writes them out while the run goes on; only a full pool makes this wait.
+void checkpoint_batch(checkpoint_writer_t *writer, const batch_t *batch, const uint64_t step) {
+    uint32_t id = take_buffer(writer, step);
+    writer->buffers[id].first = true;
+    const checkpoint_header_t header = {
+            .magic = CHECKPOINT_MAGIC,
+            .version = CHECKPOINT_VERSION,
+            .byte_order = CHECKPOINT_BYTE_ORDER,
+            .count = batch->size,
+            .step = step,
+    };
+    append(writer, &id, &header, sizeof(header));
+    uint64_t size = sizeof(header);
+
+    for (uint32_t env = 0; env < batch->size; env++) {
+        //the state is saved straight into the buffer, behind its record
+        checkpoint_buffer_t *buffer = &writer->buffers[id];
+        if (writer->buffer_size - buffer->used < sizeof(checkpoint_record_t) + SAVESTATE_MAX_SIZE) {
+            queue_buffer(writer, id);
+            id = take_buffer(writer, step);
+            buffer = &writer->buffers[id];
+        }
+        uint8_t *at = buffer->data + buffer->used;
+        const checkpoint_record_t record = {
+                .size = (uint32_t) save_state(&batch->machines[env], at + sizeof(record), SAVESTATE_MAX_SIZE, true),
+                .done = batch->done[env],
+        };
+        memcpy(at, &record, sizeof(record));
+        buffer->used += sizeof(record) + record.size;
+        size += sizeof(record) + record.size;
+    }
+
+    checkpoint_trailer_t trailer = {.magic = CHECKPOINT_END_MAGIC, .count = batch->size, .size = size};
+    append(writer, &id, &trailer, sizeof(trailer));
+    writer->buffers[id].last = true;
+    queue_buffer(writer, id);
+}
+
+//waits until every checkpoint queued so far is written
+void flush_checkpoints(checkpoint_writer_t *writer) {
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queue_count || writer->writing)
+        pthread_cond_wait(&writer->emptied, &writer->lock);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+//writes out what is queued and stops the writer
+void free_checkpoint_writer(checkpoint_writer_t *writer) {
+    if (!writer->stopping) {
+        pthread_mutex_lock(&writer->lock);
+        writer->stopping = true;
+        pthread_cond_signal(&writer->filled);
+        pthread_mutex_unlock(&writer->lock);
+        pthread_join(writer->thread, NULL);
+    }
+    for (uint32_t i = 0; writer->buffers && i < writer->buffer_count; i++)
+        free(writer->buffers[i].data);
+    free(writer->buffers);
+    free(writer->free_buffers);
+    free(writer->queue);
+    free(writer->dir);
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->filled);
+    pthread_cond_destroy(&writer->emptied);
+    writer->buffers = NULL;
+}
+
+void checkpoint_stats(checkpoint_writer_t *writer, checkpoint_stats_t *stats) {
+    pthread_mutex_lock(&writer->lock);
+    *stats = (checkpoint_stats_t) {
+            .checkpoints = writer->checkpoints,
+            .failures = writer->failures,
+            .bytes = writer->bytes,
+            .writes = writer->writes,
+            .syncs = writer->syncs,
+            .stall_ms = writer->stall_ns / 1e6,
+            .write_ms = writer->write_ns / 1e6,
+    };
+    pthread_mutex_unlock(&writer->lock);
+}
+
+//loads the envs of the batch, which has to be the same size, from a complete checkpoint. A damaged
+//one leaves every env reset.
+static bool load_records(batch_t *batch, const uint8_t *data, const size_t size, uint64_t *step) {
+    checkpoint_header_t header;
+    checkpoint_trailer_t trailer;
+    if (size < sizeof(header) + sizeof(trailer))
+        return false;
+    memcpy(&header, data, sizeof(header));
+    memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.version != CHECKPOINT_VERSION ||
+        header.byte_order != CHECKPOINT_BYTE_ORDER || header.count != batch->size ||
+        memcmp(trailer.magic, CHECKPOINT_END_MAGIC, sizeof(trailer.magic)) != 0 || trailer.count != header.count ||
+        trailer.size != size - sizeof(trailer))
+        return false;
+
+    size_t at = sizeof(header);
+    const size_t end = size - sizeof(trailer);
+    for (uint32_t env = 0; env < batch->size; env++) {
+        checkpoint_record_t record;
+        if (end - at < sizeof(record))
+            return false;
+        memcpy(&record, data + at, sizeof(record));
+        at += sizeof(record);
+        if (end - at < record.size || record.done > 1 ||
+            !load_state(&batch->machines[env], data + at, record.size))
+            return false;
+        at += record.size;
+        batch->done[env] = record.done;
+    }
+    if (at != end)
+        return false;
+    //conditions compare against the values at the last evaluation, which were the checkpointed ones
+    for (uint32_t env = 0; env < batch->size; env++) {
+        prime_condition(&batch->rewards[env], &batch->machines[env]);
+        prime_condition(&batch->dones[env], &batch->machines[env]);
+    }
+    *step = header.step;
+    return true;
+}
+
+bool load_checkpoint(batch_t *batch, const char *path, uint64_t *step) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    const size_t size = (size_t) status.st_size;
+    void *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    const bool loaded = load_records(batch, data, size, step);
+    munmap(data, size);
+    if (!loaded) {
+        for (uint32_t env = 0; env < batch->size; env++)
+            reset_batch_env(batch, env);
+    }
+    return loaded;
+}
+
+//loads the newest complete checkpoint in dir, false (and every env reset) if there is none
+bool resume_batch(batch_t *batch, const char *dir, uint64_t *step) {
+    uint64_t *steps;
+    uint32_t count;
+    list_checkpoints(dir, CHECKPOINT_SUFFIX, &steps, &count);
+    bool loaded = false;
+    for (uint32_t i = 0; i < count && !loaded; i++) {
+        char path[4096];
+        checkpoint_path(path, sizeof(path), dir, steps[i], false);
+        loaded = load_checkpoint(batch, path, step);
+        if (!loaded)
+            fprintf(stderr, "%s is incomplete or damaged, trying an older checkpoint\n", path);
+    }
+    free(steps);
+    return loaded;
+}
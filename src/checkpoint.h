@@ -0,0 +1,109 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <pthread.h>
+#include "batch.h"
+#include "savestate.h"
+
+#define CHECKPOINT_MAGIC "CHIP8CKP"
+#define CHECKPOINT_END_MAGIC "CKPT-END"
+#define CHECKPOINT_VERSION 1
+#define CHECKPOINT_BYTE_ORDER 0x01020304u
+
+//A checkpoint of a batch: every env's save state and done flag at one step of the run, in
+//<dir>/checkpoint-<step>.ckpt.
+//  header    checkpoint_header_t
+//  records   count times a checkpoint_record_t followed by the env's save state
+//  trailer   checkpoint_trailer_t
+//A checkpoint is written to a .tmp file and only renamed once complete, the trailer tells one that
+//was renamed before the system lost its data apart. resume_batch() goes back to the newest intact one.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t count; // envs
+    uint32_t reserved;
+    uint64_t step;
+} checkpoint_header_t;
+
+typedef struct {
+    uint32_t size; // of the save state following it
+    uint8_t done;
+    uint8_t reserved[3];
+} checkpoint_record_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t size; // of the file up to the trailer
+} checkpoint_trailer_t;
+
+//the smallest buffer every record fits in
+#define CHECKPOINT_MIN_BUFFER (sizeof(checkpoint_header_t) + sizeof(checkpoint_record_t) + SAVESTATE_MAX_SIZE)
+
+//a pooled buffer of consecutive checkpoint bytes
+typedef struct {
+    uint8_t *data;
+    size_t used;
+    uint64_t step;
+    bool first; // starts the checkpoint of step
+    bool last;  // completes it
+} checkpoint_buffer_t;
+
+//Checkpoints written in the background. checkpoint_batch() serializes the envs into buffers from a
+//fixed pool and queues them, a writer thread writes whatever is queued with one writev() at a time.
+//The run only waits when every buffer is still queued, the pool bounds the memory checkpoints take.
+typedef struct {
+    char *dir;
+    uint32_t sync_every; // fsync every nth checkpoint (and the directory once it is renamed), 0 never
+    uint32_t keep;       // newest complete checkpoints kept, older ones are deleted once the newest is synced
+    checkpoint_buffer_t *buffers;
+    uint32_t buffer_count;
+    size_t buffer_size;
+    uint32_t *free_buffers;
+    uint32_t free_count;
+    uint32_t *queue;     // filled buffers, in the order they are written
+    uint32_t queue_head;
+    uint32_t queue_count;
+    uint32_t writing;    // buffers taken off the queue and not returned yet
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t filled;  // a buffer was queued, or stopping
+    pthread_cond_t emptied; // a buffer was returned to the pool
+    bool stopping;
+    //owned by the writer thread
+    int fd;
+    uint64_t fd_step;
+    bool discarding;     // the checkpoint being written failed, the rest of its buffers are dropped
+    uint64_t started;    // checkpoints begun, for sync_every
+    //statistics, under lock
+    uint64_t checkpoints;
+    uint64_t failures;
+    uint64_t bytes;
+    uint64_t writes;
+    uint64_t syncs;
+    uint64_t stall_ns;   // checkpoint_batch() waited for a free buffer
+    uint64_t write_ns;   // the writer spent in writev, fsync and rename
+} checkpoint_writer_t;
+
+typedef struct {
+    uint64_t checkpoints; // completed
+    uint64_t failures;
+    uint64_t bytes;
+    uint64_t writes;      // writev calls
+    uint64_t syncs;
+    double stall_ms;
+    double write_ms;
+} checkpoint_stats_t;
+
+bool init_checkpoint_writer(checkpoint_writer_t *writer, const char *dir, const uint32_t buffers,
+                            const size_t buffer_size, const uint32_t sync_every, const uint32_t keep);
+void checkpoint_batch(checkpoint_writer_t *writer, const batch_t *batch, const uint64_t step);
+void flush_checkpoints(checkpoint_writer_t *writer);
+void free_checkpoint_writer(checkpoint_writer_t *writer);
+void checkpoint_stats(checkpoint_writer_t *writer, checkpoint_stats_t *stats);
+bool load_checkpoint(batch_t *batch, const char *path, uint64_t *step);
+bool resume_batch(batch_t *batch, const char *dir, uint64_t *step);
+
+#endif
@@ -2,6 +2,12 @@
 #include "SDL2/SDL.h"
 #include "stdint.h"
 #include "time.h"
+#include "chip8.h"
+#include "ram_search.h"
+#include "savestate.h"
+#ifndef _WIN32
+#include "rollback.h"
+#endif
 
 //sdl struct
 typedef struct {
@@ -11,64 +17,132 @@ typedef struct {
     SDL_AudioDeviceID dev;
 } sdl_t;
 
-//CHIP8 Extension
-typedef enum {
-    CHIP8,
-    SUPERCHIP,
-    XOCHIP,
-} extension_t;
+//render-only state: the colour every pixel is fading towards the foreground. Sized for the largest
+//display (SCHIP/XO-CHIP high resolution), pixels are indexed row by row across the active one.
+#define RENDER_WIDTH 128
+#define RENDER_HEIGHT 64
+typedef struct {
+    uint32_t pixel_color[RENDER_WIDTH * RENDER_HEIGHT];
+    uint64_t display_hash; // the machine's display_hash when the last frame was published
+} render_t;
+
+//frame published by the emulation thread, ready to be presented
+typedef struct {
+    bool display[RENDER_WIDTH * RENDER_HEIGHT];
+    uint32_t pixel_color[RENDER_WIDTH * RENDER_HEIGHT];
+} frame_t;
 
-//config stuff
+//lock-free triple buffer: the emulation thread fills back, the render thread reads front,
+//and the two swap their buffer with middle through a single atomic exchange
+#define FRAME_DIRTY 0x4
 typedef struct {
-    uint32_t windowWidth;
-    uint32_t windowHeight;
-    uint32_t fgColor;
-    uint32_t bgColor;
-    uint32_t scaleFactor;
-    bool pixelOutlines;
-    uint32_t insts_per_second;
-    uint32_t square_wave_freq;
-    uint32_t audio_sample_rate;
-    int16_t volume;
-    float color_lerp_rate;
-    extension_t extension;
-} config_t;
-
-//emulator states
+    frame_t frames[3];
+    SDL_atomic_t middle; // index of the middle buffer, FRAME_DIRTY set while it holds an unread frame
+    int back;            // owned by the emulation thread
+    int front;           // owned by the render thread
+} triple_buffer_t;
+
+//commands sent from the SDL thread to the emulation thread
 typedef enum {
-    QUIT,
-    RUNNING,
-    PAUSED,
-} emulator_state_t;
+    CMD_KEY,
+    CMD_TOGGLE_PAUSE,
+    CMD_RESET,
+    CMD_SET_LERP_RATE,
+    CMD_WINDOW_HIDDEN,
+    CMD_WINDOW_SHOWN,
+    CMD_RAM_SEARCH_START,
+    CMD_RAM_SEARCH,
+    CMD_SAVE_STATE,
+    CMD_LOAD_STATE,
+    CMD_QUIT,
+} command_type_t;
+
+typedef struct {
+    command_type_t type;
+    uint8_t key;
+    bool pressed;
+    uint32_t timestamp; // SDL event timestamp of a key change
+    uint64_t sent_at;   // performance counter when the command was queued
+    float lerp_rate;
+    ram_relation_t relation;
+} command_t;
+
+//key change scheduled at a machine cycle
+typedef struct {
+    uint64_t cycle;
+    uint8_t key;
+    bool pressed;
+} input_event_t;
+
+//single producer/single consumer ring: the SDL thread pushes, the emulation thread pops
+#define COMMAND_QUEUE_SIZE 256
+typedef struct {
+    command_t commands[COMMAND_QUEUE_SIZE];
+    SDL_atomic_t head; // next slot to pop, only written by the emulation thread
+    SDL_atomic_t tail; // next slot to push, only written by the SDL thread
+} command_queue_t;
+
+//a 60Hz frame, what a slice may take; run-ahead is checked against it every RUN_AHEAD_WINDOW slices
+#define FRAME_BUDGET_MS 16.67
+#define RUN_AHEAD_WINDOW 60
 
-//instruction struct
+//profiling counters kept by the emulation thread, reported when it exits
 typedef struct {
-    uint16_t opcode;
-    uint16_t NNN; // 12 bit address/constant
-    uint8_t NN;   //  8 bit constant
-    uint8_t N;    //  4 bit constant
-    uint8_t X;    //  4 bit register identifier
-    uint8_t Y;    //  4 bit register identifier
-} instruction_t;
-
-//chip8 struct
+    uint64_t slices;
+    uint64_t instructions;
+    uint64_t cycles;
+    uint64_t emulation_ticks; // performance counter ticks spent executing instructions
+    uint64_t display_waits;   // slices ended early by a DXYN waiting for the vertical blank
+    uint64_t skipped_cycles;  // budget those slices left unused
+    uint64_t run_ahead_frames;
+    uint64_t run_ahead_ticks; // spent emulating frames ahead
+    uint64_t slice_ticks;     // whole slices, run-ahead included, against the 60Hz frame budget
+    uint64_t over_budget;     // windows of RUN_AHEAD_WINDOW slices that did not fit it
+} profile_t;
+
+//Ownership: once the emulation thread is started it owns the chip8_t, the render_t (the colour fade
+//is applied when a frame is published) and its own copy of config_t.
+//The SDL thread owns sdl_t and the original config_t, sees the machine only through published
+//frames and changes it only through the command queue.
 typedef struct {
-    emulator_state_t state;
-    uint8_t ram[4096];
-    bool display[64 * 32];
-    uint32_t pixel_color[64 * 32];
-    uint16_t stack[12];
-    uint16_t *stackPtr;
-    uint8_t V[16]; //V0-VF registers
-    uint16_t I; //Index Register
-    uint16_t PC; //Program counter
-    uint8_t delayTimer;
-    uint8_t soundTimer;
-    bool keypad[16];
-    instruction_t inst;
-    const char *romName;
-    bool draw;
-} chip8_t;
+    chip8_t *chip8;
+    config_t config;
+    render_t render;
+    sdl_t sdl;
+    triple_buffer_t frames;
+    command_queue_t commands;
+    SDL_sem *wakeup;      // posted for every queued command, a paused emulation thread sleeps on it
+    uint32_t frame_event; // SDL user event pushed when a new frame is ready
+
+    //emulation thread only: key changes waiting for their cycle, and the ticks at which the
+    //current and previous slices started, used to map event timestamps onto cycles
+    input_event_t pending[COMMAND_QUEUE_SIZE];
+    int pending_head;
+    int pending_tail;
+    uint32_t slice_ticks;
+    uint32_t previous_slice_ticks;
+    uint64_t slice_end; // cycle the current slice runs up to, overshoot is paid by the next slice
+    uint32_t slice_cycles; // cycles the last slice actually ran, the display wait can end it early
+    bool window_hidden;      // nobody can see the window, frames are not published
+    uint64_t resume_sent_at; // when the command that resumed emulation was queued, 0 once measured
+    profile_t profile;
+    ram_search_t ram_search;
+    //run-ahead: the frame shown is emulated run_ahead frames past the machine on a copy, with the keys
+    //held now, so input shows up that many frames sooner. Lowered while slices overrun the frame.
+    chip8_t ahead;
+    uint32_t run_ahead;
+    uint32_t window_slices;
+    uint64_t window_ticks;
+#ifndef _WIN32
+    //netplay: chip8 is rollback->machine and advances one frame of the session a slice
+    rollback_t *rollback;
+    uint16_t netplay_keys; // local keypad, bit k for key k
+#endif
+
+    //SDL thread only
+    bool hidden; // window is hidden or minimized, nothing gets rendered
+    bool redraw; // window contents were lost, present the current frame again
+} emulator_t;
 
 uint32_t color_lerp(const uint32_t start_color, const uint32_t end_color, const float t) {
     const uint8_t s_r = (start_color >> 24) & 0xFF;
@@ -89,30 +163,6 @@ uint32_t color_lerp(const uint32_t start_color, const uint32_t end_color, const
     return (ret_r << 24) | (ret_g << 16) | (ret_b << 8) | ret_a;
 }
 
-//sets configurations for sdl/window
-bool set_config(config_t *config, int argc, char **argv) {
-    *config = (config_t) {
-            .windowWidth = 64,
-            .windowHeight = 32,
-            .fgColor = 0xFFFFFFFF,
-            .bgColor = 0x000000FF,
-            .scaleFactor = 20,
-            .pixelOutlines = true,
-            .insts_per_second = 500,
-            .square_wave_freq = 440,
-            .audio_sample_rate = 44100,
-            .volume = 3000,
-            .color_lerp_rate = 0.7f,
-            .extension = CHIP8,
-    };
-
-    for (int i = 0; i < argc; i++) {
-        if (strncmp(argv[i], "--scale-factor", strlen("--scale-factor")) == 0) {
-            config->scaleFactor = (uint32_t) strtol(argv[i], NULL, 10);
-        }
-    }
-}
-
 void audio_callback(void *user_data, uint8_t *stream, int len) {
     config_t *config = (config_t *) user_data;
     int16_t *audio_data = (int16_t *) stream;
@@ -164,231 +214,6 @@ bool init_sdl(sdl_t *sdl, config_t *config) {
     return true;
 }
 
-//Initialize Chip-8
-bool init_chip8(chip8_t *chip8, const config_t config, const char *romName) {
-    const uint32_t entryPoint = 0x200;
-    const uint8_t font[] = {
-            0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
-            0x20, 0x60, 0x20, 0x20, 0x70, // 1
-            0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
-            0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
-            0x90, 0x90, 0xF0, 0x10, 0x10, // 4
-            0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
-            0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
-            0xF0, 0x10, 0x20, 0x40, 0x40, // 7
-            0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
-            0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
-            0xF0, 0x90, 0xF0, 0x90, 0x90, // A
-            0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
-            0xF0, 0x80, 0x80, 0x80, 0xF0, // C
-            0xE0, 0x90, 0x90, 0x90, 0xE0, // D
-            0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
-            0xF0, 0x80, 0xF0, 0x80, 0x80  // F
-    };
-
-    memset(chip8, 0, sizeof(chip8_t));
-
-    memcpy(&chip8->ram[0], &font[0], sizeof(font));
-
-    FILE *rom = fopen(romName, "rb");
-    if (!rom) {
-        SDL_Log("File: %s does not exist", romName);
-        return false;
-    }
-
-    fseek(rom, 0, SEEK_END);
-    const size_t romSize = ftell(rom);
-    const size_t maxSize = sizeof(chip8->ram) - entryPoint;
-    rewind(rom);
-
-    if (romSize > maxSize) {
-        SDL_Log("Rom file too big");
-        return false;
-    }
-
-    if (fread(&chip8->ram[entryPoint], romSize, 1, rom) != 1) {
-        SDL_Log("Could not read file into ram");
-        return false;
-    }
-
-    fclose(rom);
-    chip8->state = RUNNING;
-    chip8->PC = entryPoint;
-    chip8->romName = romName;
-    chip8->stackPtr = &chip8->stack[0];
-    memset(&chip8->pixel_color[0], config.bgColor, sizeof(chip8->pixel_color));
-    return true;
-}
-
-#ifdef DEBUG
-
-void print_debug_info(chip8_t *chip8) {
-    printf("Adress: 0x%04X, Opcode: 0x%04X Desc: ", chip8->PC - 2, chip8->inst.opcode);
-    switch ((chip8->inst.opcode >> 12) & 0x000F) {
-        case 0x0:
-            //clear the screen
-            if (chip8->inst.NN == 0xE0) {
-                printf("Clears the screen\n");
-            } else if (chip8->inst.NN == 0xEE) {
-                printf("Returned from subroutine to address 0x%04X\n", *(chip8->stackPtr - 1));
-            } else {
-                printf("Unimplemented Opcode\n");
-            }
-            break;
-        case 0x01:
-            printf("Jumps to address: 0x%04X\n", chip8->inst.NNN);
-            break;
-        case 0x02:
-            printf("Calls subroutine at NNN\n");
-            break;
-        case 0x03:
-            printf("Checks if value of V%X (0x%02X) is equal to NN (0x%02X). If yes, skips next instruction (0x%04X)\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN, chip8->PC);
-            break;
-        case 0x04:
-            printf("Checks if value of V%X (0x%02X) is not equal to NN (0x%02X). If yes, skips next instruction (0x%04X)\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN, chip8->PC);
-            break;
-        case 0x05:
-            printf("Checks if value of V%X (0x%02X) is equal to V%X (0x%02X). If yes skips next instruction (0x%04X)\n",
-                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->PC);
-            break;
-        case 0x06:
-            printf("Sets value of register V%X to NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
-            break;
-        case 0x07:
-            printf("Adds NN (0x%02X) to V%X\n", chip8->inst.NN, chip8->inst.X);
-            break;
-        case 0x08:
-            switch (chip8->inst.N) {
-                case 0x0:
-                    // 0x8XY0 sets VX = VY
-                    printf("Sets V%X (0x%02X) to V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y,
-                           chip8->V[chip8->inst.Y]);
-                    break;
-                case 0x1:
-                    // 0x8XY1 performs VX |= VY
-                    printf("Performs V%X (0x%02X) |= V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
-                           chip8->inst.Y, chip8->V[chip8->inst.Y]);
-                    break;
-                case 0x2:
-                    // 0x8XY2 performs VX &= VY
-                    printf("Performs V%X (0x%02X) &= V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
-                           chip8->inst.Y, chip8->V[chip8->inst.Y]);
-                    break;
-                case 0x3:
-                    // 0x8XY3 performs VX ^= VY
-                    printf("Performs V%X (0x%02X) ^= V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
-                           chip8->inst.Y, chip8->V[chip8->inst.Y]);
-                    break;
-                case 0x4:
-                    // 0x8XY4 sets VX += VY sets VF = 1 if there is an overflow otherwise sets VF = 0
-                    printf("Performs V%X (0x%02X) += V%X (0x%02X) and sets VF as per overflow occuring/not occuring\n",
-                           chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-                    break;
-                case 0x5:
-                    // 0x8XY5 performs VX -= VY sets VF = 0 if there is an underflow otherwise sets VF = 1
-                    printf("Performs V%X (0x%02X) += V%X (0x%02X) and sets VF as per underflow occuring/not occuring\n",
-                           chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-                    break;
-                case 0x6:
-                    // 0x8XY6 performs VX >>= VY and sets VF to the LSB of VX prior to shift
-                    printf("Performs V%X (0x%02X) >>= 1 and sets VF to the LSB of V%X prior to shift\n", chip8->inst.X,
-                           chip8->V[chip8->inst.X], chip8->inst.X);
-                    break;
-                case 0x7:
-                    // 0x8XY7 performs VX = VY - VX and sets VF = 0 when there is an underflow else set VF = 0
-                    printf("Performs V%X (0x%02X) = V%X (0x%02X) - V%X and sets VF as per underflow occuring/not occuring\n",
-                           chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
-                           chip8->inst.X);
-                    break;
-                case 0xE:
-                    // 0x8XYE performs VX <<= VY and sets VF to the MSB of VX prior to shift
-                    printf("Performs V%X (0x%02X) <<= 1 and sets VF to the MSB of V%X prior to shift\n", chip8->inst.X,
-                           chip8->V[chip8->inst.X], chip8->inst.X);
-                    break;
-            }
-            break;
-        case 0x09:
-            // 0x9XY0 Skips the next instruction if VX != VY
-            printf("Skips the next instruction if V%X (0x%02X) != V%X (0x%02X)\n", chip8->inst.X,
-                   chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
-            break;
-        case 0x0A:
-            printf("Sets instruction register to NNN (0x%04X)\n", chip8->inst.NNN);
-            break;
-        case 0x0B:
-            // 0xBNNN sets PC to V0 + NNN
-            printf("Sets the PC to V0 (0x%02X) + NNN (0x%04X)", chip8->V[0x0], chip8->inst.NNN);
-            break;
-        case 0x0C:
-            printf("Sets V%X (0x%02X) equal to rand() & NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
-                   chip8->inst.NN);
-            break;
-        case 0x0D:
-            printf("Drawing\n");
-            break;
-        case 0x0E:
-            if (chip8->inst.NN == 0x9E) {
-                // 0xEX9E skips next instruction if key stored in VX is pressed
-                printf("Skips next instruction if key stored in V%X (0x%02X) is pressed\n", chip8->inst.X,
-                       chip8->V[chip8->inst.X]);
-            } else if (chip8->inst.NN == 0xA1) {
-                // 0xEXA1 skips next instruction if key stored in VX is not pressed
-                printf("Skips next instruction if key stored in V%X (0x%02X) is not pressed\n", chip8->inst.X,
-                       chip8->V[chip8->inst.X]);
-            } else {
-                printf("Unimplemented Opcode\n");
-            }
-            break;
-        case 0x0F:
-            switch (chip8->inst.NN) {
-                case 0x07:
-                    printf("Sets V%X (0x%02X) = delayTimer (%d)\n", chip8->inst.X, chip8->V[chip8->inst.X],
-                           chip8->delayTimer);
-                    // 0xFX0A await a key press, then store it in VX
-                case 0x0A:
-                    printf("Awaiting a key press to store in V%X\n", chip8->inst.X);
-                    break;
-                    // 0xFX15 sets delayTimer = VX
-                case 0x15:
-                    printf("Sets delayTimer (%d) = V%X (0x%02X)\n", chip8->delayTimer, chip8->inst.X,
-                           chip8->V[chip8->inst.X]);
-                    break;
-                    // 0xFX18 sets soundTimer = VX
-                case 0x18:
-                    printf("Sets soundTimer (%d) = V%X (0x%02X)\n", chip8->soundTimer, chip8->inst.X,
-                           chip8->V[chip8->inst.X]);
-                    break;
-                    // 0xFX1E performs I += VX
-                case 0x1E:
-                    printf("Performs I (0x%04X) += V%X (0x%02X)\n", chip8->I, chip8->inst.X, chip8->V[chip8->inst.X]);
-                    break;
-                    // 0xFX29 sets I = location of font in VX
-                case 0x29:
-                    printf("Sets I = address of font in V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
-                    break;
-                case 0x33:
-                    printf("Stores BCD format of V%X (0x%02X) at I (0x%04X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
-                           chip8->I);
-                    break;
-                case 0x55:
-                    printf("Performs regdump of V0-V%X at address I (0x%04X)\n", chip8->inst.X, chip8->I);
-                    break;
-                case 0x65:
-                    printf("Performs regload of V0-V%X at address I (0x%04X)\n", chip8->inst.X, chip8->I);
-                    break;
-
-            }
-            break;
-        default:
-            printf("Unimplemented Opcode\n");
-            break;
-    }
-}
-
-#endif
-
 //Quit SDL
 bool quit_sdl(const sdl_t sdl) {
     SDL_DestroyRenderer(sdl.renderer);
@@ -409,7 +234,7 @@ void clear_screen(const sdl_t sdl, const config_t config) {
 }
 
 //bring backbuffer to screen
-void update_screen(const sdl_t sdl, const config_t config, chip8_t *chip8) {
+void update_screen(const sdl_t sdl, const config_t config, const frame_t *frame) {
     SDL_Rect rect = {.x = 0, .y = 0, .w = config.scaleFactor, .h = config.scaleFactor};
 
     const uint8_t bg_r = (config.bgColor >> 24) & 0xFF;
@@ -417,19 +242,15 @@ void update_screen(const sdl_t sdl, const config_t config, chip8_t *chip8) {
     const uint8_t bg_b = (config.bgColor >> 8) & 0xFF;
     const uint8_t bg_a = (config.bgColor >> 0) & 0xFF;
 
-    for (uint32_t i = 0; i < sizeof(chip8->display); i++) {
+    for (uint32_t i = 0; i < config.windowWidth * config.windowHeight; i++) {
         rect.x = (i % config.windowWidth) * config.scaleFactor;
         rect.y = (i / config.windowWidth) * config.scaleFactor;
-//        printf("Bruh %d %d %d\n", rect.x, rect.y, chip8->display[i]);
 
-        if (chip8->display[i]) {
-            if (chip8->pixel_color[i] != config.fgColor) {
-                chip8->pixel_color[i] = color_lerp(chip8->pixel_color[i], config.fgColor, config.color_lerp_rate);
-            }
-            const uint8_t r = (chip8->pixel_color[i] >> 24) & 0xFF;
-            const uint8_t g = (chip8->pixel_color[i] >> 16) & 0xFF;
-            const uint8_t b = (chip8->pixel_color[i] >> 8) & 0xFF;
-            const uint8_t a = (chip8->pixel_color[i] >> 0) & 0xFF;
+        if (frame->display[i]) {
+            const uint8_t r = (frame->pixel_color[i] >> 24) & 0xFF;
+            const uint8_t g = (frame->pixel_color[i] >> 16) & 0xFF;
+            const uint8_t b = (frame->pixel_color[i] >> 8) & 0xFF;
+            const uint8_t a = (frame->pixel_color[i] >> 0) & 0xFF;
 
             SDL_SetRenderDrawColor(sdl.renderer, r, g, b, a);
             SDL_RenderFillRect(sdl.renderer, &rect);
@@ -446,64 +267,159 @@ void update_screen(const sdl_t sdl, const config_t config, chip8_t *chip8) {
     SDL_RenderPresent(sdl.renderer);
 }
 
-//handle user events
-void handle_input(chip8_t *chip8, config_t *config) {
+//every pixel starts from the background colour. display_hash is left alone, so a reset that
+//cleared the screen still publishes the blank frame.
+void reset_render(render_t *render, const config_t config) {
+    for (uint32_t i = 0; i < RENDER_WIDTH * RENDER_HEIGHT; i++)
+        render->pixel_color[i] = config.bgColor;
+}
+
+//fade pixel colours and hand the display of chip8 (the machine or the run-ahead copy) over to the
+//render thread
+//returns true if the render thread had already taken the previous frame and has to be woken up
+bool publish_frame(emulator_t *emu, const chip8_t *chip8) {
+    render_t *render = &emu->render;
+    frame_t *frame = &emu->frames.frames[emu->frames.back];
+
+    for (uint32_t i = 0; i < sizeof(chip8->display); i++) {
+        if (chip8->display[i] && render->pixel_color[i] != emu->config.fgColor) {
+            render->pixel_color[i] = color_lerp(render->pixel_color[i], emu->config.fgColor,
+                                                emu->config.color_lerp_rate);
+        }
+    }
+    render->display_hash = chip8->display_hash;
+    memcpy(frame->display, chip8->display, sizeof(chip8->display));
+    memcpy(frame->pixel_color, render->pixel_color, sizeof(chip8->display) * sizeof(frame->pixel_color[0]));
+
+    const int previous = SDL_AtomicSet(&emu->frames.middle, emu->frames.back | FRAME_DIRTY);
+    emu->frames.back = previous & ~FRAME_DIRTY;
+    return !(previous & FRAME_DIRTY);
+}
+
+//publish the display and wake the SDL thread if it is waiting for a frame
+void send_frame(emulator_t *emu, const chip8_t *chip8) {
+    if (publish_frame(emu, chip8)) {
+        SDL_Event event = {.type = emu->frame_event};
+        SDL_PushEvent(&event);
+    }
+}
+
+//take the latest published frame, returns false if nothing new was published
+bool acquire_frame(triple_buffer_t *frames) {
+    if (!(SDL_AtomicGet(&frames->middle) & FRAME_DIRTY))
+        return false;
+    frames->front = SDL_AtomicSet(&frames->middle, frames->front) & ~FRAME_DIRTY;
+    return true;
+}
+
+bool push_command(command_queue_t *queue, const command_t command) {
+    const int tail = SDL_AtomicGet(&queue->tail);
+    const int next = (tail + 1) % COMMAND_QUEUE_SIZE;
+    if (next == SDL_AtomicGet(&queue->head))
+        return false;
+    queue->commands[tail] = command;
+    SDL_AtomicSet(&queue->tail, next);
+    return true;
+}
+
+bool pop_command(command_queue_t *queue, command_t *command) {
+    const int head = SDL_AtomicGet(&queue->head);
+    if (head == SDL_AtomicGet(&queue->tail))
+        return false;
+    *command = queue->commands[head];
+    SDL_AtomicSet(&queue->head, (head + 1) % COMMAND_QUEUE_SIZE);
+    return true;
+}
+
+void send_command(emulator_t *emu, command_t command) {
+    command.sent_at = SDL_GetPerformanceCounter();
+    if (!push_command(&emu->commands, command)) {
+        SDL_Log("Command queue full, dropping command %d", command.type);
+        return;
+    }
+    SDL_SemPost(emu->wakeup);
+}
+
+void send_key(emulator_t *emu, const uint8_t key, const bool pressed, const uint32_t timestamp) {
+    send_command(emu, (command_t) {.type = CMD_KEY, .key = key, .pressed = pressed, .timestamp = timestamp});
+}
+
+//handle user events, returns false once the user asked to quit
+bool handle_input(emulator_t *emu, config_t *config) {
     SDL_Event event;
 
     while (SDL_PollEvent(&event)) {
         switch (event.type) {
             case SDL_QUIT:
-                chip8->state = QUIT;
-                return;
+                return false;
+            case SDL_WINDOWEVENT:
+                switch (event.window.event) {
+                    case SDL_WINDOWEVENT_MINIMIZED:
+                    case SDL_WINDOWEVENT_HIDDEN:
+                        emu->hidden = true;
+                        send_command(emu, (command_t) {.type = CMD_WINDOW_HIDDEN});
+                        break;
+                    case SDL_WINDOWEVENT_RESTORED:
+                    case SDL_WINDOWEVENT_SHOWN:
+                        emu->hidden = false;
+                        send_command(emu, (command_t) {.type = CMD_WINDOW_SHOWN});
+                        break;
+                    case SDL_WINDOWEVENT_EXPOSED:
+                        emu->redraw = true;
+                        break;
+                    default:
+                        break;
+                }
+                break;
             case SDL_KEYUP:
                 switch (event.key.keysym.sym) {
                     case SDLK_1:
-                        chip8->keypad[0x1] = false;
+                        send_key(emu, 0x1, false, event.key.timestamp);
                         break;
                     case SDLK_2:
-                        chip8->keypad[0x2] = false;
+                        send_key(emu, 0x2, false, event.key.timestamp);
                         break;
                     case SDLK_3:
-                        chip8->keypad[0x3] = false;
+                        send_key(emu, 0x3, false, event.key.timestamp);
                         break;
                     case SDLK_4:
-                        chip8->keypad[0xC] = false;
+                        send_key(emu, 0xC, false, event.key.timestamp);
                         break;
                     case SDLK_q:
-                        chip8->keypad[0x4] = false;
+                        send_key(emu, 0x4, false, event.key.timestamp);
                         break;
                     case SDLK_w:
-                        chip8->keypad[0x5] = false;
+                        send_key(emu, 0x5, false, event.key.timestamp);
                         break;
                     case SDLK_e:
-                        chip8->keypad[0x6] = false;
+                        send_key(emu, 0x6, false, event.key.timestamp);
                         break;
                     case SDLK_r:
-                        chip8->keypad[0xD] = false;
+                        send_key(emu, 0xD, false, event.key.timestamp);
                         break;
                     case SDLK_a:
-                        chip8->keypad[0x7] = false;
+                        send_key(emu, 0x7, false, event.key.timestamp);
                         break;
                     case SDLK_s:
-                        chip8->keypad[0x8] = false;
+                        send_key(emu, 0x8, false, event.key.timestamp);
                         break;
                     case SDLK_d:
-                        chip8->keypad[0x9] = false;
+                        send_key(emu, 0x9, false, event.key.timestamp);
                         break;
                     case SDLK_f:
-                        chip8->keypad[0xE] = false;
+                        send_key(emu, 0xE, false, event.key.timestamp);
                         break;
                     case SDLK_z:
-                        chip8->keypad[0xA] = false;
+                        send_key(emu, 0xA, false, event.key.timestamp);
                         break;
                     case SDLK_x:
-                        chip8->keypad[0x0] = false;
+                        send_key(emu, 0x0, false, event.key.timestamp);
                         break;
                     case SDLK_c:
-                        chip8->keypad[0xB] = false;
+                        send_key(emu, 0xB, false, event.key.timestamp);
                         break;
                     case SDLK_v:
-                        chip8->keypad[0xF] = false;
+                        send_key(emu, 0xF, false, event.key.timestamp);
                         break;
                     default:
                         break;
@@ -512,27 +428,22 @@ void handle_input(chip8_t *chip8, config_t *config) {
             case SDL_KEYDOWN:
                 switch (event.key.keysym.sym) {
                     case SDLK_ESCAPE:
-                        chip8->state = QUIT;
-                        break;
+                        return false;
                     case SDLK_SPACE:
-                        if (chip8->state == RUNNING) {
-                            chip8->state = PAUSED;
-                            puts("====Paused====");
-                        } else if (chip8->state == PAUSED) {
-                            chip8->state = RUNNING;
-                            puts("====Resumed====");
-                        }
-                        return;
+                        send_command(emu, (command_t) {.type = CMD_TOGGLE_PAUSE});
+                        return true;
                     case SDLK_EQUALS:
-                        init_chip8(chip8, *config, chip8->romName);
+                        send_command(emu, (command_t) {.type = CMD_RESET});
                         break;
                     case SDLK_j:
                         if (config->color_lerp_rate > 0)
                             config->color_lerp_rate -= 0.1f;
+                        send_command(emu, (command_t) {.type = CMD_SET_LERP_RATE, .lerp_rate = config->color_lerp_rate});
                         break;
                     case SDLK_k:
                         if (config->color_lerp_rate < 1)
                             config->color_lerp_rate += 0.1f;
+                        send_command(emu, (command_t) {.type = CMD_SET_LERP_RATE, .lerp_rate = config->color_lerp_rate});
                         break;
                     case SDLK_o:
                         if (config->volume > 0)
@@ -542,354 +453,412 @@ void handle_input(chip8_t *chip8, config_t *config) {
                         if (config->volume < INT16_MAX)
                             config->volume += 500;
                         break;
+                    //RAM search: F1 starts over, F2-F5 keep the addresses that stayed equal, changed,
+                    //increased or decreased since the last of these keys
+                    case SDLK_F1:
+                        send_command(emu, (command_t) {.type = CMD_RAM_SEARCH_START});
+                        break;
+                    case SDLK_F2:
+                        send_command(emu, (command_t) {.type = CMD_RAM_SEARCH, .relation = RAM_EQUAL});
+                        break;
+                    case SDLK_F3:
+                        send_command(emu, (command_t) {.type = CMD_RAM_SEARCH, .relation = RAM_CHANGED});
+                        break;
+                    case SDLK_F4:
+                        send_command(emu, (command_t) {.type = CMD_RAM_SEARCH, .relation = RAM_INCREASED});
+                        break;
+                    case SDLK_F5:
+                        send_command(emu, (command_t) {.type = CMD_RAM_SEARCH, .relation = RAM_DECREASED});
+                        break;
+                    //F6 saves the machine to <rom>.state, F7 loads it back
+                    case SDLK_F6:
+                        send_command(emu, (command_t) {.type = CMD_SAVE_STATE});
+                        break;
+                    case SDLK_F7:
+                        send_command(emu, (command_t) {.type = CMD_LOAD_STATE});
+                        break;
                     case SDLK_1:
-                        chip8->keypad[0x1] = true;
+                        send_key(emu, 0x1, true, event.key.timestamp);
                         break;
                     case SDLK_2:
-                        chip8->keypad[0x2] = true;
+                        send_key(emu, 0x2, true, event.key.timestamp);
                         break;
                     case SDLK_3:
-                        chip8->keypad[0x3] = true;
+                        send_key(emu, 0x3, true, event.key.timestamp);
                         break;
                     case SDLK_4:
-                        chip8->keypad[0xC] = true;
+                        send_key(emu, 0xC, true, event.key.timestamp);
                         break;
                     case SDLK_q:
-                        chip8->keypad[0x4] = true;
+                        send_key(emu, 0x4, true, event.key.timestamp);
                         break;
                     case SDLK_w:
-                        chip8->keypad[0x5] = true;
+                        send_key(emu, 0x5, true, event.key.timestamp);
                         break;
                     case SDLK_e:
-                        chip8->keypad[0x6] = true;
+                        send_key(emu, 0x6, true, event.key.timestamp);
                         break;
                     case SDLK_r:
-                        chip8->keypad[0xD] = true;
+                        send_key(emu, 0xD, true, event.key.timestamp);
                         break;
                     case SDLK_a:
-                        chip8->keypad[0x7] = true;
+                        send_key(emu, 0x7, true, event.key.timestamp);
                         break;
                     case SDLK_s:
-                        chip8->keypad[0x8] = true;
+                        send_key(emu, 0x8, true, event.key.timestamp);
                         break;
                     case SDLK_d:
-                        chip8->keypad[0x9] = true;
+                        send_key(emu, 0x9, true, event.key.timestamp);
                         break;
                     case SDLK_f:
-                        chip8->keypad[0xE] = true;
+                        send_key(emu, 0xE, true, event.key.timestamp);
                         break;
                     case SDLK_z:
-                        chip8->keypad[0xA] = true;
+                        send_key(emu, 0xA, true, event.key.timestamp);
                         break;
                     case SDLK_x:
-                        chip8->keypad[0x0] = true;
+                        send_key(emu, 0x0, true, event.key.timestamp);
                         break;
                     case SDLK_c:
-                        chip8->keypad[0xB] = true;
+                        send_key(emu, 0xB, true, event.key.timestamp);
                         break;
                     case SDLK_v:
-                        chip8->keypad[0xF] = true;
+                        send_key(emu, 0xF, true, event.key.timestamp);
                         break;
                     default:
-                        return;
+                        return true;
                 }
                 break;
             default:
                 break;
         }
     }
+    return true;
 }
 
-void emulate_instruction(chip8_t *chip8, config_t config) {
-    chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];
-    chip8->PC += 2;
+//play the tone while the sound timer is running
+void update_audio(const sdl_t sdl, const chip8_t *chip8) {
+    SDL_PauseAudioDevice(sdl.dev, chip8->soundTimer > 0 ? 0 : 1);
+}
 
-    chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
-    chip8->inst.NN = chip8->inst.opcode & 0x00FF;
-    chip8->inst.N = chip8->inst.opcode & 0x000F;
-    chip8->inst.X = (chip8->inst.opcode >> 8) & 0x000F;
-    chip8->inst.Y = (chip8->inst.opcode >> 4) & 0x000F;
+//map an SDL timestamp onto the cycle a key change takes effect at: the change keeps its offset
+//into the slice it was generated during and is applied at the same offset into the coming slice.
+//The offset is scaled to the cycles that slice actually ran, not the full budget, so a slice the
+//display wait ended early does not push key changes into later slices.
+uint64_t timestamp_to_cycle(const emulator_t *emu, const uint32_t timestamp) {
+    const uint32_t cycles_per_slice = emu->slice_cycles;
+    int32_t elapsed = (int32_t) (timestamp - emu->previous_slice_ticks);
+    if (elapsed < 0)
+        elapsed = 0;
+
+    uint64_t offset = (uint64_t) elapsed * cycles_per_slice * 60 / 1000;
+    if (cycles_per_slice && offset >= cycles_per_slice)
+        offset = cycles_per_slice - 1;
+    return emu->chip8->cycles + offset;
+}
 
-#ifdef DEBUG
-    print_debug_info(chip8);
-#endif
+//apply the key changes due at or before cycle
+void apply_input(emulator_t *emu, const uint64_t cycle) {
+    chip8_t *chip8 = emu->chip8;
 
-    switch ((chip8->inst.opcode >> 12) & 0x000F) {
-        case 0x0:
-            if (chip8->inst.NN == 0XE0) {
-                // 0x00E0 Clear the screen
-                memset(&chip8->display[0], false, sizeof(chip8->display));
-            } else if (chip8->inst.NN == 0xEE) {
-                // 0x00EE Return from subroutine
-                chip8->PC = *--chip8->stackPtr;
-            }
-            break;
-        case 0x01:
-            chip8->PC = chip8->inst.NNN;
-            break;
-        case 0x02:
-            // 0x2NNN call subroutine at NNN
-            *chip8->stackPtr++ = chip8->PC;
-            chip8->PC = chip8->inst.NNN;
-            break;
-        case 0x03:
-            // checks if Vx == NN. If yes, skips next instruction
-            if (chip8->V[chip8->inst.X] == chip8->inst.NN) {
-                chip8->PC += 2;
-            }
-            break;
-        case 0x04:
-            // checks if Vx != NN. If yes, skips next instruction
-            if (chip8->V[chip8->inst.X] != chip8->inst.NN) {
-                chip8->PC += 2;
-            }
-            break;
-        case 0x05:
-            // 0x5XY0 checks if Vx == Vy. If yes, skips next instruction
-            if (chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]) {
-                chip8->PC += 2;
-            }
-            break;
-        case 0x06:
-            // 0x6XNN sets value of register VX to NN
-            chip8->V[chip8->inst.X] = chip8->inst.NN;
-            break;
-        case 0x07:
-            // 0x7XNN adds VX to NN
-            chip8->V[chip8->inst.X] += chip8->inst.NN;
-            break;
-        case 0x08:
-            switch (chip8->inst.N) {
-                case 0x0:
-                    // 0x8XY0 sets VX = VY
-                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-                    break;
-                case 0x1:
-                    // 0x8XY1 performs VX |= VY
-                    chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-                    if (config.extension == CHIP8)
-                        chip8->V[0xF] = 0;
-                    break;
-                case 0x2:
-                    // 0x8XY2 performs VX &= VY
-                    chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-                    if (config.extension == CHIP8)
-                        chip8->V[0xF] = 0;
-                    break;
-                case 0x3:
-                    // 0x8XY3 performs VX |= VY
-                    chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-                    if (config.extension == CHIP8)
-                        chip8->V[0xF] = 0;
-                    break;
-                case 0x4: {
-                    // 0x8XY4 sets VX += VY sets VF = 1 if there is an overflow otherwise sets VF = 0
-                    const bool carry = (uint16_t) chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y] > 0xFF;
-                    chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-                    chip8->V[0xF] = carry;
-                }
-                    break;
-                case 0x5: {
-                    // 0x8XY5 performs VX -= VY sets VF = 0 if there is an underflow otherwise sets VF = 1
-                    const bool carry = chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y];
-                    chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
-                    chip8->V[0xF] = carry;
-                }
-                    break;
-                case 0x6: {
-                    // 0x8XY6 performs VX >>= 1 and sets VF to the LSB of VX prior to shift
-                    bool carry;
-                    if (config.extension == CHIP8) {
-                        carry = chip8->V[chip8->inst.Y] & 0x1;
-                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] >> 1;
-                    } else {
-                        carry = chip8->V[chip8->inst.X] & 0x1;
-                        chip8->V[chip8->inst.X] >>= 1;
-                    }
-                    chip8->V[0xF] = carry;
-                }
-                    break;
-                case 0x7: {
-                    // 0x8XY7 performs VX = VY - VX and sets VF = 0 when there is an underflow else set VF = 0
-                    const bool carry = chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y];
-                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-                    chip8->V[0xF] = carry;
-                }
-                    break;
-                case 0xE: {
-                    // 0x8XYE performs VX <<= VY and sets VF to the MSB of VX prior to shift
-                    bool carry;
-                    if (config.extension == CHIP8) {
-                        carry = (chip8->V[chip8->inst.Y] & 0x80) >> 7;
-                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] << 1;
-                    } else {
-                        carry = (chip8->V[chip8->inst.X] & 0x80) >> 0x7;
-                        chip8->V[chip8->inst.X] <<= 1;
-                    }
-                    chip8->V[0xF] = carry;
-                }
-                    break;
-            }
-            break;
-        case 0x09:
-            // 0x9XY0 Skips the next instruction if VX != VY
-            if (chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y]) {
-                chip8->PC += 2;
-            }
-            break;
-        case 0x0A:
-            // 0xANNN Sets index register I to NNN
-            chip8->I = chip8->inst.NNN;
-            break;
-        case 0x0B:
-            // 0xBNNN sets PC to V0 + NNN
-            chip8->PC = chip8->V[0x0] + chip8->inst.NNN;
-            break;
-        case 0x0C:
-            // 0xCXNN sets VX = rand() & NN
-            chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
-            break;
-        case 0x0D: {
-            // 0xDXYN Draws N-height sprites at cords X,Y; Read from memory location I
-            // Screen pixels are XOR'd with sprite bits
-            // VF (Carry Flag) is set if any screen pixels are switched off
-            uint8_t X_cord = chip8->V[chip8->inst.X] % config.windowWidth;
-            uint8_t Y_Cord = chip8->V[chip8->inst.Y] % config.windowHeight;
-            const uint8_t orig_X = X_cord;
+    while (emu->pending_head != emu->pending_tail && emu->pending[emu->pending_head].cycle <= cycle) {
+        const input_event_t *input = &emu->pending[emu->pending_head];
+        chip8->keypad[input->key] = input->pressed;
+        emu->pending_head = (emu->pending_head + 1) % COMMAND_QUEUE_SIZE;
+    }
+}
+
+void schedule_input(emulator_t *emu, const command_t command) {
+    const int next = (emu->pending_tail + 1) % COMMAND_QUEUE_SIZE;
+    if (next == emu->pending_head) {
+        //out of room, the oldest change is applied early rather than lost
+        apply_input(emu, emu->pending[emu->pending_head].cycle);
+    }
 
-            chip8->V[0xF] = 0;
+    //a change never lands before one queued earlier, so press and release keep their order
+    uint64_t cycle = timestamp_to_cycle(emu, command.timestamp);
+    if (emu->pending_head != emu->pending_tail) {
+        const int last = (emu->pending_tail + COMMAND_QUEUE_SIZE - 1) % COMMAND_QUEUE_SIZE;
+        if (cycle < emu->pending[last].cycle)
+            cycle = emu->pending[last].cycle;
+    }
+    emu->pending[emu->pending_tail] = (input_event_t) {.cycle = cycle, .key = command.key, .pressed = command.pressed};
+    emu->pending_tail = next;
+}
 
-            for (uint8_t i = 0; i < chip8->inst.N; i++) {
+void print_profile(const profile_t *profile) {
+    if (!profile->instructions)
+        return;
+    const double ns = (double) profile->emulation_ticks * 1e9 / SDL_GetPerformanceFrequency();
+    const double ns_per_cycle = ns / profile->cycles;
+    puts("====Profile====");
+    printf("slices: %llu, instructions: %llu (%.1f ns each), cycles: %llu\n", (unsigned long long) profile->slices,
+           (unsigned long long) profile->instructions, ns / profile->instructions,
+           (unsigned long long) profile->cycles);
+    printf("display wait: %llu slices ended early, %llu cycles skipped (~%.3f ms of host time saved)\n",
+           (unsigned long long) profile->display_waits, (unsigned long long) profile->skipped_cycles,
+           profile->skipped_cycles * ns_per_cycle / 1e6);
+    if (profile->run_ahead_frames) {
+        const double frequency = (double) SDL_GetPerformanceFrequency();
+        const double slice_ms = profile->slice_ticks * 1000 / frequency / profile->slices;
+        printf("run-ahead: %llu frames (%.3f ms per slice), slices took %.3f ms (%.0f%% of the frame), "
+               "%llu windows over budget\n", (unsigned long long) profile->run_ahead_frames,
+               profile->run_ahead_ticks * 1000 / frequency / profile->slices, slice_ms,
+               100 * slice_ms / FRAME_BUDGET_MS, (unsigned long long) profile->over_budget);
+    }
+}
 
-                const uint8_t sprite_data = chip8->ram[chip8->I + i];
-                X_cord = orig_X;
+//the candidates left after a filter, the first few with their current values
+void print_ram_search(const ram_search_t *search, const chip8_t *chip8) {
+    uint16_t addresses[8];
+    const uint32_t shown = ram_candidates(search, addresses, sizeof(addresses) / sizeof(addresses[0]));
+    printf("====RAM search==== %u candidates\n", search->count);
+    for (uint32_t i = 0; i < shown; i++)
+        printf("0x%03X = %u\n", addresses[i], chip8->ram[addresses[i]]);
+}
 
-                for (int8_t j = 7; j >= 0; j--) {
-                    bool *pixel = &chip8->display[Y_Cord * config.windowWidth + X_cord];
-                    const bool sprite_bit = (sprite_data & (1 << j));
+//emulates run_ahead frames past the machine on emu->ahead and returns it. The machine's timers tick
+//before its next slice, so the copy's do too; pending input is not applied, the keys stay as held now.
+const chip8_t *run_ahead(emulator_t *emu) {
+    const uint64_t start = SDL_GetPerformanceCounter();
+    chip8_t *ahead = &emu->ahead;
+    copy_chip8(ahead, emu->chip8);
+    update_timers(ahead);
+    for (uint32_t frame = 0; frame < emu->run_ahead; frame++)
+        run_frame(ahead, emu->config);
+    emu->profile.run_ahead_frames += emu->run_ahead;
+    emu->profile.run_ahead_ticks += SDL_GetPerformanceCounter() - start;
+    return ahead;
+}
 
-                    if (sprite_bit && *pixel) {
-                        chip8->V[0xF] = 1;
-                    }
+//a slice, run-ahead included, has to fit in a 60Hz frame at the configured speed. Every
+//RUN_AHEAD_WINDOW slices run-ahead is scaled down to what would have fit if on average they did not.
+void check_frame_budget(emulator_t *emu, const uint64_t ticks) {
+    emu->profile.slice_ticks += ticks;
+    emu->window_ticks += ticks;
+    if (++emu->window_slices < RUN_AHEAD_WINDOW)
+        return;
+    const double ms = (double) emu->window_ticks * 1000 / SDL_GetPerformanceFrequency() / emu->window_slices;
+    if (ms > FRAME_BUDGET_MS) {
+        emu->profile.over_budget++;
+        if (emu->run_ahead) {
+            const uint32_t fitting = (uint32_t) (emu->run_ahead * FRAME_BUDGET_MS / ms);
+            emu->run_ahead = fitting < emu->run_ahead ? fitting : emu->run_ahead - 1;
+            printf("====Run-ahead==== %.2f ms per slice is over the %.2f ms frame at %u instructions/s, "
+                   "now %u frames ahead\n", ms, FRAME_BUDGET_MS, emu->config.insts_per_second, emu->run_ahead);
+        }
+    }
+    emu->window_slices = 0;
+    emu->window_ticks = 0;
+}
 
-                    *pixel ^= sprite_bit;
+//during netplay the machine has to stay in step with the peer's, nothing but the session may change it
+bool netplay_refuses(const emulator_t *emu, const char *what) {
+#ifndef _WIN32
+    if (emu->rollback) {
+        printf("====Netplay==== cannot %s during netplay\n", what);
+        return true;
+    }
+#endif
+    (void) emu;
+    (void) what;
+    return false;
+}
 
-                    if (++X_cord >= config.windowWidth)
-                        break;
-                }
+//apply the commands queued by the SDL thread
+void handle_commands(emulator_t *emu) {
+    chip8_t *chip8 = emu->chip8;
+    command_t command;
 
-                if (++Y_Cord >= config.windowHeight)
+    while (pop_command(&emu->commands, &command)) {
+        switch (command.type) {
+            case CMD_KEY:
+#ifndef _WIN32
+                if (emu->rollback) {
+                    emu->netplay_keys = (uint16_t) (command.pressed ? emu->netplay_keys | 1 << command.key
+                                                                    : emu->netplay_keys & ~(1 << command.key));
                     break;
-            }
-            chip8->draw = true;
-            break;
-        }
-        case 0x0E:
-            if (chip8->inst.NN == 0x9E) {
-                // 0xEX9E skips next instruction if key stored in VX is pressed
-                if (chip8->keypad[chip8->V[chip8->inst.X]]) {
-                    chip8->PC += 2;
                 }
-            } else if (chip8->inst.NN == 0xA1) {
-                // 0xEXA1 skips next instruction if key stored in VX is not pressed
-                if (!chip8->keypad[chip8->V[chip8->inst.X]]) {
-                    chip8->PC += 2;
-                }
-            }
-            break;
-        case 0x0F:
-            switch (chip8->inst.NN) {
-                // 0FX07 sets VX = delayTimer
-                case 0x07:
-                    chip8->V[chip8->inst.X] = chip8->delayTimer;
-                    break;
-                    // 0xFX0A await a key press, then store it in VX
-                case 0x0A: {
-                    static bool any_key_pressed = false;
-                    static uint8_t key = 0xFF;
-                    for (uint8_t i = 0; key == 0xFF && i < sizeof(chip8->keypad); i++) {
-                        if (chip8->keypad[i]) {
-                            key = i;
-                            any_key_pressed = true;
-                        }
-                    }
-                    if (!any_key_pressed)
-                        chip8->PC -= 2;
-                    else {
-                        if (chip8->keypad[key])
-                            chip8->PC -= 2;
-                        else {
-                            chip8->V[chip8->inst.X] = key;
-                            key = 0xFF;
-                            any_key_pressed = false;
-                        }
-                    }
-                    break;
+#endif
+                schedule_input(emu, command);
+                break;
+            case CMD_TOGGLE_PAUSE:
+                if (netplay_refuses(emu, "pause"))
+                    break;
+                if (chip8->state == RUNNING) {
+                    chip8->state = PAUSED;
+                    puts("====Paused====");
+                } else if (chip8->state == PAUSED) {
+                    chip8->state = RUNNING;
+                    emu->resume_sent_at = command.sent_at;
                 }
-                    // 0xFX15 sets delayTimer = VX
-                case 0x15:
-                    chip8->delayTimer = chip8->V[chip8->inst.X];
-                    break;
-                    // 0xFX18 sets soundTimer = VX
-                case 0x18:
-                    chip8->soundTimer = chip8->V[chip8->inst.X];
-                    break;
-                    // 0xFX1E performs I += VX
-                case 0x1E:
-                    chip8->I += chip8->V[chip8->inst.X];
-                    break;
-                    // 0xFX29 sets I = location of font in VX
-                case 0x29:
-                    chip8->I = chip8->V[chip8->inst.X] * 5;
-                    break;
-                    // 0xFX33 sets bcd value of VX at I
-                    // hundreds place at I, tens place at I+1, ones place at I+2
-                case 0x33: {
-                    uint8_t bcd = chip8->V[chip8->inst.X];
-                    chip8->ram[chip8->I + 2] = bcd % 10;
-                    bcd /= 10;
-                    chip8->ram[chip8->I + 1] = bcd % 10;
-                    bcd /= 10;
-                    chip8->ram[chip8->I] = bcd % 10;
+                break;
+            case CMD_RESET:
+                if (netplay_refuses(emu, "reset"))
                     break;
+                init_chip8(chip8, emu->config, chip8->romName);
+                reset_render(&emu->render, emu->config);
+                emu->pending_head = emu->pending_tail = 0;
+                emu->slice_end = chip8->cycles;
+                break;
+            case CMD_SET_LERP_RATE:
+                emu->config.color_lerp_rate = command.lerp_rate;
+                break;
+            case CMD_WINDOW_HIDDEN:
+                emu->window_hidden = true;
+                break;
+            case CMD_WINDOW_SHOWN:
+                //frames were skipped while hidden, publish the current display for one full redraw
+                if (emu->window_hidden)
+                    send_frame(emu, emu->run_ahead ? run_ahead(emu) : chip8);
+                emu->window_hidden = false;
+                break;
+            case CMD_RAM_SEARCH_START:
+                start_ram_search(&emu->ram_search, chip8);
+                printf("====RAM search==== %u candidates\n", emu->ram_search.count);
+                break;
+            case CMD_RAM_SEARCH:
+                filter_ram_search(&emu->ram_search, chip8, command.relation, 0);
+                print_ram_search(&emu->ram_search, chip8);
+                break;
+            case CMD_SAVE_STATE:
+            case CMD_LOAD_STATE: {
+                char path[4096];
+                snprintf(path, sizeof(path), "%s.state", chip8->romName);
+                if (command.type == CMD_LOAD_STATE && netplay_refuses(emu, "load a state"))
+                    break;
+                if (command.type == CMD_SAVE_STATE) {
+                    if (save_state_file(chip8, path, true))
+                        printf("====Saved %s====\n", path);
+                } else if (load_state_file(chip8, path)) {
+                    //input scheduled for the machine before it went back in time no longer applies
+                    emu->pending_head = emu->pending_tail = 0;
+                    //slices are budgeted from the loaded machine's cycle count, not the one it replaced
+                    emu->slice_end = chip8->cycles;
+                    printf("====Loaded %s====\n", path);
                 }
-                case 0x55:
-                    for (uint8_t i = 0; i <= chip8->inst.X; i++) {
-                        if (config.extension == CHIP8)
-                            chip8->ram[chip8->I++] = chip8->V[i];
-                        else
-                            chip8->ram[chip8->I + i] = chip8->V[i];
-                    }
-                    break;
-                case 0x65:
-                    for (uint8_t i = 0; i <= chip8->inst.X; i++) {
-                        if (config.extension == CHIP8)
-                            chip8->V[i] = chip8->ram[chip8->I++];
-                        else
-                            chip8->V[i] = chip8->ram[chip8->I + i];
-                    }
-                    break;
+                break;
             }
-            break;
-        default:
-            break;
+            case CMD_QUIT:
+                chip8->state = QUIT;
+                return;
+        }
     }
 }
 
-void update_timers(const sdl_t sdl, chip8_t *chip8) {
-    if (chip8->delayTimer > 0)
-        chip8->delayTimer--;
-    if (chip8->soundTimer > 0) {
-        chip8->soundTimer--;
-        SDL_PauseAudioDevice(sdl.dev, 0);
-    } else {
-        SDL_PauseAudioDevice(sdl.dev, 1);
+#ifndef _WIN32
+//a netplay slice: the peer's input that arrived may rewind and resimulate the machine, then the next
+//frame of the session runs with the keys held now
+void netplay_slice(emulator_t *emu) {
+    const chip8_t *chip8 = emu->chip8;
+    const uint64_t start = SDL_GetPerformanceCounter();
+    poll_rollback(emu->rollback);
+    advance_rollback(emu->rollback, emu->netplay_keys);
+    if (chip8->display_hash != emu->render.display_hash && !emu->window_hidden)
+        send_frame(emu, chip8);
+    update_audio(emu->sdl, chip8);
+    const uint64_t end = SDL_GetPerformanceCounter();
+    emu->profile.slices++;
+    emu->profile.slice_ticks += end - start;
+    const double time_elapsed = (double) ((end - start) * 1000) / SDL_GetPerformanceFrequency();
+    SDL_Delay(FRAME_BUDGET_MS > time_elapsed ? FRAME_BUDGET_MS - time_elapsed : 0);
+}
+#endif
+
+//runs the machine in 60Hz slices and publishes a frame whenever the display changed
+int emulation_thread(void *data) {
+    emulator_t *emu = (emulator_t *) data;
+    chip8_t *chip8 = emu->chip8;
+
+    emu->slice_ticks = SDL_GetTicks();
+    start_ram_search(&emu->ram_search, chip8);
+    while (chip8->state != QUIT) {
+        emu->previous_slice_ticks = emu->slice_ticks;
+        emu->slice_ticks = SDL_GetTicks();
+        handle_commands(emu);
+        if (chip8->state == QUIT)
+            break;
+        if (chip8->state == PAUSED) {
+            //nothing to do until the SDL thread queues a command
+            SDL_PauseAudioDevice(emu->sdl.dev, 1);
+            SDL_SemWait(emu->wakeup);
+            continue;
+        }
+#ifndef _WIN32
+        if (emu->rollback) {
+            netplay_slice(emu);
+            continue;
+        }
+#endif
+        const uint64_t start = SDL_GetPerformanceCounter();
+        if (emu->resume_sent_at) {
+            const double latency = (double) ((start - emu->resume_sent_at) * 1000) / SDL_GetPerformanceFrequency();
+            printf("====Resumed==== (resume latency: %.3f ms)\n", latency);
+            emu->resume_sent_at = 0;
+        }
+        //a slice that overran its budget starts from where it should have ended,
+        //one cut short by the display wait does not carry the unused budget over
+        const uint64_t slice_start = chip8->cycles < emu->slice_end ? chip8->cycles : emu->slice_end;
+        emu->slice_end = slice_start + slice_budget(emu->config);
+        const uint64_t cycles_before = chip8->cycles;
+        uint32_t executed = 0;
+        while (chip8->cycles < emu->slice_end) {
+            apply_input(emu, chip8->cycles);
+#ifdef CHIP8_AOT
+            //a compiled block stops where the interpreter would next apply input or end the slice
+            uint64_t limit = emu->slice_end;
+            if (emu->pending_head != emu->pending_tail && emu->pending[emu->pending_head].cycle < limit)
+                limit = emu->pending[emu->pending_head].cycle;
+            const uint32_t compiled = chip8_aot_run(chip8, emu->config, limit);
+            if (compiled) {
+                executed += compiled;
+            } else
+#endif
+            {
+                emulate_instruction(chip8, emu->config);
+                executed++;
+            }
+            if (display_wait(chip8, emu->config)) {
+                emu->profile.display_waits++;
+                if (chip8->cycles < emu->slice_end)
+                    emu->profile.skipped_cycles += emu->slice_end - chip8->cycles;
+                break;
+            }
+        }
+        //key changes meant for the part of the slice the display wait cut off still belong to this frame
+        apply_input(emu, emu->slice_end - 1);
+        emu->slice_cycles = (uint32_t) (chip8->cycles - cycles_before);
+        emu->profile.slices++;
+        emu->profile.instructions += executed;
+        emu->profile.cycles += chip8->cycles - cycles_before;
+        emu->profile.emulation_ticks += SDL_GetPerformanceCounter() - start;
+        //timers and audio keep running while hidden, only the colour fade and publishing are skipped
+        const chip8_t *shown = emu->run_ahead && !emu->window_hidden ? run_ahead(emu) : chip8;
+        if (shown->display_hash != emu->render.display_hash && !emu->window_hidden)
+            send_frame(emu, shown);
+        update_audio(emu->sdl, chip8);
+        update_timers(chip8);
+        const uint64_t end = SDL_GetPerformanceCounter();
+        check_frame_budget(emu, end - start);
+        double time_elapsed = (double) ((end - start) * 1000) / SDL_GetPerformanceFrequency();
+        SDL_Delay(FRAME_BUDGET_MS > time_elapsed ? FRAME_BUDGET_MS - time_elapsed : 0);
     }
+    print_profile(&emu->profile);
+#ifndef _WIN32
+    if (emu->rollback) {
+        const rollback_stats_t *stats = &emu->rollback->stats;
+        printf("====Netplay==== %llu frames, %llu stalled, %llu rollbacks resimulating %llu frames (%.3f ms at "
+               "most), %llu desynced\n", (unsigned long long) stats->frames, (unsigned long long) stats->stalls,
+               (unsigned long long) stats->rollbacks, (unsigned long long) stats->resimulated,
+               stats->max_rollback_ns / 1e6, (unsigned long long) stats->desyncs);
+    }
+#endif
+    return 0;
 }
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <rom-path>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <rom-path> [--display-wait] [--trace] [--netplay <port> <peer host:port> [--input-delay N]]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     sdl_t sdl = {0};
@@ -903,23 +872,66 @@ int main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
     clear_screen(sdl, config);
-    srand(time(NULL));
-    while (chip8.state != QUIT) {
-        handle_input(&chip8, &config);
-        if (chip8.state == PAUSED)
-            continue;
-        const uint64_t start = SDL_GetPerformanceCounter();
-        for (uint32_t i = 0; i < config.insts_per_second / 60; i++)
-            emulate_instruction(&chip8, config);
-        const uint64_t end = SDL_GetPerformanceCounter();
-        double time_elapsed = (double) ((end - start) * 1000) / SDL_GetPerformanceFrequency();
-        SDL_Delay(16.67f > time_elapsed ? 16.67f - time_elapsed : 0);
-        if (chip8.draw) {
-            update_screen(sdl, config, &chip8);
-            chip8.draw = false;
+    const char *netplay_port = NULL;
+    const char *netplay_peer = NULL;
+    uint32_t input_delay = 2;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--netplay") == 0 && i + 2 < argc) {
+            netplay_port = argv[i + 1];
+            netplay_peer = argv[i + 2];
+        }
+        if (strcmp(argv[i], "--input-delay") == 0 && i + 1 < argc)
+            input_delay = (uint32_t) strtoul(argv[i + 1], NULL, 10);
+    }
+    //without --seed CXNN differs from run to run, a reset replays the same sequence. Netplay peers
+    //have to agree on it, they use 1.
+    if (!config.rng_seed)
+        config.rng_seed = netplay_peer ? 1 : (uint32_t) time(NULL);
+    chip8.rng = config.rng_seed;
+
+    emulator_t emu = {
+            .chip8 = &chip8,
+            .config = config,
+            .sdl = sdl,
+            .run_ahead = config.run_ahead,
+            .frames = {.back = 0, .front = 2},
+            .wakeup = SDL_CreateSemaphore(0),
+            .frame_event = SDL_RegisterEvents(1),
+    };
+    SDL_AtomicSet(&emu.frames.middle, 1);
+    reset_render(&emu.render, config);
+    if (netplay_peer) {
+#ifndef _WIN32
+        static rollback_t rollback;
+        if (!init_rollback(&rollback, config, romName, (uint16_t) strtoul(netplay_port, NULL, 10), netplay_peer,
+                           input_delay))
+            exit(EXIT_FAILURE);
+        emu.rollback = &rollback;
+        emu.chip8 = &rollback.machine;
+#else
+        fprintf(stderr, "Netplay is not available on this platform\n");
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    SDL_Thread *emulation = SDL_CreateThread(emulation_thread, "emulation", &emu);
+    if (!emulation) {
+        SDL_Log("Could not create emulation thread: %s\n", SDL_GetError());
+        exit(EXIT_FAILURE);
+    }
+    //the SDL thread only handles events and presents frames, it sleeps until either arrives
+    while (handle_input(&emu, &config)) {
+        if (!emu.hidden && (acquire_frame(&emu.frames) || emu.redraw)) {
+            update_screen(sdl, config, &emu.frames.frames[emu.frames.front]);
+            emu.redraw = false;
         }
-        update_timers(sdl, &chip8);
+        SDL_WaitEvent(NULL);
     }
+    while (!push_command(&emu.commands, (command_t) {.type = CMD_QUIT}))
+        SDL_Delay(1);
+    SDL_SemPost(emu.wakeup);
+    SDL_WaitThread(emulation, NULL);
+    SDL_DestroySemaphore(emu.wakeup);
     quit_sdl(sdl);
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,110 @@
+#ifndef CHIP8_H
+#define CHIP8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//CHIP8 Extension
+typedef enum {
+    CHIP8,
+    SUPERCHIP,
+    XOCHIP,
+} extension_t;
+
+//how a frame slice is budgeted
+typedef enum {
+    TIMING_INSTRUCTIONS, // every instruction costs one cycle, insts_per_second / 60 per slice
+    TIMING_COSMAC_VIP,   // per-opcode machine cycle costs, cycles_per_frame per slice
+} timing_t;
+
+#define CHIP8_CACHE_LINE 64
+
+//config stuff
+typedef struct {
+    uint32_t windowWidth;
+    uint32_t windowHeight;
+    uint32_t fgColor;
+    uint32_t bgColor;
+    uint32_t scaleFactor;
+    bool pixelOutlines;
+    uint32_t insts_per_second;
+    uint32_t square_wave_freq;
+    uint32_t audio_sample_rate;
+    int16_t volume;
+    float color_lerp_rate;
+    extension_t extension;
+    bool display_wait; // CHIP8 only: DXYN waits for the vertical blank, ending the frame slice (--display-wait)
+    timing_t timing;
+    uint32_t cycles_per_frame; // machine cycles per slice under TIMING_COSMAC_VIP
+    uint32_t rng_seed;         // CXNN sequence, the same seed and inputs give the same run
+    bool huge_pages;           // back instance pools (batch, scheduler) with huge pages where available
+    uint32_t run_ahead;        // frontend: frames shown ahead of the machine to hide input lag, 0 off
+    bool trace;                // print every instruction executed (--trace)
+} config_t;
+
+//emulator states
+typedef enum {
+    QUIT,
+    RUNNING,
+    PAUSED,
+} emulator_state_t;
+
+//instruction struct
+typedef struct {
+    uint16_t opcode;
+    uint16_t NNN; // 12 bit address/constant
+    uint8_t NN;   //  8 bit constant
+    uint8_t N;    //  4 bit constant
+    uint8_t X;    //  4 bit register identifier
+    uint8_t Y;    //  4 bit register identifier
+} instruction_t;
+
+//chip8 struct. The registers every instruction touches come first and share the first few cache
+//lines, the bulk state (RAM, display) follows starting on a line of its own. Nothing here is only
+//for show, how pixels are drawn is up to the frontend.
+typedef struct {
+    emulator_state_t state;
+    uint8_t V[16]; //V0-VF registers
+    uint16_t I; //Index Register
+    uint16_t PC; //Program counter
+    uint8_t delayTimer;
+    uint8_t soundTimer;
+    uint8_t wait_key; // key FX0A saw pressed and waits to be released, 0xFF while none
+    uint16_t stack[12];
+    uint16_t *stackPtr;
+    bool keypad[16];
+    uint32_t rng;     // CXNN generator state
+    instruction_t inst;
+    uint64_t cycles; // machine cycles since reset, see timing_t
+    uint64_t ram_hash;     // kept up to date on every RAM write, see state_hash
+    uint64_t display_hash; // kept up to date on every pixel change
+    uint16_t ram_dirty;    // one bit per 256-byte RAM page written since the last clone
+    bool display_dirty;    // display changed since the last clone
+    const char *romName;
+    _Alignas(CHIP8_CACHE_LINE) uint8_t ram[4096];
+    bool display[64 * 32];
+} chip8_t;
+
+uint64_t hash_bytes(const void *data, size_t length, const uint64_t seed);
+bool set_config(config_t *config, int argc, char **argv);
+bool init_chip8_rom(chip8_t *chip8, const config_t config, const char *romName, const uint8_t *rom,
+                    const size_t size);
+bool init_chip8(chip8_t *chip8, const config_t config, const char *romName);
+void copy_chip8(chip8_t *dest, const chip8_t *src);
+uint32_t instruction_cycles(const chip8_t *chip8, const config_t config);
+void emulate_instruction(chip8_t *chip8, config_t config);
+void update_timers(chip8_t *chip8);
+uint32_t slice_budget(const config_t config);
+bool display_wait(const chip8_t *chip8, const config_t config);
+uint32_t run_frame(chip8_t *chip8, const config_t config);
+uint64_t state_hash(const chip8_t *chip8);
+uint64_t rehash_state(const chip8_t *chip8);
+
+//runs the ahead-of-time compiled block at chip8->PC and returns how many instructions it executed,
+//0 if there is no block for PC or its code was modified, or config.trace is set. The block stops
+//early after the instruction that brings chip8->cycles to limit. Generated by chip8_aot, see
+//CHIP8_AOT_ROMS.
+uint32_t chip8_aot_run(chip8_t *chip8, const config_t config, const uint64_t limit);
+
+#endif
@@ -0,0 +1,880 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "corpus.h"
+#include "observation.h"
+
+//chip8d: emulator service. Listens on a Unix socket and runs jobs on a pool of worker threads that is
+//started once, with ROMs loaded once and copied for each job that uses them. ROMs are files or come
+//from a corpus pack (--corpus, see corpus.h) mapped at start up. Requests and replies are NDJSON, one
+//object per line:
+//  {"id": 1, "rom": "pong.ch8", "seed": 7, "frames": 600, "cycles": 0, "movie": "5--5A", "every": 60,
+//   "outputs": ["hash", "registers", "display"]}
+//      "rom_id": 12 instead of "rom" picks a ROM of the corpus by ID, "rom" takes a name in it as well.
+//      Runs frames frames (default 60), or until the machine has used cycles machine cycles. The movie
+//      holds the key for each frame, a hex digit or '-' for none (chip8_tas output joined up); frames
+//      past its end hold nothing. With every, a progress line carrying the state hash streams back
+//      every that many frames.
+//  {"cancel": 1}
+//      stops the job with that id, queued or running, its reply has "status": "cancelled". Jobs of the
+//      same connection are looked at first, then those of every other one.
+//Every job ends with one reply, {"id": 1, "status": "ok", "frames": 600, ...the requested outputs}, or
+//"status": "error" with an "error" message. Replies of different jobs can come in any order.
+//Backpressure: the job queue is bounded (--queue). While it is full the connection is not read from,
+//so a client sending faster than the workers run blocks in its own writes. A cancel sent behind such
+//a backlog is only read once the jobs before it were queued, to stop one sooner send the cancel on a
+//second connection. A connection that is shut down for writing gets the replies of its remaining jobs
+//and is then closed. Replies are queued on their connection and sent by a thread of its own, so a
+//client that stops reading only stalls itself: once it leaves MAX_UNSENT bytes unread, or a send
+//waits SEND_TIMEOUT seconds, it is treated as gone and its jobs are cancelled.
+//  chip8d <socket-path> [--threads N] [--queue N] [--corpus pack] [--seed N] [--vip-timing] [--display-wait]
+//  chip8d --client <socket-path>   sends stdin, prints every reply, for testing on localhost
+
+#define MAX_THREADS 64
+#define MAX_ROMS 64
+#define MAX_LINE (16 << 20)
+#define MAX_ID 64
+#define MAX_UNSENT (16 << 20)
+#define SEND_TIMEOUT 30
+
+#define OUTPUT_HASH 0x1
+#define OUTPUT_REGISTERS 0x2
+#define OUTPUT_DISPLAY 0x4
+
+typedef struct connection connection_t;
+
+typedef struct job {
+    char id[MAX_ID];     // as it appeared in the request, a JSON number or string
+    char *rom;
+    uint32_t seed;
+    bool seeded;
+    uint32_t frames;
+    uint64_t cycles;
+    char *movie;
+    uint32_t every;
+    uint8_t outputs;
+    connection_t *connection;
+    atomic_bool cancelled;
+    struct job *next;    // in the connection's list of unfinished jobs
+} job_t;
+
+struct connection {
+    int fd;
+    pthread_mutex_t lock;   // guards jobs, pending, outgoing, closing and broken, never held across send()
+    pthread_cond_t drained; // pending dropped to 0
+    pthread_cond_t output;  // outgoing gained bytes, or closing was set
+    job_t *jobs;
+    uint32_t pending;
+    char *outgoing;         // replies not handed to the writer yet
+    size_t outgoing_length;
+    size_t outgoing_capacity;
+    bool closing;           // no more replies come, the writer exits once outgoing is sent
+    bool broken;            // a write failed or too much was left unread, the client is gone
+    pthread_t writer;
+    atomic_uint refs;       // the connection's own thread, and cancels from other connections looking at it
+    connection_t *next;     // in daemon_t.connections
+};
+
+typedef struct {
+    char path[4096];
+    chip8_t *initial;
+} rom_t;
+
+typedef struct {
+    config_t config;
+    job_t **queue; // ring of queue_capacity jobs
+    uint32_t queue_capacity;
+    uint32_t queue_head;
+    uint32_t queue_count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    rom_t roms[MAX_ROMS];
+    uint32_t rom_count;
+    pthread_mutex_t roms_lock;
+    corpus_t corpus;           // --corpus, mapped for as long as the daemon runs
+    connection_t *connections; // open ones, for cancels arriving on another connection
+    uint32_t connection_count;
+    pthread_mutex_t connections_lock;
+} daemon_t;
+
+static daemon_t daemon_state;
+
+//JSON, only as much as the requests need: flat objects of strings, numbers and arrays of strings
+
+static const char *skip_space(const char *at) {
+    while (*at == ' ' || *at == '\t' || *at == '\r' || *at == '\n')
+        at++;
+    return at;
+}
+
+//a string value, unescaped into a new allocation. NULL on malformed input.
+static char *parse_string(const char **at) {
+    const char *from = skip_space(*at);
+    if (*from != '"')
+        return NULL;
+    from++;
+    char *text = malloc(strlen(from) + 1);
+    if (!text)
+        return NULL;
+    size_t length = 0;
+    for (;;) {
+        char c = *from++;
+        if (c == '\0') {
+            free(text);
+            return NULL;
+        }
+        if (c == '"')
+            break;
+        if (c == '\\') {
+            c = *from++;
+            static const char escapes[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+            const char *escape = c ? strchr(escapes, c) : NULL;
+            if (c == 'u' && strlen(from) >= 4) {
+                //only the ASCII range is meaningful in paths and movies
+                char hex[5] = {from[0], from[1], from[2], from[3], '\0'};
+                c = (char) (strtoul(hex, NULL, 16) & 0x7F);
+                from += 4;
+            } else if (escape && (escape - escapes) % 2 == 0) {
+                c = escape[1];
+            } else {
+                free(text);
+                return NULL;
+            }
+        }
+        text[length++] = c;
+    }
+    text[length] = '\0';
+    *at = from;
+    return text;
+}
+
+static bool parse_integer(const char **at, uint64_t *value) {
+    const char *from = skip_space(*at);
+    if (*from < '0' || *from > '9')
+        return false;
+    char *end;
+    *value = strtoull(from, &end, 10);
+    *at = end;
+    return true;
+}
+
+//an id is kept as JSON text so the reply can repeat it exactly
+static bool parse_id(const char **at, char id[MAX_ID]) {
+    const char *from = skip_space(*at);
+    if (*from == '"') {
+        char *text = parse_string(at);
+        if (!text)
+            return false;
+        //ids go back out between quotes, keep them to characters that need no escaping
+        bool plain = strlen(text) + 3 <= MAX_ID;
+        for (const char *c = text; plain && *c; c++)
+            plain = *c >= ' ' && *c != '"' && *c != '\\';
+        if (plain)
+            snprintf(id, MAX_ID, "\"%s\"", text);
+        free(text);
+        return plain;
+    }
+    uint64_t number;
+    if (!parse_integer(at, &number))
+        return false;
+    snprintf(id, MAX_ID, "%llu", (unsigned long long) number);
+    return true;
+}
+
+//skips any value, nested ones included
+static bool skip_value(const char **at) {
+    const char *from = skip_space(*at);
+    if (*from == '"') {
+        char *text = parse_string(at);
+        free(text);
+        return text != NULL;
+    }
+    if (*from == '{' || *from == '[') {
+        uint32_t depth = 0;
+        do {
+            if (*from == '"') {
+                char *text = parse_string(&from);
+                if (!text)
+                    return false;
+                free(text);
+                continue;
+            }
+            if (*from == '\0')
+                return false;
+            if (*from == '{' || *from == '[')
+                depth++;
+            else if (*from == '}' || *from == ']')
+                depth--;
+            from++;
+        } while (depth);
+        *at = from;
+        return true;
+    }
+    while (*from && *from != ',' && *from != '}' && *from != ']')
+        from++;
+    *at = from;
+    return true;
+}
+
+static bool parse_outputs(const char **at, uint8_t *outputs) {
+    const char *from = skip_space(*at);
+    if (*from++ != '[')
+        return false;
+    from = skip_space(from);
+    while (*from != ']') {
+        char *name = parse_string(&from);
+        if (!name)
+            return false;
+        if (strcmp(name, "hash") == 0)
+            *outputs |= OUTPUT_HASH;
+        else if (strcmp(name, "registers") == 0)
+            *outputs |= OUTPUT_REGISTERS;
+        else if (strcmp(name, "display") == 0)
+            *outputs |= OUTPUT_DISPLAY;
+        free(name);
+        from = skip_space(from);
+        if (*from == ',')
+            from = skip_space(from + 1);
+        else if (*from != ']')
+            return false;
+    }
+    *at = from + 1;
+    return true;
+}
+
+//a job or a cancel (cancel set, the id in job->id). False on anything else, error says why.
+static bool parse_request(const char *line, job_t *job, bool *cancel, const char **error) {
+    memset(job, 0, sizeof(*job));
+    job->frames = 60;
+    *cancel = false;
+    *error = "malformed request";
+    const char *at = skip_space(line);
+    if (*at++ != '{')
+        return false;
+    at = skip_space(at);
+    while (*at != '}') {
+        char *key = parse_string(&at);
+        if (!key)
+            return false;
+        at = skip_space(at);
+        if (*at++ != ':') {
+            free(key);
+            return false;
+        }
+        bool parsed;
+        uint64_t number = 0;
+        if (strcmp(key, "id") == 0) {
+            parsed = parse_id(&at, job->id);
+        } else if (strcmp(key, "cancel") == 0) {
+            parsed = parse_id(&at, job->id);
+            *cancel = true;
+        } else if (strcmp(key, "rom") == 0) {
+            free(job->rom);
+            parsed = (job->rom = parse_string(&at)) != NULL;
+        } else if (strcmp(key, "rom_id") == 0) {
+            char id[24];
+            parsed = parse_integer(&at, &number);
+            snprintf(id, sizeof(id), "%llu", (unsigned long long) number);
+            free(job->rom);
+            job->rom = strdup(id);
+        } else if (strcmp(key, "movie") == 0) {
+            free(job->movie);
+            parsed = (job->movie = parse_string(&at)) != NULL;
+        } else if (strcmp(key, "outputs") == 0) {
+            parsed = parse_outputs(&at, &job->outputs);
+        } else if (strcmp(key, "seed") == 0) {
+            parsed = parse_integer(&at, &number);
+            job->seed = (uint32_t) number;
+            job->seeded = true;
+        } else if (strcmp(key, "frames") == 0) {
+            parsed = parse_integer(&at, &number);
+            job->frames = (uint32_t) number;
+        } else if (strcmp(key, "cycles") == 0) {
+            parsed = parse_integer(&at, &job->cycles);
+        } else if (strcmp(key, "every") == 0) {
+            parsed = parse_integer(&at, &number);
+            job->every = (uint32_t) number;
+        } else {
+            parsed = skip_value(&at);
+        }
+        free(key);
+        if (!parsed)
+            return false;
+        at = skip_space(at);
+        if (*at == ',')
+            at = skip_space(at + 1);
+        else if (*at != '}')
+            return false;
+    }
+    if (!job->id[0]) {
+        *error = "missing id";
+        return false;
+    }
+    if (!*cancel && !job->rom) {
+        *error = "missing rom";
+        return false;
+    }
+    for (const char *key = job->movie; key && *key; key++) {
+        if (*key != '-' && !strchr("0123456789abcdefABCDEF", *key)) {
+            *error = "movie holds a character that is neither a hex digit nor '-'";
+            return false;
+        }
+    }
+    return true;
+}
+
+static void free_job(job_t *job) {
+    free(job->rom);
+    free(job->movie);
+    free(job);
+}
+
+//replies
+
+//under connection->lock: nobody reads the replies any more, the jobs stop
+static void break_connection(connection_t *connection) {
+    connection->broken = true;
+    connection->outgoing_length = 0;
+    for (job_t *job = connection->jobs; job; job = job->next)
+        atomic_store(&job->cancelled, true);
+}
+
+//queues a whole line for the connection's writer, never blocks on the client
+static void send_line(connection_t *connection, const char *line, const size_t length) {
+    pthread_mutex_lock(&connection->lock);
+    if (!connection->broken && connection->outgoing_length + length > connection->outgoing_capacity) {
+        size_t capacity = connection->outgoing_capacity ? connection->outgoing_capacity : 4096;
+        while (capacity < connection->outgoing_length + length)
+            capacity *= 2;
+        char *grown = capacity <= MAX_UNSENT ? realloc(connection->outgoing, capacity) : NULL;
+        if (grown) {
+            connection->outgoing = grown;
+            connection->outgoing_capacity = capacity;
+        } else {
+            break_connection(connection);
+        }
+    }
+    if (!connection->broken) {
+        memcpy(connection->outgoing + connection->outgoing_length, line, length);
+        connection->outgoing_length += length;
+        pthread_cond_signal(&connection->output);
+    }
+    pthread_mutex_unlock(&connection->lock);
+}
+
+//the connection's writer thread: takes whatever replies are queued and sends them with the lock released
+static void *write_replies(void *data) {
+    connection_t *connection = (connection_t *) data;
+    char *sending = NULL;
+    size_t sending_capacity = 0;
+    pthread_mutex_lock(&connection->lock);
+    for (;;) {
+        while (!connection->outgoing_length && !connection->closing && !connection->broken)
+            pthread_cond_wait(&connection->output, &connection->lock);
+        if (connection->broken || !connection->outgoing_length)
+            break;
+        //swap buffers, send_line() keeps appending to the other one meanwhile
+        char *buffer = connection->outgoing;
+        const size_t length = connection->outgoing_length;
+        const size_t capacity = connection->outgoing_capacity;
+        connection->outgoing = sending;
+        connection->outgoing_capacity = sending_capacity;
+        connection->outgoing_length = 0;
+        sending = buffer;
+        sending_capacity = capacity;
+        pthread_mutex_unlock(&connection->lock);
+
+        size_t sent = 0;
+        while (sent < length) {
+            const ssize_t written = send(connection->fd, sending + sent, length - sent, MSG_NOSIGNAL);
+            if (written <= 0)
+                break;
+            sent += (size_t) written;
+        }
+        pthread_mutex_lock(&connection->lock);
+        if (sent < length)
+            break_connection(connection);
+    }
+    pthread_mutex_unlock(&connection->lock);
+    free(sending);
+    return NULL;
+}
+
+static void send_error(connection_t *connection, const char *id, const char *error) {
+    char line[256];
+    const int length = snprintf(line, sizeof(line), "{\"id\": %s, \"status\": \"error\", \"error\": \"%s\"}\n",
+                                id[0] ? id : "null", error);
+    send_line(connection, line, (size_t) length);
+}
+
+//the final reply of a job, with the outputs it asked for
+static void send_result(const job_t *job, const chip8_t *chip8, const uint32_t frames) {
+    char line[2048];
+    int length = snprintf(line, sizeof(line), "{\"id\": %s, \"status\": \"%s\", \"frames\": %u, \"cycles\": %llu",
+                          job->id, atomic_load(&job->cancelled) ? "cancelled" : "ok", frames,
+                          (unsigned long long) chip8->cycles);
+    if (job->outputs & OUTPUT_HASH)
+        length += snprintf(line + length, sizeof(line) - length, ", \"hash\": \"%016llx\"",
+                           (unsigned long long) state_hash(chip8));
+    if (job->outputs & OUTPUT_REGISTERS) {
+        length += snprintf(line + length, sizeof(line) - length, ", \"V\": [");
+        for (uint8_t i = 0; i < 16; i++)
+            length += snprintf(line + length, sizeof(line) - length, i ? ", %u" : "%u", chip8->V[i]);
+        length += snprintf(line + length, sizeof(line) - length,
+                           "], \"I\": %u, \"PC\": %u, \"DT\": %u, \"ST\": %u", chip8->I, chip8->PC,
+                           chip8->delayTimer, chip8->soundTimer);
+    }
+    if (job->outputs & OUTPUT_DISPLAY) {
+        //packed rows, bit x of each little endian 64 bit row is pixel x
+        packed_display_t display;
+        pack_display(chip8, &display);
+        const uint8_t *bytes = (const uint8_t *) display.rows;
+        length += snprintf(line + length, sizeof(line) - length, ", \"display\": \"");
+        for (uint32_t i = 0; i < sizeof(display.rows); i++)
+            length += snprintf(line + length, sizeof(line) - length, "%02x", bytes[i]);
+        length += snprintf(line + length, sizeof(line) - length, "\"");
+    }
+    length += snprintf(line + length, sizeof(line) - length, "}\n");
+    send_line(job->connection, line, (size_t) length);
+}
+
+//a ROM from the --corpus pack by name or ID, or else a file (or "<pack>#<ID or name>")
+static bool init_rom(daemon_t *daemon, chip8_t *chip8, const char *name) {
+    const int64_t id = daemon->corpus.count ? parse_corpus_id(&daemon->corpus, name) : -1;
+    if (id < 0)
+        return init_chip8(chip8, daemon->config, name);
+    size_t size;
+    const uint8_t *rom = corpus_rom(&daemon->corpus, (uint32_t) id, &size);
+    return init_chip8_rom(chip8, daemon->config, name, rom, size);
+}
+
+//the ROM already kept loaded under name, NULL if there is none. Under roms_lock.
+static const chip8_t *find_rom(const daemon_t *daemon, const char *name) {
+    for (uint32_t i = 0; i < daemon->rom_count; i++) {
+        if (strcmp(daemon->roms[i].path, name) == 0)
+            return daemon->roms[i].initial;
+    }
+    return NULL;
+}
+
+//chip8 set to the machine right after loading name. The first MAX_ROMS ROMs asked for are kept
+//loaded, others are loaded for every job. Loading happens outside roms_lock so one slow or missing
+//file holds up no other worker; two workers loading the same ROM keep whichever is published first.
+static bool load_rom(daemon_t *daemon, chip8_t *chip8, const char *name) {
+    pthread_mutex_lock(&daemon->roms_lock);
+    const chip8_t *initial = find_rom(daemon, name);
+    const bool keep = !initial && daemon->rom_count < MAX_ROMS && strlen(name) < sizeof(daemon->roms[0].path);
+    pthread_mutex_unlock(&daemon->roms_lock);
+    if (initial) {
+        copy_chip8(chip8, initial);
+        return true;
+    }
+    if (!keep)
+        return init_rom(daemon, chip8, name);
+
+    chip8_t *loaded = aligned_alloc(CHIP8_CACHE_LINE, sizeof(chip8_t));
+    if (!loaded || !init_rom(daemon, loaded, name)) {
+        free(loaded);
+        return false;
+    }
+    pthread_mutex_lock(&daemon->roms_lock);
+    initial = find_rom(daemon, name);
+    if (!initial && daemon->rom_count < MAX_ROMS) {
+        rom_t *rom = &daemon->roms[daemon->rom_count++];
+        strcpy(rom->path, name);
+        loaded->romName = rom->path; // name goes away with the job
+        rom->initial = loaded;
+        initial = loaded;
+    }
+    pthread_mutex_unlock(&daemon->roms_lock);
+    //kept ROMs are never freed or changed, so they can be copied without the lock
+    copy_chip8(chip8, initial ? initial : loaded);
+    if (initial != loaded)
+        free(loaded);
+    return true;
+}
+
+static uint8_t hex_value(const char digit) {
+    return digit <= '9' ? digit - '0' : (digit | 0x20) - 'a' + 10;
+}
+
+static void run_job(daemon_t *daemon, job_t *job, chip8_t *chip8) {
+    if (!load_rom(daemon, chip8, job->rom)) {
+        send_error(job->connection, job->id, "could not load rom");
+        return;
+    }
+    chip8->rng = job->seeded ? job->seed : daemon->config.rng_seed;
+    const size_t movie_length = job->movie ? strlen(job->movie) : 0;
+    uint32_t frame = 0;
+    while (frame < job->frames && !(job->cycles && chip8->cycles >= job->cycles) &&
+           !atomic_load(&job->cancelled)) {
+        memset(chip8->keypad, false, sizeof(chip8->keypad));
+        if (frame < movie_length && job->movie[frame] != '-')
+            chip8->keypad[hex_value(job->movie[frame])] = true;
+        run_frame(chip8, daemon->config);
+        frame++;
+        if (job->every && frame % job->every == 0 && frame < job->frames) {
+            char line[128];
+            const int length = snprintf(line, sizeof(line), "{\"id\": %s, \"frame\": %u, \"hash\": \"%016llx\"}\n",
+                                        job->id, frame, (unsigned long long) state_hash(chip8));
+            send_line(job->connection, line, (size_t) length);
+        }
+    }
+    send_result(job, chip8, frame);
+}
+
+//takes the job off its connection, the last one lets the connection close
+static void finish_job(job_t *job) {
+    connection_t *connection = job->connection;
+    pthread_mutex_lock(&connection->lock);
+    for (job_t **link = &connection->jobs; *link; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            break;
+        }
+    }
+    if (--connection->pending == 0)
+        pthread_cond_signal(&connection->drained);
+    pthread_mutex_unlock(&connection->lock);
+    free_job(job);
+}
+
+static void *worker(void *data) {
+    daemon_t *daemon = (daemon_t *) data;
+    chip8_t *chip8 = aligned_alloc(CHIP8_CACHE_LINE, sizeof(chip8_t));
+    if (!chip8) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (;;) {
+        pthread_mutex_lock(&daemon->lock);
+        while (!daemon->queue_count)
+            pthread_cond_wait(&daemon->not_empty, &daemon->lock);
+        job_t *job = daemon->queue[daemon->queue_head];
+        daemon->queue_head = (daemon->queue_head + 1) % daemon->queue_capacity;
+        daemon->queue_count--;
+        pthread_cond_signal(&daemon->not_full);
+        pthread_mutex_unlock(&daemon->lock);
+
+        //a job cancelled while queued still gets its reply, without running
+        if (atomic_load(&job->cancelled)) {
+            char line[128];
+            const int length = snprintf(line, sizeof(line), "{\"id\": %s, \"status\": \"cancelled\", \"frames\": 0}\n",
+                                        job->id);
+            send_line(job->connection, line, (size_t) length);
+        } else {
+            run_job(daemon, job, chip8);
+        }
+        finish_job(job);
+    }
+    return NULL;
+}
+
+//connections
+
+//marks the jobs of owner with that id, returns whether there were any
+static bool cancel_jobs(connection_t *owner, const char *id) {
+    bool found = false;
+    pthread_mutex_lock(&owner->lock);
+    for (job_t *job = owner->jobs; job; job = job->next) {
+        if (strcmp(job->id, id) == 0) {
+            atomic_store(&job->cancelled, true);
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&owner->lock);
+    return found;
+}
+
+//the last reference closes the connection
+static void release_connection(connection_t *connection) {
+    if (atomic_fetch_sub(&connection->refs, 1) != 1)
+        return;
+    close(connection->fd);
+    pthread_mutex_destroy(&connection->lock);
+    pthread_cond_destroy(&connection->drained);
+    pthread_cond_destroy(&connection->output);
+    free(connection->outgoing);
+    free(connection);
+}
+
+static void cancel_job(daemon_t *daemon, connection_t *connection, const char *id) {
+    bool found = cancel_jobs(connection, id);
+    if (!found) {
+        //the other connections are only referenced under connections_lock, their locks are taken after it
+        //was released
+        pthread_mutex_lock(&daemon->connections_lock);
+        connection_t **others = malloc(sizeof(connection_t *) * (daemon->connection_count + 1));
+        uint32_t count = 0;
+        for (connection_t *other = daemon->connections; others && other; other = other->next) {
+            if (other != connection) {
+                atomic_fetch_add(&other->refs, 1);
+                others[count++] = other;
+            }
+        }
+        pthread_mutex_unlock(&daemon->connections_lock);
+        if (!others) {
+            send_error(connection, id, "out of memory");
+            return;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            found = cancel_jobs(others[i], id) || found;
+            release_connection(others[i]);
+        }
+        free(others);
+    }
+    if (!found)
+        send_error(connection, id, "no such job");
+}
+
+//blocks while the queue is full, which is where backpressure comes from
+static void queue_job(daemon_t *daemon, job_t *job) {
+    connection_t *connection = job->connection;
+    pthread_mutex_lock(&connection->lock);
+    job->next = connection->jobs;
+    connection->jobs = job;
+    connection->pending++;
+    if (connection->broken)
+        atomic_store(&job->cancelled, true);
+    pthread_mutex_unlock(&connection->lock);
+
+    pthread_mutex_lock(&daemon->lock);
+    while (daemon->queue_count == daemon->queue_capacity)
+        pthread_cond_wait(&daemon->not_full, &daemon->lock);
+    daemon->queue[(daemon->queue_head + daemon->queue_count++) % daemon->queue_capacity] = job;
+    pthread_cond_signal(&daemon->not_empty);
+    pthread_mutex_unlock(&daemon->lock);
+}
+
+static void handle_line(daemon_t *daemon, connection_t *connection, const char *line) {
+    if (!*skip_space(line))
+        return;
+    job_t *job = calloc(1, sizeof(job_t));
+    bool cancel;
+    const char *error;
+    if (!job) {
+        send_error(connection, "", "out of memory");
+    } else if (!parse_request(line, job, &cancel, &error)) {
+        send_error(connection, job->id, error);
+    } else if (cancel) {
+        cancel_job(daemon, connection, job->id);
+    } else {
+        job->connection = connection;
+        queue_job(daemon, job);
+        return;
+    }
+    if (job)
+        free_job(job);
+}
+
+static void *serve_connection(void *data) {
+    daemon_t *daemon = &daemon_state;
+    connection_t *connection = (connection_t *) data;
+    if (pthread_create(&connection->writer, NULL, write_replies, connection) != 0) {
+        fprintf(stderr, "Could not serve a connection\n");
+        release_connection(connection);
+        return NULL;
+    }
+    pthread_mutex_lock(&daemon->connections_lock);
+    connection->next = daemon->connections;
+    daemon->connections = connection;
+    daemon->connection_count++;
+    pthread_mutex_unlock(&daemon->connections_lock);
+
+    size_t capacity = 4096;
+    size_t length = 0;
+    char *buffer = malloc(capacity);
+    while (buffer) {
+        if (length + 1 == capacity) {
+            if (capacity >= MAX_LINE) {
+                send_error(connection, "", "request line too long");
+                break;
+            }
+            char *grown = realloc(buffer, capacity * 2);
+            if (!grown)
+                break;
+            buffer = grown;
+            capacity *= 2;
+        }
+        const ssize_t received = recv(connection->fd, buffer + length, capacity - length - 1, 0);
+        if (received < 0) {
+            //the client went away, nobody is left to read what its jobs would send
+            pthread_mutex_lock(&connection->lock);
+            for (job_t *job = connection->jobs; job; job = job->next)
+                atomic_store(&job->cancelled, true);
+            pthread_mutex_unlock(&connection->lock);
+        }
+        if (received <= 0)
+            break;
+        length += (size_t) received;
+        buffer[length] = '\0';
+        char *line = buffer;
+        char *newline;
+        while ((newline = strchr(line, '\n'))) {
+            *newline = '\0';
+            handle_line(daemon, connection, line);
+            line = newline + 1;
+        }
+        length -= (size_t) (line - buffer);
+        memmove(buffer, line, length);
+    }
+    free(buffer);
+
+    //the client is done sending, its jobs still get their replies
+    pthread_mutex_lock(&connection->lock);
+    while (connection->pending)
+        pthread_cond_wait(&connection->drained, &connection->lock);
+    connection->closing = true;
+    pthread_cond_signal(&connection->output);
+    pthread_mutex_unlock(&connection->lock);
+    pthread_join(connection->writer, NULL);
+    pthread_mutex_lock(&daemon->connections_lock);
+    for (connection_t **link = &daemon->connections; *link; link = &(*link)->next) {
+        if (*link == connection) {
+            *link = connection->next;
+            daemon->connection_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&daemon->connections_lock);
+    release_connection(connection);
+    return NULL;
+}
+
+static int open_socket(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        perror("socket");
+    return fd;
+}
+
+static int serve(const char *path, const uint32_t threads) {
+    struct sockaddr_un address;
+    const int listener = open_socket(path, &address);
+    if (listener < 0)
+        return EXIT_FAILURE;
+    unlink(path);
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, &daemon_state) != 0) {
+            fprintf(stderr, "Could not start worker %u\n", i);
+            return EXIT_FAILURE;
+        }
+        pthread_detach(thread);
+    }
+    fprintf(stderr, "chip8d: %u workers, queue of %u jobs, listening on %s\n", threads,
+            daemon_state.queue_capacity, path);
+
+    for (;;) {
+        const int fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            perror("accept");
+            continue;
+        }
+        connection_t *connection = calloc(1, sizeof(connection_t));
+        pthread_t thread;
+        if (connection) {
+            //a send that waits this long is a client that stopped reading, see write_replies()
+            const struct timeval timeout = {.tv_sec = SEND_TIMEOUT};
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            connection->fd = fd;
+            atomic_init(&connection->refs, 1);
+            pthread_mutex_init(&connection->lock, NULL);
+            pthread_cond_init(&connection->drained, NULL);
+            pthread_cond_init(&connection->output, NULL);
+        }
+        if (!connection || pthread_create(&thread, NULL, serve_connection, connection) != 0) {
+            fprintf(stderr, "Could not serve a connection\n");
+            close(fd);
+            free(connection);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+
+//copies stdin to the daemon while printing its replies, until it closes the connection
+static int client(const char *path) {
+    struct sockaddr_un address;
+    const int fd = open_socket(path, &address);
+    if (fd < 0)
+        return EXIT_FAILURE;
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    if (fork() == 0) {
+        char buffer[4096];
+        size_t length;
+        while ((length = fread(buffer, 1, sizeof(buffer), stdin)) > 0) {
+            if (send(fd, buffer, length, MSG_NOSIGNAL) != (ssize_t) length)
+                break;
+        }
+        shutdown(fd, SHUT_WR);
+        _exit(EXIT_SUCCESS);
+    }
+    char buffer[4096];
+    ssize_t received;
+    while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        fwrite(buffer, 1, (size_t) received, stdout);
+        fflush(stdout);
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "--client") == 0)
+        exit(client(argv[2]));
+    if (argc < 2 || argv[1][0] == '-') {
+        fprintf(stderr, "Usage: %s <socket-path> [--threads N] [--queue N] [--corpus pack] [--seed N] [--vip-timing] [--display-wait]\n"
+                        "       %s --client <socket-path>\n",
+                argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    daemon_t *daemon = &daemon_state;
+    set_config(&daemon->config, argc, argv);
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    daemon->queue_capacity = 64;
+    for (int i = 2; i < argc - 1; i++) {
+        if (strcmp(argv[i], "--threads") == 0)
+            threads = strtol(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--queue") == 0)
+            daemon->queue_capacity = (uint32_t) strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--corpus") == 0 && !open_corpus(&daemon->corpus, argv[i + 1]))
+            exit(EXIT_FAILURE);
+    }
+    threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+    if (!daemon->queue_capacity)
+        daemon->queue_capacity = 1;
+    daemon->queue = malloc(sizeof(job_t *) * daemon->queue_capacity);
+    if (!daemon->queue) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&daemon->lock, NULL);
+    pthread_cond_init(&daemon->not_empty, NULL);
+    pthread_cond_init(&daemon->not_full, NULL);
+    pthread_mutex_init(&daemon->roms_lock, NULL);
+    pthread_mutex_init(&daemon->connections_lock, NULL);
+    exit(serve(argv[1], (uint32_t) threads));
+}
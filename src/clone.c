@@ -0,0 +1,168 @@
+#include <stdlib.h>
+#include <string.h>
+#include "clone.h"
+
+static bool init_block_store(block_store_t *store, const uint32_t block_size, const uint32_t capacity) {
+    *store = (block_store_t) {
+            .data = malloc((size_t) block_size * capacity),
+            .refs = malloc(sizeof(uint32_t) * capacity),
+            .free = malloc(sizeof(uint32_t) * capacity),
+            .block_size = block_size,
+            .capacity = capacity,
+    };
+    return store->data && store->refs && store->free;
+}
+
+static void free_block_store(block_store_t *store) {
+    free(store->data);
+    free(store->refs);
+    free(store->free);
+    memset(store, 0, sizeof(*store));
+}
+
+static uint8_t *block_data(const block_store_t *store, const uint32_t id) {
+    return &store->data[(size_t) id * store->block_size];
+}
+
+//hand out a block with one reference, reusing released ones before growing
+static bool alloc_block(block_store_t *store, uint32_t *id) {
+    if (store->free_count) {
+        *id = store->free[--store->free_count];
+    } else {
+        if (store->count == store->capacity) {
+            const uint32_t capacity = store->capacity * 2;
+            uint8_t *data = realloc(store->data, (size_t) store->block_size * capacity);
+            if (!data)
+                return false;
+            store->data = data;
+            uint32_t *refs = realloc(store->refs, sizeof(uint32_t) * capacity);
+            if (!refs)
+                return false;
+            store->refs = refs;
+            uint32_t *free_ids = realloc(store->free, sizeof(uint32_t) * capacity);
+            if (!free_ids)
+                return false;
+            store->free = free_ids;
+            store->capacity = capacity;
+        }
+        *id = store->count++;
+    }
+    store->refs[*id] = 1;
+    return true;
+}
+
+static void release_block(block_store_t *store, const uint32_t id) {
+    if (--store->refs[id] == 0)
+        store->free[store->free_count++] = id;
+}
+
+bool init_clone_pool(clone_pool_t *pool, const uint32_t initial_pages) {
+    const uint32_t pages = initial_pages ? initial_pages : CLONE_RAM_PAGES;
+    const uint32_t displays = pages / CLONE_RAM_PAGES ? pages / CLONE_RAM_PAGES : 1;
+    if (!init_block_store(&pool->pages, CLONE_PAGE_SIZE, pages) ||
+        !init_block_store(&pool->displays, sizeof(((chip8_t *) 0)->display), displays)) {
+        free_clone_pool(pool);
+        return false;
+    }
+    return true;
+}
+
+void free_clone_pool(clone_pool_t *pool) {
+    free_block_store(&pool->pages);
+    free_block_store(&pool->displays);
+}
+
+//snapshot the machine. base is the clone chip8 was captured to or restored from last, its pages and
+//display are shared wherever chip8 has not written since. Without a base everything is copied.
+bool capture_clone(clone_pool_t *pool, chip8_clone_t *clone, chip8_t *chip8, const chip8_clone_t *base) {
+    chip8_clone_t result = {
+            .I = chip8->I,
+            .PC = chip8->PC,
+            .stack_depth = chip8->stackPtr - chip8->stack,
+            .delayTimer = chip8->delayTimer,
+            .soundTimer = chip8->soundTimer,
+            .state = chip8->state,
+            .wait_key = chip8->wait_key,
+            .rng = chip8->rng,
+            .cycles = chip8->cycles,
+            .ram_hash = chip8->ram_hash,
+            .display_hash = chip8->display_hash,
+    };
+    memcpy(result.V, chip8->V, sizeof(result.V));
+    memcpy(result.stack, chip8->stack, sizeof(result.stack));
+    memcpy(result.keypad, chip8->keypad, sizeof(result.keypad));
+
+    for (uint32_t page = 0; page < CLONE_RAM_PAGES; page++) {
+        if (base && !(chip8->ram_dirty & (1 << page))) {
+            result.pages[page] = base->pages[page];
+            pool->pages.refs[base->pages[page]]++;
+            continue;
+        }
+        if (!alloc_block(&pool->pages, &result.pages[page])) {
+            while (page-- > 0)
+                release_block(&pool->pages, result.pages[page]);
+            return false;
+        }
+        memcpy(block_data(&pool->pages, result.pages[page]), &chip8->ram[page * CLONE_PAGE_SIZE], CLONE_PAGE_SIZE);
+    }
+
+    if (base && !chip8->display_dirty) {
+        result.display = base->display;
+        pool->displays.refs[base->display]++;
+    } else {
+        if (!alloc_block(&pool->displays, &result.display)) {
+            for (uint32_t page = 0; page < CLONE_RAM_PAGES; page++)
+                release_block(&pool->pages, result.pages[page]);
+            return false;
+        }
+        memcpy(block_data(&pool->displays, result.display), chip8->display, sizeof(chip8->display));
+    }
+
+    chip8->ram_dirty = 0;
+    chip8->display_dirty = false;
+    *clone = result;
+    return true;
+}
+
+//load a clone into the machine. base is the clone chip8 was captured to or restored from last,
+//only the pages that differ from it or were written since are copied. Without a base everything is.
+void restore_clone(clone_pool_t *pool, chip8_t *chip8, const chip8_clone_t *clone, const chip8_clone_t *base) {
+    for (uint32_t page = 0; page < CLONE_RAM_PAGES; page++) {
+        if (base && base->pages[page] == clone->pages[page] && !(chip8->ram_dirty & (1 << page)))
+            continue;
+        memcpy(&chip8->ram[page * CLONE_PAGE_SIZE], block_data(&pool->pages, clone->pages[page]), CLONE_PAGE_SIZE);
+    }
+    if (!base || base->display != clone->display || chip8->display_dirty)
+        memcpy(chip8->display, block_data(&pool->displays, clone->display), sizeof(chip8->display));
+
+    memcpy(chip8->V, clone->V, sizeof(chip8->V));
+    memcpy(chip8->stack, clone->stack, sizeof(chip8->stack));
+    memcpy(chip8->keypad, clone->keypad, sizeof(chip8->keypad));
+    chip8->I = clone->I;
+    chip8->PC = clone->PC;
+    chip8->stackPtr = &chip8->stack[clone->stack_depth];
+    chip8->delayTimer = clone->delayTimer;
+    chip8->soundTimer = clone->soundTimer;
+    chip8->state = clone->state;
+    chip8->wait_key = clone->wait_key;
+    chip8->rng = clone->rng;
+    chip8->cycles = clone->cycles;
+    chip8->ram_hash = clone->ram_hash;
+    chip8->display_hash = clone->display_hash;
+    chip8->ram_dirty = 0;
+    chip8->display_dirty = false;
+}
+
+//another reference to the same state, no bulk state is copied
+void copy_clone(clone_pool_t *pool, chip8_clone_t *dest, const chip8_clone_t *src) {
+    *dest = *src;
+    for (uint32_t page = 0; page < CLONE_RAM_PAGES; page++)
+        pool->pages.refs[src->pages[page]]++;
+    pool->displays.refs[src->display]++;
+}
+
+void release_clone(clone_pool_t *pool, chip8_clone_t *clone) {
+    for (uint32_t page = 0; page < CLONE_RAM_PAGES; page++)
+        release_block(&pool->pages, clone->pages[page]);
+    release_block(&pool->displays, clone->display);
+}
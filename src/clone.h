@@ -0,0 +1,55 @@
+#ifndef CLONE_H
+#define CLONE_H
+
+#include "chip8.h"
+
+#define CLONE_PAGE_SIZE 256
+#define CLONE_RAM_PAGES (4096 / CLONE_PAGE_SIZE)
+
+//reference counted fixed size blocks, addressed by index so they survive the store growing
+typedef struct {
+    uint8_t *data;
+    uint32_t *refs;
+    uint32_t *free;
+    uint32_t block_size;
+    uint32_t count;      // blocks ever handed out
+    uint32_t capacity;
+    uint32_t free_count;
+} block_store_t;
+
+//RAM pages and displays shared between clones
+typedef struct {
+    block_store_t pages;
+    block_store_t displays;
+} clone_pool_t;
+
+//machine state with RAM and display shared copy-on-write through a clone_pool_t.
+//Copying one is a struct copy plus reference counts, the bulk state is only duplicated
+//for the pages and display the machine actually wrote.
+typedef struct {
+    uint8_t V[16];
+    uint16_t I;
+    uint16_t PC;
+    uint16_t stack[12];
+    uint8_t stack_depth;
+    uint8_t delayTimer;
+    uint8_t soundTimer;
+    emulator_state_t state;
+    bool keypad[16];
+    uint8_t wait_key;
+    uint32_t rng;
+    uint64_t cycles;
+    uint64_t ram_hash;
+    uint64_t display_hash;
+    uint32_t pages[CLONE_RAM_PAGES];
+    uint32_t display;
+} chip8_clone_t;
+
+bool init_clone_pool(clone_pool_t *pool, const uint32_t initial_pages);
+void free_clone_pool(clone_pool_t *pool);
+bool capture_clone(clone_pool_t *pool, chip8_clone_t *clone, chip8_t *chip8, const chip8_clone_t *base);
+void restore_clone(clone_pool_t *pool, chip8_t *chip8, const chip8_clone_t *clone, const chip8_clone_t *base);
+void copy_clone(clone_pool_t *pool, chip8_clone_t *dest, const chip8_clone_t *src);
+void release_clone(clone_pool_t *pool, chip8_clone_t *clone);
+
+#endif
@@ -0,0 +1,386 @@
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "condition.h"
+
+//recursive descent over the text, emitting code as it goes and tracking the stack depth it needs
+typedef struct {
+    const char *text;
+    const char *at;
+    condition_t *condition;
+    uint8_t depth;
+    char *error;
+    size_t error_size;
+    bool failed;
+} parser_t;
+
+static bool parse_or(parser_t *parser);
+
+static bool fail(parser_t *parser, const char *format, ...) {
+    if (parser->failed)
+        return false;
+    parser->failed = true;
+    const int length = snprintf(parser->error, parser->error_size, "column %d: ",
+                                (int) (parser->at - parser->text) + 1);
+    if (length >= 0 && (size_t) length < parser->error_size) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(parser->error + length, parser->error_size - length, format, args);
+        va_end(args);
+    }
+    return false;
+}
+
+static void skip_space(parser_t *parser) {
+    while (isspace((unsigned char) *parser->at))
+        parser->at++;
+}
+
+//consumes symbol if it comes next
+static bool match(parser_t *parser, const char *symbol) {
+    skip_space(parser);
+    const size_t length = strlen(symbol);
+    if (strncmp(parser->at, symbol, length) != 0)
+        return false;
+    parser->at += length;
+    return true;
+}
+
+//length of the identifier at the current position, 0 if there is none
+static size_t identifier_length(parser_t *parser) {
+    skip_space(parser);
+    size_t length = 0;
+    if (!isalpha((unsigned char) parser->at[0]) && parser->at[0] != '_')
+        return 0;
+    while (isalnum((unsigned char) parser->at[length]) || parser->at[length] == '_')
+        length++;
+    return length;
+}
+
+//consumes word if the next identifier is exactly word, case insensitive
+static bool match_word(parser_t *parser, const char *word) {
+    const size_t length = identifier_length(parser);
+    if (length != strlen(word))
+        return false;
+    for (size_t i = 0; i < length; i++) {
+        if (tolower((unsigned char) parser->at[i]) != tolower((unsigned char) word[i]))
+            return false;
+    }
+    parser->at += length;
+    return true;
+}
+
+static bool emit(parser_t *parser, const condition_opcode_t op, const int32_t arg) {
+    condition_t *condition = parser->condition;
+    if (condition->length == CONDITION_MAX_CODE)
+        return fail(parser, "expression longer than %d operations", CONDITION_MAX_CODE);
+    condition->code[condition->length++] = (condition_op_t) {.op = op, .arg = arg};
+    if (op <= OP_PREVIOUS) {
+        if (++parser->depth > CONDITION_STACK)
+            return fail(parser, "expression nested deeper than %d", CONDITION_STACK);
+    } else if (op != OP_NEG && op != OP_NOT) {
+        parser->depth--;
+    }
+    return true;
+}
+
+static bool parse_number(parser_t *parser, int32_t *value) {
+    skip_space(parser);
+    char *end;
+    const long number = strtol(parser->at, &end, 0);
+    if (end == parser->at)
+        return fail(parser, "number expected");
+    parser->at = end;
+    *value = (int32_t) number;
+    return true;
+}
+
+static bool parse_index(parser_t *parser, const int32_t limit, int32_t *index) {
+    if (!match(parser, "["))
+        return fail(parser, "'[' expected");
+    if (!parse_number(parser, index))
+        return false;
+    if (*index < 0 || *index >= limit)
+        return fail(parser, "index %d out of range", *index);
+    if (!match(parser, "]"))
+        return fail(parser, "']' expected");
+    return true;
+}
+
+//a machine operand, left unemitted so it can also be tracked. False without an error if there is none.
+static bool parse_operand(parser_t *parser, condition_op_t *operand) {
+    const size_t length = identifier_length(parser);
+    if (!length)
+        return false;
+    const char *word = parser->at;
+    if (match_word(parser, "ram")) {
+        operand->op = OP_RAM;
+        return parse_index(parser, sizeof(((chip8_t *) 0)->ram), &operand->arg);
+    }
+    if (match_word(parser, "row")) {
+        operand->op = OP_ROW;
+        return parse_index(parser, 32, &operand->arg);
+    }
+    if (match_word(parser, "I") || match_word(parser, "PC") || match_word(parser, "DT") || match_word(parser, "ST")) {
+        static const condition_opcode_t ops[] = {['I'] = OP_I, ['P'] = OP_PC, ['D'] = OP_DT, ['S'] = OP_ST};
+        operand->op = ops[toupper((unsigned char) word[0])];
+        operand->arg = 0;
+        return true;
+    }
+    if (length == 2 && (word[0] == 'V' || word[0] == 'v') && isxdigit((unsigned char) word[1])) {
+        operand->op = OP_V;
+        operand->arg = (int32_t) strtol(&word[1], NULL, 16);
+        parser->at += length;
+        return true;
+    }
+    return false;
+}
+
+//slot holding the previous value of operand, shared by every use of the same operand
+static bool track(parser_t *parser, const condition_op_t operand, uint8_t *slot) {
+    condition_t *condition = parser->condition;
+    for (*slot = 0; *slot < condition->tracked_count; (*slot)++) {
+        if (condition->tracked[*slot].op == operand.op && condition->tracked[*slot].arg == operand.arg)
+            return true;
+    }
+    if (condition->tracked_count == CONDITION_MAX_TRACKED)
+        return fail(parser, "more than %d operands compared with their previous value", CONDITION_MAX_TRACKED);
+    condition->tracked[condition->tracked_count++] = operand;
+    return true;
+}
+
+static bool parse_primary(parser_t *parser) {
+    if (match(parser, "(")) {
+        if (!parse_or(parser))
+            return false;
+        return match(parser, ")") || fail(parser, "')' expected");
+    }
+    skip_space(parser);
+    if (isdigit((unsigned char) *parser->at)) {
+        int32_t value = 0;
+        return parse_number(parser, &value) && emit(parser, OP_CONST, value);
+    }
+
+    condition_op_t operand;
+    uint8_t slot;
+    if (match_word(parser, "delta")) {
+        if (!match(parser, "("))
+            return fail(parser, "'(' expected after delta");
+        if (!parse_operand(parser, &operand))
+            return fail(parser, "operand expected in delta");
+        if (!match(parser, ")"))
+            return fail(parser, "')' expected");
+        return track(parser, operand, &slot) && emit(parser, operand.op, operand.arg) &&
+               emit(parser, OP_PREVIOUS, slot) && emit(parser, OP_SUB, 0);
+    }
+    if (!parse_operand(parser, &operand))
+        return fail(parser, "operand or number expected");
+    if (!emit(parser, operand.op, operand.arg))
+        return false;
+
+    static const char *changes[] = {"changed", "increased", "decreased"};
+    static const condition_opcode_t compares[] = {OP_NE, OP_GT, OP_LT};
+    for (uint8_t i = 0; i < sizeof(changes) / sizeof(changes[0]); i++) {
+        if (match_word(parser, changes[i]))
+            return track(parser, operand, &slot) && emit(parser, OP_PREVIOUS, slot) && emit(parser, compares[i], 0);
+    }
+    return true;
+}
+
+static bool parse_unary(parser_t *parser) {
+    if (match(parser, "-"))
+        return parse_unary(parser) && emit(parser, OP_NEG, 0);
+    return parse_primary(parser);
+}
+
+static bool parse_product(parser_t *parser) {
+    if (!parse_unary(parser))
+        return false;
+    while (match(parser, "*")) {
+        if (!parse_unary(parser) || !emit(parser, OP_MUL, 0))
+            return false;
+    }
+    return true;
+}
+
+static bool parse_sum(parser_t *parser) {
+    if (!parse_product(parser))
+        return false;
+    for (;;) {
+        condition_opcode_t op;
+        if (match(parser, "+"))
+            op = OP_ADD;
+        else if (match(parser, "-"))
+            op = OP_SUB;
+        else
+            return true;
+        if (!parse_product(parser) || !emit(parser, op, 0))
+            return false;
+    }
+}
+
+static bool parse_comparison(parser_t *parser) {
+    if (!parse_sum(parser))
+        return false;
+    //two character symbols first so "<=" is not read as "<"
+    static const char *symbols[] = {"==", "!=", "<=", ">=", "<", ">"};
+    static const condition_opcode_t ops[] = {OP_EQ, OP_NE, OP_LE, OP_GE, OP_LT, OP_GT};
+    for (uint8_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (match(parser, symbols[i]))
+            return parse_sum(parser) && emit(parser, ops[i], 0);
+    }
+    return true;
+}
+
+static bool parse_not(parser_t *parser) {
+    skip_space(parser);
+    if (match_word(parser, "not") || (parser->at[0] == '!' && parser->at[1] != '=' && match(parser, "!")))
+        return parse_not(parser) && emit(parser, OP_NOT, 0);
+    return parse_comparison(parser);
+}
+
+static bool parse_and(parser_t *parser) {
+    if (!parse_not(parser))
+        return false;
+    while (match_word(parser, "and") || match(parser, "&&")) {
+        if (!parse_not(parser) || !emit(parser, OP_AND, 0))
+            return false;
+    }
+    return true;
+}
+
+static bool parse_or(parser_t *parser) {
+    if (!parse_and(parser))
+        return false;
+    while (match_word(parser, "or") || match(parser, "||")) {
+        if (!parse_and(parser) || !emit(parser, OP_OR, 0))
+            return false;
+    }
+    return true;
+}
+
+//compiles text, on failure error describes where and why
+bool compile_condition(condition_t *condition, const char *text, char *error, const size_t error_size) {
+    memset(condition, 0, sizeof(*condition));
+    parser_t parser = {
+            .text = text,
+            .at = text,
+            .condition = condition,
+            .error = error,
+            .error_size = error_size,
+    };
+    if (!parse_or(&parser))
+        return false;
+    skip_space(&parser);
+    if (*parser.at)
+        return fail(&parser, "unexpected '%s'", parser.at);
+    return true;
+}
+
+static int32_t load_operand(const condition_op_t operand, const chip8_t *chip8) {
+    switch (operand.op) {
+        case OP_RAM:
+            return chip8->ram[operand.arg];
+        case OP_V:
+            return chip8->V[operand.arg];
+        case OP_I:
+            return chip8->I;
+        case OP_PC:
+            return chip8->PC;
+        case OP_DT:
+            return chip8->delayTimer;
+        case OP_ST:
+            return chip8->soundTimer;
+        case OP_ROW: {
+            const bool *row = &chip8->display[operand.arg * 64];
+            int32_t lit = 0;
+            for (uint8_t x = 0; x < 64; x++)
+                lit += row[x];
+            return lit;
+        }
+        default:
+            return operand.arg;
+    }
+}
+
+//take the current values as the previous ones, so the first evaluation does not see a change from 0
+void prime_condition(condition_t *condition, const chip8_t *chip8) {
+    for (uint8_t slot = 0; slot < condition->tracked_count; slot++)
+        condition->previous[slot] = load_operand(condition->tracked[slot], chip8);
+}
+
+//value of the expression, comparisons and logic give 0 or 1. Remembers the operands changes are
+//measured against, so call it once per frame.
+int32_t evaluate_condition(condition_t *condition, const chip8_t *chip8) {
+    int32_t stack[CONDITION_STACK];
+    int32_t *top = stack;
+    for (uint8_t i = 0; i < condition->length; i++) {
+        const condition_op_t op = condition->code[i];
+        switch (op.op) {
+            case OP_CONST:
+                *top++ = op.arg;
+                break;
+            case OP_PREVIOUS:
+                *top++ = condition->previous[op.arg];
+                break;
+            //arithmetic wraps around in 32 bits, computed unsigned so overflow is defined
+            case OP_NEG:
+                top[-1] = (int32_t) (0u - (uint32_t) top[-1]);
+                break;
+            case OP_NOT:
+                top[-1] = !top[-1];
+                break;
+            case OP_ADD:
+                top--;
+                top[-1] = (int32_t) ((uint32_t) top[-1] + (uint32_t) top[0]);
+                break;
+            case OP_SUB:
+                top--;
+                top[-1] = (int32_t) ((uint32_t) top[-1] - (uint32_t) top[0]);
+                break;
+            case OP_MUL:
+                top--;
+                top[-1] = (int32_t) ((uint32_t) top[-1] * (uint32_t) top[0]);
+                break;
+            case OP_EQ:
+                top--;
+                top[-1] = top[-1] == top[0];
+                break;
+            case OP_NE:
+                top--;
+                top[-1] = top[-1] != top[0];
+                break;
+            case OP_LT:
+                top--;
+                top[-1] = top[-1] < top[0];
+                break;
+            case OP_LE:
+                top--;
+                top[-1] = top[-1] <= top[0];
+                break;
+            case OP_GT:
+                top--;
+                top[-1] = top[-1] > top[0];
+                break;
+            case OP_GE:
+                top--;
+                top[-1] = top[-1] >= top[0];
+                break;
+            case OP_AND:
+                top--;
+                top[-1] = top[-1] && top[0];
+                break;
+            case OP_OR:
+                top--;
+                top[-1] = top[-1] || top[0];
+                break;
+            default:
+                *top++ = load_operand(op, chip8);
+                break;
+        }
+    }
+    prime_condition(condition, chip8);
+    return condition->length ? stack[0] : 0;
+}
@@ -0,0 +1,58 @@
+#ifndef CONDITION_H
+#define CONDITION_H
+
+#include "chip8.h"
+
+#define CONDITION_MAX_CODE 128
+#define CONDITION_MAX_TRACKED 16
+#define CONDITION_STACK 32
+
+//Per-frame signals (reward, termination, search goals) written as expressions over the machine,
+//compiled once to stack bytecode and evaluated in place on the chip8_t:
+//  operands     ram[ADDR]  VX  I  PC  DT  ST  row[Y] (lit pixels in display row Y)  numbers
+//  change       delta(operand)  operand changed|increased|decreased   (since the last evaluation)
+//  arithmetic   + - *   comparison  == != < <= > >=   logic  and or not (&& || ! also work)
+//e.g. "ram[0x3F0] decreased", "V3 == 0 and row[31] == 0", "delta(ram[0x2F0]) * 10"
+typedef enum {
+    OP_CONST,
+    OP_RAM,
+    OP_V,
+    OP_I,
+    OP_PC,
+    OP_DT,
+    OP_ST,
+    OP_ROW,
+    OP_PREVIOUS, // value a tracked operand had at the previous evaluation
+    OP_NEG,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_AND,
+    OP_OR,
+    OP_NOT,
+} condition_opcode_t;
+
+typedef struct {
+    uint8_t op;
+    int32_t arg;
+} condition_op_t;
+
+typedef struct {
+    condition_op_t code[CONDITION_MAX_CODE];
+    uint8_t length;
+    condition_op_t tracked[CONDITION_MAX_TRACKED]; // operands used by delta and friends
+    int32_t previous[CONDITION_MAX_TRACKED];
+    uint8_t tracked_count;
+} condition_t;
+
+bool compile_condition(condition_t *condition, const char *text, char *error, const size_t error_size);
+void prime_condition(condition_t *condition, const chip8_t *chip8);
+int32_t evaluate_condition(condition_t *condition, const chip8_t *chip8);
+
+#endif
@@ -0,0 +1,765 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "corpus.h"
+
+//64-bit MurmurHash2 (64A), fast enough to hash a whole machine state
+uint64_t hash_bytes(const void *data, size_t length, const uint64_t seed) {
+    const uint64_t m = 0xC6A4A7935BD1E995ULL;
+    const int r = 47;
+    const uint8_t *bytes = (const uint8_t *) data;
+    uint64_t h = seed ^ (length * m);
+
+    for (; length >= 8; bytes += 8, length -= 8) {
+        uint64_t k;
+        memcpy(&k, bytes, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    if (length) {
+        for (size_t i = length; i-- > 0;)
+            h ^= (uint64_t) bytes[i] << (8 * i);
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+//splitmix64 finaliser, spreads a small key over all 64 bits
+static uint64_t mix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+//Zobrist-style keys: the RAM hash is the XOR of ram_key(addr, ram[addr]) over all of RAM and the
+//display hash the XOR of pixel_key(i) over the lit pixels, so a write only has to swap one key
+static uint64_t ram_key(const uint16_t addr, const uint8_t value) {
+    return mix64((uint64_t) addr << 8 | value);
+}
+
+static uint64_t pixel_key(const uint16_t index) {
+    return mix64(0x1000000 + index);
+}
+
+//the registers change on almost every instruction, they are small enough to hash when asked
+static uint64_t register_hash(const chip8_t *chip8) {
+    struct {
+        uint8_t V[16];
+        uint16_t stack[12];
+        uint16_t I;
+        uint16_t PC;
+        uint8_t stack_depth;
+        uint8_t delayTimer;
+        uint8_t soundTimer;
+        bool keypad[16];
+        uint8_t wait_key;
+        uint32_t rng;
+    } registers;
+    memset(&registers, 0, sizeof(registers));
+    memcpy(registers.V, chip8->V, sizeof(registers.V));
+    memcpy(registers.stack, chip8->stack, sizeof(registers.stack));
+    memcpy(registers.keypad, chip8->keypad, sizeof(registers.keypad));
+    registers.I = chip8->I;
+    registers.PC = chip8->PC;
+    registers.stack_depth = chip8->stackPtr - chip8->stack;
+    registers.delayTimer = chip8->delayTimer;
+    registers.soundTimer = chip8->soundTimer;
+    registers.wait_key = chip8->wait_key;
+    registers.rng = chip8->rng;
+    return hash_bytes(&registers, sizeof(registers), 0);
+}
+
+//hash of the whole machine state in constant time, from the incrementally kept RAM and display hashes
+uint64_t state_hash(const chip8_t *chip8) {
+    return chip8->ram_hash ^ mix64(chip8->display_hash) ^ register_hash(chip8);
+}
+
+//state_hash computed from scratch, for seeding and checking the incremental hashes
+uint64_t rehash_state(const chip8_t *chip8) {
+    uint64_t ram_hash = 0;
+    uint64_t display_hash = 0;
+    for (uint16_t addr = 0; addr < sizeof(chip8->ram); addr++)
+        ram_hash ^= ram_key(addr, chip8->ram[addr]);
+    for (uint16_t i = 0; i < sizeof(chip8->display); i++) {
+        if (chip8->display[i])
+            display_hash ^= pixel_key(i);
+    }
+    return ram_hash ^ mix64(display_hash) ^ register_hash(chip8);
+}
+
+//sets configurations for sdl/window
+bool set_config(config_t *config, int argc, char **argv) {
+    *config = (config_t) {
+            .windowWidth = 64,
+            .windowHeight = 32,
+            .fgColor = 0xFFFFFFFF,
+            .bgColor = 0x000000FF,
+            .scaleFactor = 20,
+            .pixelOutlines = true,
+            .insts_per_second = 500,
+            .square_wave_freq = 440,
+            .audio_sample_rate = 44100,
+            .volume = 3000,
+            .color_lerp_rate = 0.7f,
+            .extension = CHIP8,
+            .display_wait = false,
+            .timing = TIMING_INSTRUCTIONS,
+            .cycles_per_frame = 3668, // 1.7609MHz / 8 clocks per machine cycle / 60Hz
+    };
+
+    for (int i = 0; i < argc; i++) {
+        if (strncmp(argv[i], "--scale-factor", strlen("--scale-factor")) == 0) {
+            config->scaleFactor = (uint32_t) strtol(argv[i], NULL, 10);
+        }
+        if (strncmp(argv[i], "--vip-timing", strlen("--vip-timing")) == 0) {
+            config->timing = TIMING_COSMAC_VIP;
+        }
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            config->rng_seed = (uint32_t) strtoul(argv[i + 1], NULL, 10);
+        }
+        if (strcmp(argv[i], "--display-wait") == 0) {
+            config->display_wait = true;
+        }
+        if (strcmp(argv[i], "--trace") == 0) {
+            config->trace = true;
+        }
+        if (strcmp(argv[i], "--huge-pages") == 0) {
+            config->huge_pages = true;
+        }
+        if (strcmp(argv[i], "--run-ahead") == 0 && i + 1 < argc) {
+            config->run_ahead = (uint32_t) strtoul(argv[i + 1], NULL, 10);
+        }
+    }
+}
+
+//a machine is copyable except for the stack pointer, which has to point into the copy's own stack
+void copy_chip8(chip8_t *dest, const chip8_t *src) {
+    *dest = *src;
+    dest->stackPtr = &dest->stack[src->stackPtr - src->stack];
+}
+
+//Initialize Chip-8 with the size bytes of rom loaded at the entry point. romName is only kept as a
+//reference, it has to outlive the machine.
+bool init_chip8_rom(chip8_t *chip8, const config_t config, const char *romName, const uint8_t *rom,
+                    const size_t size) {
+    const uint32_t entryPoint = 0x200;
+    const uint8_t font[] = {
+            0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
+            0x20, 0x60, 0x20, 0x20, 0x70, // 1
+            0xF0, 0x10, 0xF0, 0x80, 0xF0, // 2
+            0xF0, 0x10, 0xF0, 0x10, 0xF0, // 3
+            0x90, 0x90, 0xF0, 0x10, 0x10, // 4
+            0xF0, 0x80, 0xF0, 0x10, 0xF0, // 5
+            0xF0, 0x80, 0xF0, 0x90, 0xF0, // 6
+            0xF0, 0x10, 0x20, 0x40, 0x40, // 7
+            0xF0, 0x90, 0xF0, 0x90, 0xF0, // 8
+            0xF0, 0x90, 0xF0, 0x10, 0xF0, // 9
+            0xF0, 0x90, 0xF0, 0x90, 0x90, // A
+            0xE0, 0x90, 0xE0, 0x90, 0xE0, // B
+            0xF0, 0x80, 0x80, 0x80, 0xF0, // C
+            0xE0, 0x90, 0x90, 0x90, 0xE0, // D
+            0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
+            0xF0, 0x80, 0xF0, 0x80, 0x80  // F
+    };
+
+    memset(chip8, 0, sizeof(chip8_t));
+
+    memcpy(&chip8->ram[0], &font[0], sizeof(font));
+
+    const size_t maxSize = sizeof(chip8->ram) - entryPoint;
+    if (size > maxSize) {
+        fprintf(stderr, "Rom file too big\n");
+        return false;
+    }
+    memcpy(&chip8->ram[entryPoint], rom, size);
+
+    chip8->state = RUNNING;
+    chip8->PC = entryPoint;
+    chip8->romName = romName;
+    chip8->stackPtr = &chip8->stack[0];
+    chip8->wait_key = 0xFF;
+    chip8->rng = config.rng_seed;
+    chip8->ram_dirty = 0xFFFF;
+    chip8->display_dirty = true;
+    for (uint16_t addr = 0; addr < sizeof(chip8->ram); addr++)
+        chip8->ram_hash ^= ram_key(addr, chip8->ram[addr]);
+    return true;
+}
+
+//Initialize Chip-8 from a ROM file, or from a corpus pack as "<pack>#<ID or name>" (see corpus.h)
+bool init_chip8(chip8_t *chip8, const config_t config, const char *romName) {
+    FILE *rom = fopen(romName, "rb");
+    if (!rom) {
+        if (strchr(romName, '#'))
+            return load_corpus_rom(chip8, config, romName);
+        fprintf(stderr, "File: %s does not exist\n", romName);
+        return false;
+    }
+
+    uint8_t data[4096];
+    const size_t romSize = fread(data, 1, sizeof(data), rom);
+    const bool failed = ferror(rom);
+    fclose(rom);
+    if (failed) {
+        fprintf(stderr, "Could not read file into ram\n");
+        return false;
+    }
+    return init_chip8_rom(chip8, config, romName, data, romSize);
+}
+
+//--trace: one line per instruction executed, for the frontend; the headless tools never set it
+static void print_debug_info(const chip8_t *chip8) {
+    printf("Adress: 0x%04X, Opcode: 0x%04X Desc: ", chip8->PC - 2, chip8->inst.opcode);
+    switch ((chip8->inst.opcode >> 12) & 0x000F) {
+        case 0x0:
+            //clear the screen
+            if (chip8->inst.NN == 0xE0) {
+                printf("Clears the screen\n");
+            } else if (chip8->inst.NN == 0xEE) {
+                printf("Returned from subroutine to address 0x%04X\n", *(chip8->stackPtr - 1));
+            } else {
+                printf("Unimplemented Opcode\n");
+            }
+            break;
+        case 0x01:
+            printf("Jumps to address: 0x%04X\n", chip8->inst.NNN);
+            break;
+        case 0x02:
+            printf("Calls subroutine at NNN\n");
+            break;
+        case 0x03:
+            printf("Checks if value of V%X (0x%02X) is equal to NN (0x%02X). If yes, skips next instruction (0x%04X)\n",
+                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN, chip8->PC);
+            break;
+        case 0x04:
+            printf("Checks if value of V%X (0x%02X) is not equal to NN (0x%02X). If yes, skips next instruction (0x%04X)\n",
+                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.NN, chip8->PC);
+            break;
+        case 0x05:
+            printf("Checks if value of V%X (0x%02X) is equal to V%X (0x%02X). If yes skips next instruction (0x%04X)\n",
+                   chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y], chip8->PC);
+            break;
+        case 0x06:
+            printf("Sets value of register V%X to NN (0x%02X)\n", chip8->inst.X, chip8->inst.NN);
+            break;
+        case 0x07:
+            printf("Adds NN (0x%02X) to V%X\n", chip8->inst.NN, chip8->inst.X);
+            break;
+        case 0x08:
+            switch (chip8->inst.N) {
+                case 0x0:
+                    // 0x8XY0 sets VX = VY
+                    printf("Sets V%X (0x%02X) to V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y,
+                           chip8->V[chip8->inst.Y]);
+                    break;
+                case 0x1:
+                    // 0x8XY1 performs VX |= VY
+                    printf("Performs V%X (0x%02X) |= V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
+                           chip8->inst.Y, chip8->V[chip8->inst.Y]);
+                    break;
+                case 0x2:
+                    // 0x8XY2 performs VX &= VY
+                    printf("Performs V%X (0x%02X) &= V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
+                           chip8->inst.Y, chip8->V[chip8->inst.Y]);
+                    break;
+                case 0x3:
+                    // 0x8XY3 performs VX ^= VY
+                    printf("Performs V%X (0x%02X) ^= V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
+                           chip8->inst.Y, chip8->V[chip8->inst.Y]);
+                    break;
+                case 0x4:
+                    // 0x8XY4 sets VX += VY sets VF = 1 if there is an overflow otherwise sets VF = 0
+                    printf("Performs V%X (0x%02X) += V%X (0x%02X) and sets VF as per overflow occuring/not occuring\n",
+                           chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
+                    break;
+                case 0x5:
+                    // 0x8XY5 performs VX -= VY sets VF = 0 if there is an underflow otherwise sets VF = 1
+                    printf("Performs V%X (0x%02X) += V%X (0x%02X) and sets VF as per underflow occuring/not occuring\n",
+                           chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
+                    break;
+                case 0x6:
+                    // 0x8XY6 performs VX >>= VY and sets VF to the LSB of VX prior to shift
+                    printf("Performs V%X (0x%02X) >>= 1 and sets VF to the LSB of V%X prior to shift\n", chip8->inst.X,
+                           chip8->V[chip8->inst.X], chip8->inst.X);
+                    break;
+                case 0x7:
+                    // 0x8XY7 performs VX = VY - VX and sets VF = 0 when there is an underflow else set VF = 0
+                    printf("Performs V%X (0x%02X) = V%X (0x%02X) - V%X and sets VF as per underflow occuring/not occuring\n",
+                           chip8->inst.X, chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y],
+                           chip8->inst.X);
+                    break;
+                case 0xE:
+                    // 0x8XYE performs VX <<= VY and sets VF to the MSB of VX prior to shift
+                    printf("Performs V%X (0x%02X) <<= 1 and sets VF to the MSB of V%X prior to shift\n", chip8->inst.X,
+                           chip8->V[chip8->inst.X], chip8->inst.X);
+                    break;
+            }
+            break;
+        case 0x09:
+            // 0x9XY0 Skips the next instruction if VX != VY
+            printf("Skips the next instruction if V%X (0x%02X) != V%X (0x%02X)\n", chip8->inst.X,
+                   chip8->V[chip8->inst.X], chip8->inst.Y, chip8->V[chip8->inst.Y]);
+            break;
+        case 0x0A:
+            printf("Sets instruction register to NNN (0x%04X)\n", chip8->inst.NNN);
+            break;
+        case 0x0B:
+            // 0xBNNN sets PC to V0 + NNN
+            printf("Sets the PC to V0 (0x%02X) + NNN (0x%04X)", chip8->V[0x0], chip8->inst.NNN);
+            break;
+        case 0x0C:
+            printf("Sets V%X (0x%02X) equal to rand() & NN (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
+                   chip8->inst.NN);
+            break;
+        case 0x0D:
+            printf("Drawing\n");
+            break;
+        case 0x0E:
+            if (chip8->inst.NN == 0x9E) {
+                // 0xEX9E skips next instruction if key stored in VX is pressed
+                printf("Skips next instruction if key stored in V%X (0x%02X) is pressed\n", chip8->inst.X,
+                       chip8->V[chip8->inst.X]);
+            } else if (chip8->inst.NN == 0xA1) {
+                // 0xEXA1 skips next instruction if key stored in VX is not pressed
+                printf("Skips next instruction if key stored in V%X (0x%02X) is not pressed\n", chip8->inst.X,
+                       chip8->V[chip8->inst.X]);
+            } else {
+                printf("Unimplemented Opcode\n");
+            }
+            break;
+        case 0x0F:
+            switch (chip8->inst.NN) {
+                case 0x07:
+                    printf("Sets V%X (0x%02X) = delayTimer (%d)\n", chip8->inst.X, chip8->V[chip8->inst.X],
+                           chip8->delayTimer);
+                    // 0xFX0A await a key press, then store it in VX
+                case 0x0A:
+                    printf("Awaiting a key press to store in V%X\n", chip8->inst.X);
+                    break;
+                    // 0xFX15 sets delayTimer = VX
+                case 0x15:
+                    printf("Sets delayTimer (%d) = V%X (0x%02X)\n", chip8->delayTimer, chip8->inst.X,
+                           chip8->V[chip8->inst.X]);
+                    break;
+                    // 0xFX18 sets soundTimer = VX
+                case 0x18:
+                    printf("Sets soundTimer (%d) = V%X (0x%02X)\n", chip8->soundTimer, chip8->inst.X,
+                           chip8->V[chip8->inst.X]);
+                    break;
+                    // 0xFX1E performs I += VX
+                case 0x1E:
+                    printf("Performs I (0x%04X) += V%X (0x%02X)\n", chip8->I, chip8->inst.X, chip8->V[chip8->inst.X]);
+                    break;
+                    // 0xFX29 sets I = location of font in VX
+                case 0x29:
+                    printf("Sets I = address of font in V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+                    break;
+                case 0x33:
+                    printf("Stores BCD format of V%X (0x%02X) at I (0x%04X)\n", chip8->inst.X, chip8->V[chip8->inst.X],
+                           chip8->I);
+                    break;
+                case 0x55:
+                    printf("Performs regdump of V0-V%X at address I (0x%04X)\n", chip8->inst.X, chip8->I);
+                    break;
+                case 0x65:
+                    printf("Performs regload of V0-V%X at address I (0x%04X)\n", chip8->inst.X, chip8->I);
+                    break;
+
+            }
+            break;
+        default:
+            printf("Unimplemented Opcode\n");
+            break;
+    }
+}
+
+//machine cycles the instruction in chip8->inst took, approximating the COSMAC VIP interpreter:
+//a fixed fetch/decode overhead plus the work of each opcode. Sprite draws scale with their height.
+uint32_t instruction_cycles(const chip8_t *chip8, const config_t config) {
+    if (config.timing != TIMING_COSMAC_VIP)
+        return 1;
+
+    const uint32_t fetch = 40;
+    switch ((chip8->inst.opcode >> 12) & 0x000F) {
+        case 0x0:
+            if (chip8->inst.NN == 0xE0)
+                return fetch + 1024;
+            if (chip8->inst.NN == 0xEE)
+                return fetch + 10;
+            return fetch;
+        case 0x01:
+            return fetch + 12;
+        case 0x02:
+            return fetch + 26;
+        case 0x03:
+        case 0x04:
+            return fetch + 10;
+        case 0x05:
+        case 0x09:
+            return fetch + 14;
+        case 0x06:
+            return fetch + 6;
+        case 0x07:
+            return fetch + 10;
+        case 0x08:
+            return fetch + 44;
+        case 0x0A:
+            return fetch + 12;
+        case 0x0B:
+            return fetch + 22;
+        case 0x0C:
+            return fetch + 36;
+        case 0x0D:
+            return fetch + 170 + 46 * chip8->inst.N;
+        case 0x0E:
+            return fetch + 14;
+        case 0x0F:
+            switch (chip8->inst.NN) {
+                case 0x0A:
+                    return fetch + 19;
+                case 0x1E:
+                    return fetch + 16;
+                case 0x29:
+                    return fetch + 20;
+                case 0x33:
+                    return fetch + 152;
+                case 0x55:
+                case 0x65:
+                    return fetch + 14 + 14 * (chip8->inst.X + 1);
+                default:
+                    return fetch + 10;
+            }
+        default:
+            return fetch;
+    }
+}
+
+//per machine LCG so runs with the same seed and inputs are identical, high byte has the best period
+static uint8_t next_random(chip8_t *chip8) {
+    chip8->rng = chip8->rng * 1664525u + 1013904223u;
+    return chip8->rng >> 24;
+}
+
+//every RAM write goes through here to keep the incremental hash and the dirty pages clones use current
+static void write_ram(chip8_t *chip8, const uint16_t addr, const uint8_t value) {
+    chip8->ram_hash ^= ram_key(addr, chip8->ram[addr]) ^ ram_key(addr, value);
+    chip8->ram[addr] = value;
+    chip8->ram_dirty |= 1 << ((addr >> 8) & 0xF);
+}
+
+void emulate_instruction(chip8_t *chip8, config_t config) {
+    chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];
+    chip8->PC += 2;
+
+    chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
+    chip8->inst.NN = chip8->inst.opcode & 0x00FF;
+    chip8->inst.N = chip8->inst.opcode & 0x000F;
+    chip8->inst.X = (chip8->inst.opcode >> 8) & 0x000F;
+    chip8->inst.Y = (chip8->inst.opcode >> 4) & 0x000F;
+
+    if (config.trace)
+        print_debug_info(chip8);
+
+    switch ((chip8->inst.opcode >> 12) & 0x000F) {
+        case 0x0:
+            if (chip8->inst.NN == 0XE0) {
+                // 0x00E0 Clear the screen
+                memset(&chip8->display[0], false, sizeof(chip8->display));
+                chip8->display_hash = 0;
+                chip8->display_dirty = true;
+            } else if (chip8->inst.NN == 0xEE) {
+                // 0x00EE Return from subroutine
+                chip8->PC = *--chip8->stackPtr;
+            }
+            break;
+        case 0x01:
+            chip8->PC = chip8->inst.NNN;
+            break;
+        case 0x02:
+            // 0x2NNN call subroutine at NNN
+            *chip8->stackPtr++ = chip8->PC;
+            chip8->PC = chip8->inst.NNN;
+            break;
+        case 0x03:
+            // checks if Vx == NN. If yes, skips next instruction
+            if (chip8->V[chip8->inst.X] == chip8->inst.NN) {
+                chip8->PC += 2;
+            }
+            break;
+        case 0x04:
+            // checks if Vx != NN. If yes, skips next instruction
+            if (chip8->V[chip8->inst.X] != chip8->inst.NN) {
+                chip8->PC += 2;
+            }
+            break;
+        case 0x05:
+            // 0x5XY0 checks if Vx == Vy. If yes, skips next instruction
+            if (chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]) {
+                chip8->PC += 2;
+            }
+            break;
+        case 0x06:
+            // 0x6XNN sets value of register VX to NN
+            chip8->V[chip8->inst.X] = chip8->inst.NN;
+            break;
+        case 0x07:
+            // 0x7XNN adds VX to NN
+            chip8->V[chip8->inst.X] += chip8->inst.NN;
+            break;
+        case 0x08:
+            switch (chip8->inst.N) {
+                case 0x0:
+                    // 0x8XY0 sets VX = VY
+                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
+                    break;
+                case 0x1:
+                    // 0x8XY1 performs VX |= VY
+                    chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
+                    if (config.extension == CHIP8)
+                        chip8->V[0xF] = 0;
+                    break;
+                case 0x2:
+                    // 0x8XY2 performs VX &= VY
+                    chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
+                    if (config.extension == CHIP8)
+                        chip8->V[0xF] = 0;
+                    break;
+                case 0x3:
+                    // 0x8XY3 performs VX |= VY
+                    chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
+                    if (config.extension == CHIP8)
+                        chip8->V[0xF] = 0;
+                    break;
+                case 0x4: {
+                    // 0x8XY4 sets VX += VY sets VF = 1 if there is an overflow otherwise sets VF = 0
+                    const bool carry = (uint16_t) chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y] > 0xFF;
+                    chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
+                    chip8->V[0xF] = carry;
+                }
+                    break;
+                case 0x5: {
+                    // 0x8XY5 performs VX -= VY sets VF = 0 if there is an underflow otherwise sets VF = 1
+                    const bool carry = chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y];
+                    chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
+                    chip8->V[0xF] = carry;
+                }
+                    break;
+                case 0x6: {
+                    // 0x8XY6 performs VX >>= 1 and sets VF to the LSB of VX prior to shift
+                    bool carry;
+                    if (config.extension == CHIP8) {
+                        carry = chip8->V[chip8->inst.Y] & 0x1;
+                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] >> 1;
+                    } else {
+                        carry = chip8->V[chip8->inst.X] & 0x1;
+                        chip8->V[chip8->inst.X] >>= 1;
+                    }
+                    chip8->V[0xF] = carry;
+                }
+                    break;
+                case 0x7: {
+                    // 0x8XY7 performs VX = VY - VX and sets VF = 0 when there is an underflow else set VF = 0
+                    const bool carry = chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y];
+                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
+                    chip8->V[0xF] = carry;
+                }
+                    break;
+                case 0xE: {
+                    // 0x8XYE performs VX <<= VY and sets VF to the MSB of VX prior to shift
+                    bool carry;
+                    if (config.extension == CHIP8) {
+                        carry = (chip8->V[chip8->inst.Y] & 0x80) >> 7;
+                        chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] << 1;
+                    } else {
+                        carry = (chip8->V[chip8->inst.X] & 0x80) >> 0x7;
+                        chip8->V[chip8->inst.X] <<= 1;
+                    }
+                    chip8->V[0xF] = carry;
+                }
+                    break;
+            }
+            break;
+        case 0x09:
+            // 0x9XY0 Skips the next instruction if VX != VY
+            if (chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y]) {
+                chip8->PC += 2;
+            }
+            break;
+        case 0x0A:
+            // 0xANNN Sets index register I to NNN
+            chip8->I = chip8->inst.NNN;
+            break;
+        case 0x0B:
+            // 0xBNNN sets PC to V0 + NNN
+            chip8->PC = chip8->V[0x0] + chip8->inst.NNN;
+            break;
+        case 0x0C:
+            // 0xCXNN sets VX = rand() & NN
+            chip8->V[chip8->inst.X] = next_random(chip8) & chip8->inst.NN;
+            break;
+        case 0x0D: {
+            // 0xDXYN Draws N-height sprites at cords X,Y; Read from memory location I
+            // Screen pixels are XOR'd with sprite bits
+            // VF (Carry Flag) is set if any screen pixels are switched off
+            uint8_t X_cord = chip8->V[chip8->inst.X] % config.windowWidth;
+            uint8_t Y_Cord = chip8->V[chip8->inst.Y] % config.windowHeight;
+            const uint8_t orig_X = X_cord;
+
+            chip8->V[0xF] = 0;
+
+            for (uint8_t i = 0; i < chip8->inst.N; i++) {
+
+                const uint8_t sprite_data = chip8->ram[chip8->I + i];
+                X_cord = orig_X;
+
+                for (int8_t j = 7; j >= 0; j--) {
+                    const uint16_t pixel_index = Y_Cord * config.windowWidth + X_cord;
+                    bool *pixel = &chip8->display[pixel_index];
+                    const bool sprite_bit = (sprite_data & (1 << j));
+
+                    if (sprite_bit && *pixel) {
+                        chip8->V[0xF] = 1;
+                    }
+
+                    *pixel ^= sprite_bit;
+                    if (sprite_bit)
+                        chip8->display_hash ^= pixel_key(pixel_index);
+
+                    if (++X_cord >= config.windowWidth)
+                        break;
+                }
+
+                if (++Y_Cord >= config.windowHeight)
+                    break;
+            }
+            chip8->display_dirty = true;
+            break;
+        }
+        case 0x0E:
+            if (chip8->inst.NN == 0x9E) {
+                // 0xEX9E skips next instruction if key stored in VX is pressed
+                if (chip8->keypad[chip8->V[chip8->inst.X]]) {
+                    chip8->PC += 2;
+                }
+            } else if (chip8->inst.NN == 0xA1) {
+                // 0xEXA1 skips next instruction if key stored in VX is not pressed
+                if (!chip8->keypad[chip8->V[chip8->inst.X]]) {
+                    chip8->PC += 2;
+                }
+            }
+            break;
+        case 0x0F:
+            switch (chip8->inst.NN) {
+                // 0FX07 sets VX = delayTimer
+                case 0x07:
+                    chip8->V[chip8->inst.X] = chip8->delayTimer;
+                    break;
+                    // 0xFX0A await a key press, then store it in VX
+                case 0x0A: {
+                    for (uint8_t i = 0; chip8->wait_key == 0xFF && i < sizeof(chip8->keypad); i++) {
+                        if (chip8->keypad[i])
+                            chip8->wait_key = i;
+                    }
+                    if (chip8->wait_key == 0xFF)
+                        chip8->PC -= 2;
+                    else {
+                        if (chip8->keypad[chip8->wait_key])
+                            chip8->PC -= 2;
+                        else {
+                            chip8->V[chip8->inst.X] = chip8->wait_key;
+                            chip8->wait_key = 0xFF;
+                        }
+                    }
+                    break;
+                }
+                    // 0xFX15 sets delayTimer = VX
+                case 0x15:
+                    chip8->delayTimer = chip8->V[chip8->inst.X];
+                    break;
+                    // 0xFX18 sets soundTimer = VX
+                case 0x18:
+                    chip8->soundTimer = chip8->V[chip8->inst.X];
+                    break;
+                    // 0xFX1E performs I += VX
+                case 0x1E:
+                    chip8->I += chip8->V[chip8->inst.X];
+                    break;
+                    // 0xFX29 sets I = location of font in VX
+                case 0x29:
+                    chip8->I = chip8->V[chip8->inst.X] * 5;
+                    break;
+                    // 0xFX33 sets bcd value of VX at I
+                    // hundreds place at I, tens place at I+1, ones place at I+2
+                case 0x33: {
+                    uint8_t bcd = chip8->V[chip8->inst.X];
+                    write_ram(chip8, chip8->I + 2, bcd % 10);
+                    bcd /= 10;
+                    write_ram(chip8, chip8->I + 1, bcd % 10);
+                    bcd /= 10;
+                    write_ram(chip8, chip8->I, bcd % 10);
+                    break;
+                }
+                case 0x55:
+                    for (uint8_t i = 0; i <= chip8->inst.X; i++) {
+                        if (config.extension == CHIP8)
+                            write_ram(chip8, chip8->I++, chip8->V[i]);
+                        else
+                            write_ram(chip8, chip8->I + i, chip8->V[i]);
+                    }
+                    break;
+                case 0x65:
+                    for (uint8_t i = 0; i <= chip8->inst.X; i++) {
+                        if (config.extension == CHIP8)
+                            chip8->V[i] = chip8->ram[chip8->I++];
+                        else
+                            chip8->V[i] = chip8->ram[chip8->I + i];
+                    }
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+    chip8->cycles += instruction_cycles(chip8, config);
+}
+
+void update_timers(chip8_t *chip8) {
+    if (chip8->delayTimer > 0)
+        chip8->delayTimer--;
+    if (chip8->soundTimer > 0)
+        chip8->soundTimer--;
+}
+
+//cycles available to one 60Hz slice
+uint32_t slice_budget(const config_t config) {
+    if (config.timing == TIMING_COSMAC_VIP)
+        return config.cycles_per_frame;
+    return config.insts_per_second / 60;
+}
+
+//true when the instruction just executed has to wait for the vertical blank before the next one
+bool display_wait(const chip8_t *chip8, const config_t config) {
+    return config.display_wait && config.extension == CHIP8 && (chip8->inst.opcode >> 12) == 0x0D;
+}
+
+//one 60Hz frame without a frontend: a slice of instructions, cut short by the display wait, then the
+//timers. Returns the instructions executed.
+uint32_t run_frame(chip8_t *chip8, const config_t config) {
+    const uint64_t slice_end = chip8->cycles + slice_budget(config);
+    uint32_t executed = 0;
+    while (chip8->cycles < slice_end) {
+        emulate_instruction(chip8, config);
+        executed++;
+        if (display_wait(chip8, config))
+            break;
+    }
+    update_timers(chip8);
+    return executed;
+}
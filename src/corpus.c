@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "corpus.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//the pack is only trusted after every offset in it was checked against its size
+static bool check_corpus(corpus_t *corpus, const char *path) {
+    const corpus_header_t *header = (const corpus_header_t *) corpus->data;
+    if (corpus->size < sizeof(*header) || memcmp(header->magic, CORPUS_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "%s is not a corpus pack\n", path);
+        return false;
+    }
+    if (header->byte_order != CORPUS_BYTE_ORDER || header->version != CORPUS_VERSION) {
+        fprintf(stderr, "%s was written with another byte order or version\n", path);
+        return false;
+    }
+    const uint64_t index_end = header->index_offset + (uint64_t) header->count * sizeof(corpus_entry_t);
+    if (header->size != corpus->size || header->index_offset < sizeof(*header) ||
+        header->index_offset > corpus->size || header->index_offset % sizeof(uint64_t) ||
+        index_end > header->names_offset || header->names_offset > header->data_offset ||
+        header->data_offset > corpus->size) {
+        fprintf(stderr, "%s is truncated or corrupt\n", path);
+        return false;
+    }
+    corpus->header = header;
+    corpus->entries = (const corpus_entry_t *) (corpus->data + header->index_offset);
+    corpus->count = header->count;
+    for (uint32_t id = 0; id < corpus->count; id++) {
+        const corpus_entry_t *entry = &corpus->entries[id];
+        const uint64_t name = header->names_offset + entry->name_offset;
+        if (name >= header->data_offset || !memchr(corpus->data + name, '\0', header->data_offset - name) ||
+            entry->rom_offset < header->data_offset || entry->rom_offset > corpus->size ||
+            entry->rom_size > corpus->size - entry->rom_offset) {
+            fprintf(stderr, "%s: entry %u is corrupt\n", path, id);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool open_corpus(corpus_t *corpus, const char *path) {
+    memset(corpus, 0, sizeof(*corpus));
+#ifndef _WIN32
+    const int fd = open(path, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        fprintf(stderr, "Could not open %s\n", path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    corpus->size = (size_t) status.st_size;
+    void *data = corpus->size ? mmap(NULL, corpus->size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", path);
+        return false;
+    }
+    corpus->data = data;
+    corpus->mapped = true;
+#else
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    corpus->size = (size_t) ftell(file);
+    rewind(file);
+    uint8_t *data = malloc(corpus->size ? corpus->size : 1);
+    const bool read = data && fread(data, 1, corpus->size, file) == corpus->size;
+    fclose(file);
+    corpus->data = data;
+    if (!read) {
+        fprintf(stderr, "Could not read %s\n", path);
+        close_corpus(corpus);
+        return false;
+    }
+#endif
+    if (!check_corpus(corpus, path)) {
+        close_corpus(corpus);
+        return false;
+    }
+    return true;
+}
+
+void close_corpus(corpus_t *corpus) {
+#ifndef _WIN32
+    if (corpus->mapped)
+        munmap((void *) corpus->data, corpus->size);
+#else
+    free((void *) corpus->data);
+#endif
+    memset(corpus, 0, sizeof(*corpus));
+}
+
+const char *corpus_name(const corpus_t *corpus, const uint32_t id) {
+    return (const char *) corpus->data + corpus->header->names_offset + corpus->entries[id].name_offset;
+}
+
+const uint8_t *corpus_rom(const corpus_t *corpus, const uint32_t id, size_t *size) {
+    *size = corpus->entries[id].rom_size;
+    return corpus->data + corpus->entries[id].rom_offset;
+}
+
+//binary search over the index, -1 if there is no ROM of that name
+int64_t find_corpus_rom(const corpus_t *corpus, const char *name) {
+    const uint64_t hash = hash_bytes(name, strlen(name), 0);
+    uint32_t low = 0;
+    uint32_t high = corpus->count;
+    while (low < high) {
+        const uint32_t middle = low + (high - low) / 2;
+        if (corpus->entries[middle].name_hash < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    for (uint32_t id = low; id < corpus->count && corpus->entries[id].name_hash == hash; id++) {
+        if (strcmp(corpus_name(corpus, id), name) == 0)
+            return id;
+    }
+    return -1;
+}
+
+//a decimal ID or a name, -1 if it is neither
+int64_t parse_corpus_id(const corpus_t *corpus, const char *text) {
+    char *end;
+    const unsigned long long id = strtoull(text, &end, 10);
+    if (*text && *end == '\0' && id < corpus->count)
+        return (int64_t) id;
+    return find_corpus_rom(corpus, text);
+}
+
+//loads "<pack>#<ID or name>" with the pack mapped just for this. Something loading many ROMs should
+//keep its own corpus_t open and use init_chip8_rom().
+bool load_corpus_rom(chip8_t *chip8, const config_t config, const char *reference) {
+    const char *hash = strrchr(reference, '#');
+    if (!hash)
+        return false;
+    char path[4096];
+    if ((size_t) (hash - reference) >= sizeof(path)) {
+        fprintf(stderr, "Corpus path too long: %s\n", reference);
+        return false;
+    }
+    memcpy(path, reference, hash - reference);
+    path[hash - reference] = '\0';
+    corpus_t corpus;
+    if (!open_corpus(&corpus, path))
+        return false;
+    const int64_t id = parse_corpus_id(&corpus, hash + 1);
+    bool loaded = false;
+    if (id < 0) {
+        fprintf(stderr, "%s has no ROM %s\n", path, hash + 1);
+    } else {
+        size_t size;
+        const uint8_t *rom = corpus_rom(&corpus, (uint32_t) id, &size);
+        loaded = init_chip8_rom(chip8, config, reference, rom, size);
+    }
+    close_corpus(&corpus);
+    return loaded;
+}
+
+typedef struct {
+    uint64_t name_hash;
+    const char *name;
+    uint32_t file; // index into the files being packed
+} sort_key_t;
+
+static int compare_keys(const void *a, const void *b) {
+    const sort_key_t *x = (const sort_key_t *) a;
+    const sort_key_t *y = (const sort_key_t *) b;
+    if (x->name_hash != y->name_hash)
+        return x->name_hash < y->name_hash ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    *size = (size_t) ftell(file);
+    rewind(file);
+    uint8_t *data = malloc(*size ? *size : 1);
+    if (data && fread(data, 1, *size, file) != *size) {
+        fprintf(stderr, "Could not read %s\n", path);
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    return data;
+}
+
+//the ROM already packed with the same bytes as id, -1 if there is none. seen is an open addressing
+//table of capacity (a power of two) slots holding ID + 1, 0 when free.
+static int64_t find_duplicate(uint32_t *seen, const uint32_t capacity, const corpus_entry_t *entries,
+                              uint8_t **roms, const uint32_t id) {
+    for (uint32_t slot = (uint32_t) entries[id].rom_hash & (capacity - 1);; slot = (slot + 1) & (capacity - 1)) {
+        if (!seen[slot]) {
+            seen[slot] = id + 1;
+            return -1;
+        }
+        const uint32_t other = seen[slot] - 1;
+        if (entries[other].rom_hash == entries[id].rom_hash && entries[other].rom_size == entries[id].rom_size &&
+            memcmp(roms[other], roms[id], entries[id].rom_size) == 0)
+            return other;
+    }
+}
+
+//fills in the header and entries for keys in order, reading every ROM into roms (NULL for duplicates)
+static bool layout_corpus(corpus_header_t *header, const sort_key_t *keys, corpus_entry_t *entries,
+                          uint8_t **roms, const char **files, const uint32_t count) {
+    header->names_offset = header->index_offset + (uint64_t) count * sizeof(corpus_entry_t);
+    uint64_t names_size = 0;
+    for (uint32_t id = 0; id < count; id++) {
+        if (id && compare_keys(&keys[id - 1], &keys[id]) == 0) {
+            fprintf(stderr, "%s is packed twice\n", keys[id].name);
+            return false;
+        }
+        entries[id].name_hash = keys[id].name_hash;
+        entries[id].name_offset = (uint32_t) names_size;
+        names_size += strlen(keys[id].name) + 1;
+    }
+    header->data_offset = header->names_offset + names_size;
+
+    uint32_t capacity = 16;
+    while (capacity < count * 2)
+        capacity *= 2;
+    uint32_t *seen = calloc(capacity, sizeof(uint32_t));
+    if (!seen) {
+        fprintf(stderr, "Out of memory\n");
+        return false;
+    }
+    uint64_t data_size = 0;
+    for (uint32_t id = 0; id < count; id++) {
+        size_t size;
+        roms[id] = read_file(files[keys[id].file], &size);
+        if (!roms[id]) {
+            free(seen);
+            return false;
+        }
+        entries[id].rom_size = (uint32_t) size;
+        entries[id].rom_hash = hash_bytes(roms[id], size, 0);
+        const int64_t duplicate = find_duplicate(seen, capacity, entries, roms, id);
+        if (duplicate >= 0) {
+            entries[id].rom_offset = entries[duplicate].rom_offset;
+            free(roms[id]);
+            roms[id] = NULL;
+        } else {
+            entries[id].rom_offset = header->data_offset + data_size;
+            data_size += size;
+        }
+    }
+    free(seen);
+    header->size = header->data_offset + data_size;
+    return true;
+}
+
+static bool save_corpus(const char *path, const corpus_header_t *header, const sort_key_t *keys,
+                        const corpus_entry_t *entries, uint8_t **roms) {
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "Could not create %s\n", path);
+        return false;
+    }
+    bool ok = fwrite(header, sizeof(*header), 1, out) == 1 &&
+              fwrite(entries, sizeof(corpus_entry_t), header->count, out) == header->count;
+    for (uint32_t id = 0; ok && id < header->count; id++)
+        ok = fwrite(keys[id].name, strlen(keys[id].name) + 1, 1, out) == 1;
+    for (uint32_t id = 0; ok && id < header->count; id++) {
+        if (roms[id] && entries[id].rom_size)
+            ok = fwrite(roms[id], entries[id].rom_size, 1, out) == 1;
+    }
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+//packs files under names (the file paths when NULL). Identical ROMs are stored once.
+bool write_corpus(const char *path, const char **files, const char **names, const uint32_t count) {
+    names = names ? names : files;
+    sort_key_t *keys = malloc(sizeof(sort_key_t) * (count ? count : 1));
+    corpus_entry_t *entries = calloc(count ? count : 1, sizeof(corpus_entry_t));
+    uint8_t **roms = calloc(count ? count : 1, sizeof(uint8_t *));
+    bool written = false;
+    if (keys && entries && roms) {
+        for (uint32_t i = 0; i < count; i++) {
+            keys[i] = (sort_key_t) {.name_hash = hash_bytes(names[i], strlen(names[i]), 0), .name = names[i],
+                                    .file = i};
+        }
+        qsort(keys, count, sizeof(sort_key_t), compare_keys);
+        corpus_header_t header = {
+                .version = CORPUS_VERSION,
+                .byte_order = CORPUS_BYTE_ORDER,
+                .count = count,
+                .index_offset = sizeof(corpus_header_t),
+        };
+        memcpy(header.magic, CORPUS_MAGIC, sizeof(header.magic));
+        written = layout_corpus(&header, keys, entries, roms, files, count) &&
+                  save_corpus(path, &header, keys, entries, roms);
+    } else {
+        fprintf(stderr, "Out of memory\n");
+    }
+    for (uint32_t id = 0; roms && id < count; id++)
+        free(roms[id]);
+    free(roms);
+    free(entries);
+    free(keys);
+    return written;
+}
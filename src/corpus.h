@@ -0,0 +1,55 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include "chip8.h"
+
+#define CORPUS_MAGIC "CHIP8PAK"
+#define CORPUS_VERSION 1
+#define CORPUS_BYTE_ORDER 0x01020304u
+
+//A corpus pack: many ROMs in one file, mapped once instead of opened one by one.
+//  header    corpus_header_t
+//  index     count corpus_entry_t sorted by (name_hash, name); a ROM's ID is its position here
+//  names     NUL terminated
+//  data      the ROM bytes
+//Integers are stored in the byte order of the machine that wrote the pack, byte_order tells a
+//reader from the other order apart. init_chip8() also loads "<pack>#<ID or name>".
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t names_offset;
+    uint64_t data_offset;
+    uint64_t size; // of the whole file
+} corpus_header_t;
+
+typedef struct {
+    uint64_t name_hash; // hash_bytes() of the name
+    uint64_t rom_hash;  // hash_bytes() of the ROM, for checking and deduplicating
+    uint64_t rom_offset;
+    uint32_t rom_size;
+    uint32_t name_offset;
+} corpus_entry_t;
+
+typedef struct {
+    const uint8_t *data; // the whole file
+    size_t size;
+    const corpus_header_t *header;
+    const corpus_entry_t *entries;
+    uint32_t count;
+    bool mapped;
+} corpus_t;
+
+bool open_corpus(corpus_t *corpus, const char *path);
+void close_corpus(corpus_t *corpus);
+int64_t find_corpus_rom(const corpus_t *corpus, const char *name);
+const char *corpus_name(const corpus_t *corpus, const uint32_t id);
+const uint8_t *corpus_rom(const corpus_t *corpus, const uint32_t id, size_t *size);
+int64_t parse_corpus_id(const corpus_t *corpus, const char *text);
+bool load_corpus_rom(chip8_t *chip8, const config_t config, const char *reference);
+bool write_corpus(const char *path, const char **files, const char **names, const uint32_t count);
+
+#endif
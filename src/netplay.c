@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "rollback.h"
+
+//chip8_netplay: a rollback netplay peer without a window, for testing on localhost. Each player holds
+//keys of their own half of the keypad (player 0 keys 0-7, player 1 keys 8-F) from a script seeded by
+//--input-seed, so a run can be repeated. Prints the state hash of the last frame once both players'
+//input for it is known, and fails if the peers desynced.
+//  chip8_netplay <rom> --player 0|1 --port P --peer host:port [options]
+//  chip8_netplay <rom> --loopback [--port P] [options]
+//      both peers as two processes on localhost ports P and P+1, fails unless they end on the same hash
+//options: --frames N (default 600)  --delay F (input delay in frames, default 2)  --latency MS
+//         --loss PERCENT (simulated on the sending side)  --input-seed N  --seed N  --vip-timing  --display-wait
+
+#define FRAME_NS 16666667ULL
+#define LINGER_TICKS 120
+
+typedef struct {
+    const char *rom;
+    uint32_t player;
+    uint16_t port;
+    const char *peer;
+    uint32_t frames;
+    uint32_t delay;
+    uint32_t latency_ms;
+    uint32_t loss_percent;
+    uint32_t input_seed;
+    config_t config;
+} options_t;
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void sleep_until(const uint64_t deadline) {
+    const uint64_t now = now_ns();
+    if (deadline <= now)
+        return;
+    const struct timespec wait = {.tv_sec = (time_t) ((deadline - now) / 1000000000ULL),
+                                  .tv_nsec = (long) ((deadline - now) % 1000000000ULL)};
+    nanosleep(&wait, NULL);
+}
+
+//the keys a player holds at a frame: a key of their half for a while, then nothing for a while
+static uint16_t scripted_keys(const options_t *options, const uint32_t frame) {
+    const uint32_t segment[] = {options->input_seed, options->player, frame / 12};
+    const uint64_t hash = hash_bytes(segment, sizeof(segment), 0);
+    if ((hash & 3) == 0)
+        return 0;
+    return (uint16_t) (1 << (options->player * 8 + (hash >> 2) % 8));
+}
+
+//plays until both players' input for options->frames is known, writes that frame's state hash to
+//hash. Returns false if the peers desynced or the peer went quiet.
+static bool play(const options_t *options, uint64_t *hash) {
+    static rollback_t rollback;
+    if (!init_rollback(&rollback, options->config, options->rom, options->port, options->peer, options->delay))
+        return false;
+    simulate_network(&rollback, options->latency_ms, options->loss_percent, options->input_seed * 2 + options->player + 1);
+
+    //the peer gets 10 s of stalling, to start and to catch up
+    const uint64_t limit = options->frames + 600;
+    uint64_t ticks = 0;
+    uint64_t max_tick_ns = 0;
+    uint64_t deadline = now_ns();
+    bool done = false;
+    while (!done && ticks < limit) {
+        const uint64_t start = now_ns();
+        poll_rollback(&rollback);
+        advance_rollback(&rollback, scripted_keys(options, rollback.local_frame));
+        const uint64_t elapsed = now_ns() - start;
+        max_tick_ns = elapsed > max_tick_ns ? elapsed : max_tick_ns;
+        done = confirmed_hash(&rollback, options->frames, hash);
+        ticks++;
+        deadline += FRAME_NS;
+        sleep_until(deadline);
+    }
+    //the peer may still be missing input that was lost on the way, keep sending it until acknowledged
+    for (uint32_t tick = 0; done && tick < LINGER_TICKS && rollback.remote_ack < options->frames; tick++) {
+        poll_rollback(&rollback);
+        advance_rollback(&rollback, 0);
+        deadline += FRAME_NS;
+        sleep_until(deadline);
+    }
+
+    const rollback_stats_t *stats = &rollback.stats;
+    printf("player %u: ", options->player);
+    if (done)
+        printf("frame %u hash %016llx\n", options->frames, (unsigned long long) *hash);
+    else
+        printf("frame %u never confirmed, the peer did not keep up\n", options->frames);
+    printf("  %llu frames in %llu ticks, %llu stalled; %llu rollbacks resimulating %llu frames (deepest %u, "
+           "%.3f ms at most)\n", (unsigned long long) stats->frames, (unsigned long long) ticks,
+           (unsigned long long) stats->stalls, (unsigned long long) stats->rollbacks,
+           (unsigned long long) stats->resimulated, stats->max_depth, stats->max_rollback_ns / 1e6);
+    printf("  slowest tick %.3f ms of the 16.667 ms frame%s\n", max_tick_ns / 1e6,
+           max_tick_ns > FRAME_NS ? ", OVER BUDGET" : "");
+    printf("  packets: %llu sent, %llu dropped by the simulated loss, %llu received, %llu rejected\n",
+           (unsigned long long) stats->packets_sent, (unsigned long long) stats->packets_lost,
+           (unsigned long long) stats->packets_received, (unsigned long long) stats->packets_rejected);
+    if (stats->desyncs)
+        printf("  DESYNC at frame %u, %llu frames differed\n", stats->first_desync, (unsigned long long) stats->desyncs);
+    fflush(stdout);
+    free_rollback(&rollback);
+    return done && !stats->desyncs;
+}
+
+//runs both players as child processes on localhost and compares the hashes they end on
+static int loopback(options_t options) {
+    int pipes[2][2];
+    pid_t children[2];
+    for (uint32_t player = 0; player < 2; player++) {
+        char peer[32];
+        snprintf(peer, sizeof(peer), "127.0.0.1:%u", options.port + 1 - player);
+        if (pipe(pipes[player]) != 0)
+            return EXIT_FAILURE;
+        children[player] = fork();
+        if (children[player] < 0)
+            return EXIT_FAILURE;
+        if (children[player] == 0) {
+            options.player = player;
+            options.port = (uint16_t) (options.port + player);
+            options.peer = peer;
+            uint64_t hash = 0;
+            const bool ok = play(&options, &hash);
+            const ssize_t written = write(pipes[player][1], &hash, sizeof(hash));
+            _exit(ok && written == sizeof(hash) ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+        close(pipes[player][1]);
+    }
+
+    uint64_t hashes[2] = {0};
+    bool ok = true;
+    for (uint32_t player = 0; player < 2; player++) {
+        int status;
+        ok = read(pipes[player][0], &hashes[player], sizeof(hashes[player])) == sizeof(hashes[player]) && ok;
+        close(pipes[player][0]);
+        ok = waitpid(children[player], &status, 0) == children[player] && WIFEXITED(status) &&
+             WEXITSTATUS(status) == EXIT_SUCCESS && ok;
+    }
+    ok = ok && hashes[0] == hashes[1];
+    printf("loopback: %s\n", ok ? "both peers ended on the same state" : "the peers did NOT end on the same state");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv) {
+    options_t options = {.frames = 600, .delay = 2, .port = 7000};
+    bool is_loopback = false;
+    set_config(&options.config, argc, argv);
+    if (!options.config.rng_seed)
+        options.config.rng_seed = 1;
+    for (int i = 2; i < argc; i++) {
+        const bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--loopback") == 0)
+            is_loopback = true;
+        else if (strcmp(argv[i], "--player") == 0 && has_value)
+            options.player = (uint32_t) strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--port") == 0 && has_value)
+            options.port = (uint16_t) strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--peer") == 0 && has_value)
+            options.peer = argv[++i];
+        else if (strcmp(argv[i], "--frames") == 0 && has_value)
+            options.frames = (uint32_t) strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--delay") == 0 && has_value)
+            options.delay = (uint32_t) strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--latency") == 0 && has_value)
+            options.latency_ms = (uint32_t) strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--loss") == 0 && has_value)
+            options.loss_percent = (uint32_t) strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--input-seed") == 0 && has_value)
+            options.input_seed = (uint32_t) strtoul(argv[++i], NULL, 10);
+    }
+    options.rom = argc > 1 ? argv[1] : NULL;
+    if (!options.rom || options.rom[0] == '-' || options.player > 1 || (!is_loopback && !options.peer)) {
+        fprintf(stderr, "Usage: %s <rom-path> --player 0|1 --port P --peer host:port [options]\n"
+                        "       %s <rom-path> --loopback [--port P] [options]\n"
+                        "options: --frames N --delay F --latency MS --loss PERCENT --input-seed N --seed N --vip-timing --display-wait\n",
+                argv[0], argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (is_loopback)
+        exit(loopback(options));
+    uint64_t hash;
+    exit(play(&options, &hash) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
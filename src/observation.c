@@ -0,0 +1,103 @@
+#include <string.h>
+#include "observation.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//64 pixels to 64 bits, leftmost pixel in bit 0
+static uint64_t pack_row(const bool *row) {
+    uint64_t bits = 0;
+#ifdef __SSE2__
+    //display bytes are 0 or 1, shifting moves that bit to the top of the byte where movemask reads it
+    for (uint8_t x = 0; x < 64; x += 16) {
+        const __m128i pixels = _mm_slli_epi16(_mm_loadu_si128((const __m128i *) &row[x]), 7);
+        bits |= (uint64_t) (uint16_t) _mm_movemask_epi8(pixels) << x;
+    }
+#else
+    for (uint8_t x = 0; x < 64; x++)
+        bits |= (uint64_t) row[x] << x;
+#endif
+    return bits;
+}
+
+void pack_display(const chip8_t *chip8, packed_display_t *packed) {
+    for (uint8_t y = 0; y < 32; y++)
+        packed->rows[y] = pack_row(&chip8->display[y * 64]);
+}
+
+//64 bits to 64 bytes of 0 or 255
+static void unpack_row(const uint64_t bits, uint8_t *out) {
+#ifdef __SSE2__
+    //every byte gets the source byte holding its bit, then a compare against that bit's mask
+    const __m128i masks = _mm_set1_epi64x(0x8040201008040201LL);
+    for (uint8_t x = 0; x < 64; x += 16) {
+        const __m128i low = _mm_set1_epi8((char) (bits >> x));
+        const __m128i high = _mm_set1_epi8((char) (bits >> (x + 8)));
+        const __m128i spread = _mm_unpacklo_epi64(low, high);
+        _mm_storeu_si128((__m128i *) &out[x], _mm_cmpeq_epi8(_mm_and_si128(spread, masks), masks));
+    }
+#else
+    for (uint8_t x = 0; x < 64; x++)
+        out[x] = (uint8_t) -(uint8_t) (bits >> x & 1);
+#endif
+}
+
+//two rows to 32 means of 2x2 blocks. Pair counts are summed SWAR style in 4-bit fields, one per block.
+static void downsample_rows(const uint64_t top, const uint64_t bottom, uint8_t *out) {
+    static const uint8_t shades[5] = {0, 64, 128, 191, 255};
+    const uint64_t pairs = 0x5555555555555555ULL;
+    const uint64_t top_counts = (top & pairs) + (top >> 1 & pairs);
+    const uint64_t bottom_counts = (bottom & pairs) + (bottom >> 1 & pairs);
+    //even and odd blocks separately so a count of 4 has the room of a 4-bit field
+    const uint64_t fields = 0x3333333333333333ULL;
+    const uint64_t even = (top_counts & fields) + (bottom_counts & fields);
+    const uint64_t odd = (top_counts >> 2 & fields) + (bottom_counts >> 2 & fields);
+    for (uint8_t block = 0; block < 16; block++) {
+        out[block * 2] = shades[even >> (block * 4) & 0xF];
+        out[block * 2 + 1] = shades[odd >> (block * 4) & 0xF];
+    }
+}
+
+size_t observation_size(const observation_format_t format) {
+    switch (format) {
+        case OBSERVATION_PACKED:
+            return sizeof(packed_display_t);
+        case OBSERVATION_GRAY:
+            return 64 * 32;
+        case OBSERVATION_GRAY_HALF:
+            return 32 * 16;
+    }
+    return 0;
+}
+
+bool parse_observation_format(const char *name, observation_format_t *format) {
+    static const char *names[] = {"packed", "gray", "gray-half"};
+    for (uint8_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *format = (observation_format_t) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+//out has to hold observation_size(format) bytes
+void write_observation(const packed_display_t *packed, const observation_format_t format, uint8_t *out) {
+    switch (format) {
+        case OBSERVATION_PACKED:
+            for (uint8_t y = 0; y < 32; y++) {
+                for (uint8_t byte = 0; byte < 8; byte++)
+                    out[y * 8 + byte] = (uint8_t) (packed->rows[y] >> (byte * 8));
+            }
+            break;
+        case OBSERVATION_GRAY:
+            for (uint8_t y = 0; y < 32; y++)
+                unpack_row(packed->rows[y], &out[y * 64]);
+            break;
+        case OBSERVATION_GRAY_HALF:
+            for (uint8_t y = 0; y < 16; y++)
+                downsample_rows(packed->rows[y * 2], packed->rows[y * 2 + 1], &out[y * 32]);
+            break;
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef OBSERVATION_H
+#define OBSERVATION_H
+
+#include "chip8.h"
+
+//display with one bit per pixel, bit x of rows[y] set when pixel (x, y) is lit
+typedef struct {
+    uint64_t rows[32];
+} packed_display_t;
+
+//what a model gets to see of the display, all written row-major into caller buffers
+typedef enum {
+    OBSERVATION_PACKED,    // 256 bytes, 8 bytes per row, pixel x in bit x % 8 of byte x / 8
+    OBSERVATION_GRAY,      // 64x32 bytes, 0 or 255
+    OBSERVATION_GRAY_HALF, // 32x16 bytes, each the mean of a 2x2 block: 0, 64, 128, 191 or 255
+} observation_format_t;
+
+size_t observation_size(const observation_format_t format);
+bool parse_observation_format(const char *name, observation_format_t *format);
+void pack_display(const chip8_t *chip8, packed_display_t *packed);
+void write_observation(const packed_display_t *packed, const observation_format_t format, uint8_t *out);
+
+#endif
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "corpus.h"
+#ifdef _WIN32
+#include <direct.h>
+#define mkdir(path, mode) _mkdir(path)
+#endif
+
+//chip8_pack: builds and reads corpus packs (see corpus.h).
+//  create <pack> <rom>...   packs the ROMs under the paths given; "-" reads the paths from stdin, one
+//                           per line, e.g. find roms -name '*.ch8' | chip8_pack create roms.c8pak -
+//  list <pack>              ID, size, ROM hash and name of every ROM
+//  unpack <pack> <dir>      writes every ROM back out under dir
+//A packed ROM loads anywhere a ROM path is taken as <pack>#<ID or name>.
+
+typedef struct {
+    char **paths;
+    uint32_t count;
+    uint32_t capacity;
+} path_list_t;
+
+static bool add_path(path_list_t *list, const char *path) {
+    if (list->count == list->capacity) {
+        const uint32_t capacity = list->capacity ? list->capacity * 2 : 256;
+        char **grown = realloc(list->paths, sizeof(char *) * capacity);
+        if (!grown)
+            return false;
+        list->paths = grown;
+        list->capacity = capacity;
+    }
+    list->paths[list->count] = strdup(path);
+    return list->paths[list->count++] != NULL;
+}
+
+static int create(const char *path, char **roms, const int count) {
+    path_list_t files = {0};
+    bool ok = true;
+    for (int i = 0; ok && i < count; i++) {
+        if (strcmp(roms[i], "-") != 0) {
+            ok = add_path(&files, roms[i]);
+            continue;
+        }
+        char line[4096];
+        while (ok && fgets(line, sizeof(line), stdin)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0])
+                ok = add_path(&files, line);
+        }
+    }
+    //a ROM is named by the path it was packed from, without a leading ./
+    const char **names = ok ? malloc(sizeof(char *) * (files.count ? files.count : 1)) : NULL;
+    for (uint32_t i = 0; names && i < files.count; i++)
+        names[i] = strncmp(files.paths[i], "./", 2) == 0 ? files.paths[i] + 2 : files.paths[i];
+    if (!ok || !names)
+        fprintf(stderr, "Out of memory\n");
+    ok = names && write_corpus(path, (const char **) files.paths, names, files.count);
+    if (ok)
+        printf("Packed %u ROMs into %s\n", files.count, path);
+    for (uint32_t i = 0; i < files.count; i++)
+        free(files.paths[i]);
+    free(files.paths);
+    free(names);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int list(const char *path) {
+    corpus_t corpus;
+    if (!open_corpus(&corpus, path))
+        return EXIT_FAILURE;
+    for (uint32_t id = 0; id < corpus.count; id++) {
+        printf("%6u %6u %016llX %s\n", id, corpus.entries[id].rom_size,
+               (unsigned long long) corpus.entries[id].rom_hash, corpus_name(&corpus, id));
+    }
+    close_corpus(&corpus);
+    return EXIT_SUCCESS;
+}
+
+//names come from the pack, anything that could land outside dir is refused
+static bool safe_name(const char *name) {
+    if (!name[0] || name[0] == '/' || name[0] == '\\' || strchr(name, ':'))
+        return false;
+    for (const char *part = name; part; part = strpbrk(part, "/\\")) {
+        part += *part == '/' || *part == '\\';
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '\0' || part[2] == '/' || part[2] == '\\'))
+            return false;
+    }
+    return true;
+}
+
+static int unpack(const char *path, const char *dir) {
+    corpus_t corpus;
+    if (!open_corpus(&corpus, path))
+        return EXIT_FAILURE;
+    bool ok = true;
+    for (uint32_t id = 0; ok && id < corpus.count; id++) {
+        const char *name = corpus_name(&corpus, id);
+        char out[4096];
+        if (!safe_name(name) || snprintf(out, sizeof(out), "%s/%s", dir, name) >= (int) sizeof(out)) {
+            fprintf(stderr, "Refusing to unpack %s\n", name);
+            ok = false;
+            break;
+        }
+        //create the directories on the way, existing ones are fine
+        for (char *slash = strchr(out + strlen(dir) + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+            *slash = '\0';
+            mkdir(out, 0755);
+            *slash = '/';
+        }
+        size_t size;
+        const uint8_t *rom = corpus_rom(&corpus, id, &size);
+        FILE *file = fopen(out, "wb");
+        ok = file && (size == 0 || fwrite(rom, size, 1, file) == 1);
+        if (file && fclose(file) != 0)
+            ok = false;
+        if (!ok)
+            fprintf(stderr, "Could not write %s\n", out);
+    }
+    if (ok)
+        printf("Unpacked %u ROMs into %s\n", corpus.count, dir);
+    close_corpus(&corpus);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 4 && strcmp(argv[1], "create") == 0)
+        exit(create(argv[2], &argv[3], argc - 3));
+    if (argc == 3 && strcmp(argv[1], "list") == 0)
+        exit(list(argv[2]));
+    if (argc == 4 && strcmp(argv[1], "unpack") == 0) {
+        mkdir(argv[3], 0755);
+        exit(unpack(argv[2], argv[3]));
+    }
+    fprintf(stderr, "Usage: %s create <pack> <rom-path>... (- reads paths from stdin)\n"
+                    "       %s list <pack>\n"
+                    "       %s unpack <pack> <dir>\n",
+            argv[0], argv[0], argv[0]);
+    exit(EXIT_FAILURE);
+}
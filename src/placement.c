@@ -0,0 +1,117 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "placement.h"
+
+//from linux/mempolicy.h, so libnuma is not needed
+#define MEMPOLICY_BIND 2
+#define MEMPOLICY_MOVE 2
+
+//adds the CPUs of a sysfs list such as "0-3,8,10-11" that the process may use, returns how many
+static uint32_t add_cpu_list(topology_t *topology, const char *list, const uint8_t node, const void *allowed) {
+    uint32_t added = 0;
+    const char *at = list;
+    while (*at >= '0' && *at <= '9') {
+        char *end;
+        const unsigned long first = strtoul(at, &end, 10);
+        unsigned long last = first;
+        if (*end == '-')
+            last = strtoul(end + 1, &end, 10);
+        for (unsigned long cpu = first; cpu <= last && cpu < PLACEMENT_MAX_CPUS; cpu++) {
+#ifdef __linux__
+            if (allowed && !CPU_ISSET(cpu, (const cpu_set_t *) allowed))
+                continue;
+#endif
+            if (topology->cpu_count == PLACEMENT_MAX_CPUS)
+                return added;
+            topology->cpus[topology->cpu_count] = (uint16_t) cpu;
+            topology->nodes[topology->cpu_count++] = node;
+            added++;
+        }
+        at = *end == ',' ? end + 1 : end;
+    }
+    return added;
+}
+
+void read_topology(topology_t *topology) {
+    memset(topology, 0, sizeof(*topology));
+    const void *allowed = NULL;
+#ifdef __linux__
+    static cpu_set_t affinity;
+    if (sched_getaffinity(0, sizeof(affinity), &affinity) == 0)
+        allowed = &affinity;
+    for (uint32_t node = 0; node < PLACEMENT_MAX_NODES; node++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (!file)
+            continue;
+        char list[4096];
+        const bool read = fgets(list, sizeof(list), file) != NULL;
+        fclose(file);
+        //CPUs keep the kernel's node number, which mbind() takes; nodes without usable CPUs (memory
+        //only, or outside the affinity mask) are not counted
+        if (read && add_cpu_list(topology, list, (uint8_t) node, allowed))
+            topology->node_count++;
+    }
+#endif
+    if (topology->cpu_count)
+        return;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1)
+        online = 1;
+    topology->node_count = 1;
+    for (long cpu = 0; cpu < online && cpu < PLACEMENT_MAX_CPUS; cpu++) {
+#ifdef __linux__
+        if (allowed && !CPU_ISSET(cpu, (const cpu_set_t *) allowed))
+            continue;
+#endif
+        topology->cpus[topology->cpu_count++] = (uint16_t) cpu;
+    }
+    if (!topology->cpu_count)
+        topology->cpus[topology->cpu_count++] = 0;
+}
+
+//index into topology->cpus for worker out of workers, spreading them over the nodes in proportion
+//to their CPUs. Workers beyond the CPU count share.
+uint32_t worker_cpu(const topology_t *topology, const uint32_t worker, const uint32_t workers) {
+    return (uint32_t) ((uint64_t) worker * topology->cpu_count / (workers ? workers : 1));
+}
+
+//keeps the calling thread on cpu, false where affinity cannot be set
+bool pin_thread(const uint16_t cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void) cpu;
+    return false;
+#endif
+}
+
+//moves the whole pages inside memory to node and keeps them there, false where that is not supported
+bool bind_memory(void *memory, const size_t bytes, const uint8_t node) {
+#if defined(__linux__) && defined(SYS_mbind)
+    const uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    const uintptr_t start = ((uintptr_t) memory + page - 1) / page * page;
+    const uintptr_t end = ((uintptr_t) memory + bytes) / page * page;
+    if (end <= start)
+        return true;
+    unsigned long mask[PLACEMENT_MAX_NODES / (8 * sizeof(unsigned long))] = {0};
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << node % (8 * sizeof(unsigned long));
+    return syscall(SYS_mbind, start, end - start, MEMPOLICY_BIND, mask, sizeof(mask) * 8 + 1, MEMPOLICY_MOVE) == 0;
+#else
+    (void) memory;
+    (void) bytes;
+    (void) node;
+    return false;
+#endif
+}
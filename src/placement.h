@@ -0,0 +1,25 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PLACEMENT_MAX_CPUS 1024
+#define PLACEMENT_MAX_NODES 64
+
+//CPUs this process may run on, grouped node by node, read from /sys/devices/system/node. Anywhere
+//that cannot be read (one node, not Linux) it is a single node holding every online CPU.
+typedef struct {
+    uint16_t cpus[PLACEMENT_MAX_CPUS];
+    uint8_t nodes[PLACEMENT_MAX_CPUS]; // kernel node number of cpus[i], not necessarily below node_count
+    uint32_t cpu_count;
+    uint32_t node_count;               // nodes with CPUs in cpus
+} topology_t;
+
+void read_topology(topology_t *topology);
+uint32_t worker_cpu(const topology_t *topology, const uint32_t worker, const uint32_t workers);
+bool pin_thread(const uint16_t cpu);
+bool bind_memory(void *memory, const size_t bytes, const uint8_t node);
+
+#endif
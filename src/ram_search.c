@@ -0,0 +1,119 @@
+#include <string.h>
+#include "ram_search.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static uint32_t count_bits(uint64_t bits) {
+    bits = bits - ((bits >> 1) & 0x5555555555555555ULL);
+    bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    return (bits * 0x0101010101010101ULL) >> 56;
+}
+
+#ifdef __SSE2__
+//0xFF in every byte lane where current relates to previous as asked
+static inline __m128i compare_lanes(const __m128i current, const __m128i previous, const ram_relation_t relation,
+                                    const __m128i value) {
+    const __m128i equal = _mm_cmpeq_epi8(current, previous);
+    switch (relation) {
+        case RAM_EQUAL:
+            return equal;
+        case RAM_CHANGED:
+            return _mm_andnot_si128(equal, _mm_set1_epi8(-1));
+        case RAM_INCREASED:
+            //no unsigned compare in SSE2: current > previous when max(current, previous) is current and they differ
+            return _mm_andnot_si128(equal, _mm_cmpeq_epi8(_mm_max_epu8(current, previous), current));
+        case RAM_DECREASED:
+            return _mm_andnot_si128(equal, _mm_cmpeq_epi8(_mm_min_epu8(current, previous), current));
+        case RAM_VALUE:
+            return _mm_cmpeq_epi8(current, value);
+    }
+    return _mm_setzero_si128();
+}
+#endif
+
+//one bit per byte of a 64-byte block, set where the byte relates to the snapshot as asked
+static uint64_t match_block(const uint8_t *current, const uint8_t *previous, const ram_relation_t relation,
+                            const uint8_t value) {
+    uint64_t matches = 0;
+#ifdef __SSE2__
+    const __m128i wanted = _mm_set1_epi8((char) value);
+    for (uint8_t i = 0; i < 64; i += 16) {
+        const __m128i lanes = compare_lanes(_mm_loadu_si128((const __m128i *) &current[i]),
+                                            _mm_load_si128((const __m128i *) &previous[i]), relation, wanted);
+        matches |= (uint64_t) (uint16_t) _mm_movemask_epi8(lanes) << i;
+    }
+#else
+    for (uint8_t i = 0; i < 64; i++) {
+        bool match = false;
+        switch (relation) {
+            case RAM_EQUAL:
+                match = current[i] == previous[i];
+                break;
+            case RAM_CHANGED:
+                match = current[i] != previous[i];
+                break;
+            case RAM_INCREASED:
+                match = current[i] > previous[i];
+                break;
+            case RAM_DECREASED:
+                match = current[i] < previous[i];
+                break;
+            case RAM_VALUE:
+                match = current[i] == value;
+                break;
+        }
+        matches |= (uint64_t) match << i;
+    }
+#endif
+    return matches;
+}
+
+//every address is a candidate again, the current RAM becomes the snapshot to compare against
+void start_ram_search(ram_search_t *search, const chip8_t *chip8) {
+    memcpy(search->snapshot, chip8->ram, sizeof(search->snapshot));
+    memset(search->candidates, 0xFF, sizeof(search->candidates));
+    search->count = RAM_SEARCH_SIZE;
+}
+
+//drop the candidates whose byte does not match, then snapshot the RAM for the next filter.
+//value is only used by RAM_VALUE. Returns the candidates left.
+uint32_t filter_ram_search(ram_search_t *search, const chip8_t *chip8, const ram_relation_t relation,
+                           const uint8_t value) {
+    search->count = 0;
+    for (uint32_t word = 0; word < RAM_SEARCH_WORDS; word++) {
+        if (!search->candidates[word])
+            continue;
+        search->candidates[word] &= match_block(&chip8->ram[word * 64], &search->snapshot[word * 64], relation, value);
+        search->count += count_bits(search->candidates[word]);
+    }
+    memcpy(search->snapshot, chip8->ram, sizeof(search->snapshot));
+    return search->count;
+}
+
+//writes up to max candidate addresses in ascending order, returns how many were written
+uint32_t ram_candidates(const ram_search_t *search, uint16_t *addresses, const uint32_t max) {
+    uint32_t count = 0;
+    for (uint32_t word = 0; word < RAM_SEARCH_WORDS && count < max; word++) {
+        for (uint64_t bits = search->candidates[word]; bits && count < max; bits &= bits - 1) {
+            uint8_t bit = 0;
+            while (!(bits >> bit & 1))
+                bit++;
+            addresses[count++] = word * 64 + bit;
+        }
+    }
+    return count;
+}
+
+bool parse_ram_relation(const char *name, ram_relation_t *relation) {
+    static const char *names[] = {"equal", "changed", "increased", "decreased", "value"};
+    for (uint8_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *relation = (ram_relation_t) i;
+            return true;
+        }
+    }
+    return false;
+}
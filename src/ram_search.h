@@ -0,0 +1,33 @@
+#ifndef RAM_SEARCH_H
+#define RAM_SEARCH_H
+
+#include "chip8.h"
+
+//searches the whole of ram, kept a multiple of 64 bytes so every candidate word covers real memory
+#define RAM_SEARCH_SIZE sizeof(((chip8_t *) 0)->ram)
+#define RAM_SEARCH_WORDS (RAM_SEARCH_SIZE / 64)
+
+//how a byte has to relate to its value in the previous snapshot to stay a candidate
+typedef enum {
+    RAM_EQUAL,     // unchanged since the previous snapshot
+    RAM_CHANGED,
+    RAM_INCREASED, // unsigned
+    RAM_DECREASED,
+    RAM_VALUE,     // equal to the given value, regardless of the snapshot
+} ram_relation_t;
+
+//cheat finder: narrows the addresses that could hold e.g. the score or lives down over successive
+//snapshots. Candidates are a bitmap, one bit per RAM byte.
+typedef struct {
+    _Alignas(16) uint8_t snapshot[RAM_SEARCH_SIZE];
+    uint64_t candidates[RAM_SEARCH_WORDS];
+    uint32_t count;
+} ram_search_t;
+
+void start_ram_search(ram_search_t *search, const chip8_t *chip8);
+uint32_t filter_ram_search(ram_search_t *search, const chip8_t *chip8, const ram_relation_t relation,
+                           const uint8_t value);
+uint32_t ram_candidates(const ram_search_t *search, uint16_t *addresses, const uint32_t max);
+bool parse_ram_relation(const char *name, ram_relation_t *relation);
+
+#endif
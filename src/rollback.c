@@ -0,0 +1,288 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "rollback.h"
+
+#define ROLLBACK_NONE UINT32_MAX
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+//"host:port" to an IPv4 address
+static bool resolve_peer(struct sockaddr_in *address, const char *peer) {
+    char host[256];
+    const char *colon = strrchr(peer, ':');
+    if (!colon || colon == peer || (size_t) (colon - peer) >= sizeof(host))
+        return false;
+    memcpy(host, peer, colon - peer);
+    host[colon - peer] = '\0';
+    const struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *found;
+    if (getaddrinfo(host, colon + 1, &hints, &found) != 0)
+        return false;
+    memcpy(address, found->ai_addr, sizeof(*address));
+    freeaddrinfo(found);
+    return true;
+}
+
+//what both peers have to agree on for their machines to run the same: the ROM and CXNN seed (through
+//the initial state), the timing and the input delay
+static uint64_t session_hash(const chip8_t *chip8, const config_t config, const uint32_t input_delay) {
+    const uint32_t settings[] = {config.insts_per_second, config.extension, config.display_wait, config.timing,
+                                 config.cycles_per_frame, input_delay};
+    return hash_bytes(settings, sizeof(settings), state_hash(chip8));
+}
+
+//plays on port with the peer at "host:port". Both sides need the same ROM, config and input_delay.
+bool init_rollback(rollback_t *rollback, const config_t config, const char *romName, const uint16_t port,
+                   const char *peer, const uint32_t input_delay) {
+    memset(rollback, 0, sizeof(*rollback));
+    rollback->socket = -1;
+    if (input_delay > ROLLBACK_MAX_DELAY) {
+        fprintf(stderr, "The input delay can be at most %u frames\n", ROLLBACK_MAX_DELAY);
+        return false;
+    }
+    if (!resolve_peer(&rollback->peer, peer)) {
+        fprintf(stderr, "Could not resolve %s, expected host:port\n", peer);
+        return false;
+    }
+    if (!init_chip8(&rollback->machine, config, romName))
+        return false;
+
+    rollback->socket = socket(AF_INET, SOCK_DGRAM, 0);
+    const struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port),
+                                        .sin_addr.s_addr = htonl(INADDR_ANY)};
+    if (rollback->socket < 0 || fcntl(rollback->socket, F_SETFL, O_NONBLOCK) != 0 ||
+        bind(rollback->socket, (const struct sockaddr *) &address, sizeof(address)) != 0) {
+        fprintf(stderr, "Could not listen on UDP port %u: %s\n", port, strerror(errno));
+        free_rollback(rollback);
+        return false;
+    }
+    rollback->config = config;
+    rollback->input_delay = input_delay;
+    rollback->session = session_hash(&rollback->machine, config, input_delay);
+    //input for the frames before the delay is over is nothing on both sides
+    rollback->local_frame = input_delay;
+    rollback->remote_frame = input_delay;
+    rollback->rollback_from = ROLLBACK_NONE;
+    rollback->remote_hash_frame = ROLLBACK_NONE;
+    rollback->hashes[0] = state_hash(&rollback->machine);
+    rollback->confirmed = 1;
+    rollback->stats.first_desync = ROLLBACK_NONE;
+    return true;
+}
+
+void free_rollback(rollback_t *rollback) {
+    if (rollback->socket >= 0)
+        close(rollback->socket);
+    rollback->socket = -1;
+}
+
+//drops loss_percent of the packets sent and holds the rest back for latency_ms
+void simulate_network(rollback_t *rollback, const uint32_t latency_ms, const uint32_t loss_percent,
+                      const uint32_t seed) {
+    rollback->latency_ms = latency_ms;
+    rollback->loss_percent = loss_percent;
+    rollback->rng = seed ? seed : 1;
+}
+
+static void report_desync(rollback_t *rollback, const uint32_t frame) {
+    if (!rollback->stats.desyncs++) {
+        rollback->stats.first_desync = frame;
+        fprintf(stderr, "Desync: the peers' machines differ at frame %u\n", frame);
+    }
+}
+
+//compares the peer's hash of a confirmed frame with this side's
+static void check_hash(rollback_t *rollback, const uint32_t frame, const uint64_t hash) {
+    if (frame >= rollback->confirmed) {
+        //compared once this side confirms it
+        rollback->remote_hash_frame = frame;
+        rollback->remote_hash = hash;
+    } else if (rollback->confirmed - frame <= ROLLBACK_HASHES && rollback->hashes[frame % ROLLBACK_HASHES] != hash) {
+        report_desync(rollback, frame);
+    }
+}
+
+//records the state hash of every frame whose inputs are all known and emulated
+static void confirm_frames(rollback_t *rollback) {
+    const uint32_t target = rollback->remote_frame < rollback->frame ? rollback->remote_frame : rollback->frame;
+    for (; rollback->confirmed <= target; rollback->confirmed++) {
+        const uint32_t frame = rollback->confirmed;
+        const chip8_t *state = frame == rollback->frame ? &rollback->machine : &rollback->states[frame % ROLLBACK_STATES];
+        rollback->hashes[frame % ROLLBACK_HASHES] = state_hash(state);
+        if (frame == rollback->remote_hash_frame && rollback->remote_hash != rollback->hashes[frame % ROLLBACK_HASHES])
+            report_desync(rollback, frame);
+    }
+}
+
+static void receive_packet(rollback_t *rollback, const rollback_packet_t *packet) {
+    if (packet->ack > rollback->remote_ack && packet->ack <= rollback->local_frame)
+        rollback->remote_ack = packet->ack;
+    //a packet starting past what is known followed a lost one, its input comes again in the next
+    if (packet->first <= rollback->remote_frame) {
+        for (uint32_t i = 0; i < packet->count; i++) {
+            const uint32_t frame = packet->first + i;
+            if (frame < rollback->remote_frame)
+                continue;
+            if (frame >= rollback->confirmed + ROLLBACK_INPUTS - 1)
+                break;
+            const uint16_t input = packet->inputs[i];
+            rollback->remote_input[frame % ROLLBACK_INPUTS] = input;
+            if (frame < rollback->frame && rollback->used_remote[frame % ROLLBACK_INPUTS] != input &&
+                frame < rollback->rollback_from)
+                rollback->rollback_from = frame;
+            rollback->remote_frame = frame + 1;
+        }
+    }
+    check_hash(rollback, packet->hash_frame, packet->hash);
+}
+
+static void flush_outgoing(rollback_t *rollback, const uint64_t now) {
+    while (rollback->outgoing_count) {
+        const rollback_outgoing_t *outgoing = &rollback->outgoing[rollback->outgoing_head];
+        if (outgoing->due > now)
+            break;
+        sendto(rollback->socket, &outgoing->packet, outgoing->size, 0, (const struct sockaddr *) &rollback->peer,
+               sizeof(rollback->peer));
+        rollback->outgoing_head = (rollback->outgoing_head + 1) % ROLLBACK_OUTGOING;
+        rollback->outgoing_count--;
+    }
+}
+
+//sends the packets whose simulated latency is over and takes in everything the peer sent
+void poll_rollback(rollback_t *rollback) {
+    flush_outgoing(rollback, now_ns());
+    const size_t header = offsetof(rollback_packet_t, inputs);
+    for (;;) {
+        rollback_packet_t packet;
+        struct sockaddr_in from;
+        socklen_t from_size = sizeof(from);
+        const ssize_t size = recvfrom(rollback->socket, &packet, sizeof(packet), 0, (struct sockaddr *) &from,
+                                      &from_size);
+        if (size < 0)
+            break;
+        if ((size_t) size < header || packet.magic != ROLLBACK_MAGIC || packet.session != rollback->session ||
+            packet.count > ROLLBACK_INPUTS || (size_t) size < header + packet.count * sizeof(packet.inputs[0]) ||
+            from.sin_addr.s_addr != rollback->peer.sin_addr.s_addr || from.sin_port != rollback->peer.sin_port) {
+            if (!rollback->stats.packets_rejected++ && (size_t) size >= header && packet.session != rollback->session)
+                fprintf(stderr, "Ignoring the peer, it runs another ROM, seed, timing or input delay\n");
+            continue;
+        }
+        rollback->stats.packets_received++;
+        receive_packet(rollback, &packet);
+    }
+}
+
+static void send_packet(rollback_t *rollback) {
+    const uint32_t last = rollback->confirmed - 1;
+    rollback_packet_t packet = {
+            .magic = ROLLBACK_MAGIC,
+            .first = rollback->remote_ack,
+            .ack = rollback->remote_frame,
+            .hash_frame = last,
+            .hash = rollback->hashes[last % ROLLBACK_HASHES],
+            .session = rollback->session,
+            .count = (uint16_t) (rollback->local_frame - rollback->remote_ack),
+    };
+    for (uint32_t i = 0; i < packet.count; i++)
+        packet.inputs[i] = rollback->local_input[(packet.first + i) % ROLLBACK_INPUTS];
+    const size_t size = offsetof(rollback_packet_t, inputs) + packet.count * sizeof(packet.inputs[0]);
+    rollback->stats.packets_sent++;
+
+    if (rollback->loss_percent) {
+        rollback->rng = rollback->rng * 1664525u + 1013904223u;
+        if ((rollback->rng >> 8) % 100 < rollback->loss_percent) {
+            rollback->stats.packets_lost++;
+            return;
+        }
+    }
+    if (!rollback->latency_ms) {
+        sendto(rollback->socket, &packet, size, 0, (const struct sockaddr *) &rollback->peer, sizeof(rollback->peer));
+        return;
+    }
+    if (rollback->outgoing_count == ROLLBACK_OUTGOING) {
+        rollback->stats.packets_lost++;
+        return;
+    }
+    rollback_outgoing_t *outgoing =
+            &rollback->outgoing[(rollback->outgoing_head + rollback->outgoing_count++) % ROLLBACK_OUTGOING];
+    outgoing->due = now_ns() + (uint64_t) rollback->latency_ms * 1000000;
+    outgoing->size = size;
+    outgoing->packet = packet;
+}
+
+//snapshots the machine and emulates frame with the remote input known or predicted for it
+static void emulate_frame(rollback_t *rollback, const uint32_t frame) {
+    chip8_t *chip8 = &rollback->machine;
+    copy_chip8(&rollback->states[frame % ROLLBACK_STATES], chip8);
+    uint16_t remote = 0;
+    if (frame < rollback->remote_frame)
+        remote = rollback->remote_input[frame % ROLLBACK_INPUTS];
+    else if (rollback->remote_frame)
+        remote = rollback->remote_input[(rollback->remote_frame - 1) % ROLLBACK_INPUTS];
+    rollback->used_remote[frame % ROLLBACK_INPUTS] = remote;
+    const uint16_t keys = rollback->local_input[frame % ROLLBACK_INPUTS] | remote;
+    for (uint8_t key = 0; key < 16; key++)
+        chip8->keypad[key] = keys >> key & 1;
+    run_frame(chip8, rollback->config);
+}
+
+//goes back to the first frame emulated with a wrong prediction and emulates up to the current one again
+static void roll_back(rollback_t *rollback) {
+    const uint64_t start = now_ns();
+    const uint32_t from = rollback->rollback_from;
+    copy_chip8(&rollback->machine, &rollback->states[from % ROLLBACK_STATES]);
+    for (uint32_t frame = from; frame < rollback->frame; frame++)
+        emulate_frame(rollback, frame);
+    const uint64_t elapsed = now_ns() - start;
+    const uint32_t depth = rollback->frame - from;
+    rollback->stats.rollbacks++;
+    rollback->stats.resimulated += depth;
+    rollback->stats.max_depth = depth > rollback->stats.max_depth ? depth : rollback->stats.max_depth;
+    rollback->stats.rollback_ns += elapsed;
+    rollback->stats.max_rollback_ns = elapsed > rollback->stats.max_rollback_ns ? elapsed
+                                                                                : rollback->stats.max_rollback_ns;
+}
+
+//one 60Hz tick: corrects mispredictions, emulates the next frame with keys (the local keypad, bit k
+//for key k) taking effect input_delay frames later, and sends the local input. Returns false if the
+//frame had to wait for the peer's input instead.
+bool advance_rollback(rollback_t *rollback, const uint16_t keys) {
+    if (rollback->rollback_from < rollback->frame)
+        roll_back(rollback);
+    rollback->rollback_from = ROLLBACK_NONE;
+    confirm_frames(rollback);
+
+    const bool waiting = rollback->frame >= rollback->remote_frame + ROLLBACK_MAX_PREDICTION ||
+                         rollback->local_frame + 1 - rollback->remote_ack > ROLLBACK_INPUTS;
+    if (waiting) {
+        rollback->stats.stalls++;
+    } else {
+        rollback->local_input[rollback->local_frame++ % ROLLBACK_INPUTS] = keys;
+        emulate_frame(rollback, rollback->frame++);
+        rollback->stats.frames++;
+        confirm_frames(rollback);
+    }
+    send_packet(rollback);
+    return !waiting;
+}
+
+//the state hash at the start of a confirmed frame, if it is still kept
+bool confirmed_hash(const rollback_t *rollback, const uint32_t frame, uint64_t *hash) {
+    if (frame >= rollback->confirmed || rollback->confirmed - frame > ROLLBACK_HASHES)
+        return false;
+    *hash = rollback->hashes[frame % ROLLBACK_HASHES];
+    return true;
+}
@@ -0,0 +1,96 @@
+#ifndef ROLLBACK_H
+#define ROLLBACK_H
+
+#include <netinet/in.h>
+#include "chip8.h"
+
+#define ROLLBACK_MAGIC 0x43385250u       // "PR8C"
+#define ROLLBACK_MAX_PREDICTION 8        // frames run ahead of the remote input before waiting for it
+#define ROLLBACK_STATES 16               // snapshots kept, more than ROLLBACK_MAX_PREDICTION
+#define ROLLBACK_INPUTS 64               // frames of input kept for either player
+#define ROLLBACK_HASHES 64               // confirmed frames whose state hash is kept to compare
+#define ROLLBACK_MAX_DELAY 8
+#define ROLLBACK_OUTGOING 256            // packets held back by a simulated latency
+
+//Rollback netplay between two peers over UDP. Both run the same ROM with the same config and seed,
+//the machine sees the keys of both players ORed into one keypad. Local input is applied input_delay
+//frames after it was read. Remote input that has not arrived yet is predicted to stay what it was
+//last; when it arrives different, the machine goes back to the snapshot of that frame and emulates
+//the frames since again with the real input. A peer more than ROLLBACK_MAX_PREDICTION frames ahead
+//of the remote input waits for it.
+//Every packet carries all the local input the peer has not acknowledged, so a lost packet costs
+//nothing but latency, and the state hash of a confirmed frame, which the peers compare to find
+//desyncs. Loss and latency can be simulated on the sending side.
+typedef struct {
+    uint32_t magic;
+    uint32_t first;      // frame of inputs[0]
+    uint32_t ack;        // the sender has the receiver's input for every frame below this
+    uint32_t hash_frame; // a frame every input before which the sender has, and the state then
+    uint64_t hash;
+    uint64_t session;    // the peers' ROM, config and input delay must agree
+    uint16_t count;
+    uint16_t inputs[ROLLBACK_INPUTS];
+} rollback_packet_t;
+
+typedef struct {
+    uint64_t due; // monotonic ns
+    size_t size;
+    rollback_packet_t packet;
+} rollback_outgoing_t;
+
+typedef struct {
+    uint64_t frames;           // advanced
+    uint64_t stalls;           // ticks spent waiting for remote input
+    uint64_t rollbacks;
+    uint64_t resimulated;      // frames emulated again
+    uint32_t max_depth;        // most frames one rollback went back
+    uint64_t rollback_ns;      // restoring and resimulating
+    uint64_t max_rollback_ns;
+    uint64_t packets_sent;
+    uint64_t packets_lost;     // dropped by the simulated loss
+    uint64_t packets_received;
+    uint64_t packets_rejected; // another session, or malformed
+    uint64_t desyncs;
+    uint32_t first_desync;     // frame the peers' states first differed at
+} rollback_stats_t;
+
+typedef struct {
+    int socket;
+    struct sockaddr_in peer;
+    config_t config;
+    uint32_t input_delay;
+    uint64_t session;
+    chip8_t machine;                       // at the start of frame
+    chip8_t states[ROLLBACK_STATES];       // the machine at the start of each recent frame
+    uint16_t local_input[ROLLBACK_INPUTS];
+    uint16_t remote_input[ROLLBACK_INPUTS];
+    uint16_t used_remote[ROLLBACK_INPUTS]; // remote input each frame was last emulated with
+    uint32_t frame;                        // next frame to emulate
+    uint32_t local_frame;                  // local input is known below this
+    uint32_t remote_frame;                 // remote input is known below this
+    uint32_t remote_ack;                   // the peer has the local input below this
+    uint32_t rollback_from;                // earliest frame emulated with a wrong prediction
+    uint32_t confirmed;                    // frames every input is known for
+    uint64_t hashes[ROLLBACK_HASHES];      // state hash at the start of each recently confirmed frame
+    uint32_t remote_hash_frame;            // the last hash the peer sent
+    uint64_t remote_hash;
+    //simulated network on the sending side
+    uint32_t latency_ms;
+    uint32_t loss_percent;
+    uint32_t rng;
+    rollback_outgoing_t outgoing[ROLLBACK_OUTGOING];
+    uint32_t outgoing_head;
+    uint32_t outgoing_count;
+    rollback_stats_t stats;
+} rollback_t;
+
+bool init_rollback(rollback_t *rollback, const config_t config, const char *romName, const uint16_t port,
+                   const char *peer, const uint32_t input_delay);
+void free_rollback(rollback_t *rollback);
+void simulate_network(rollback_t *rollback, const uint32_t latency_ms, const uint32_t loss_percent,
+                      const uint32_t seed);
+void poll_rollback(rollback_t *rollback);
+bool advance_rollback(rollback_t *rollback, const uint16_t keys);
+bool confirmed_hash(const rollback_t *rollback, const uint32_t frame, uint64_t *hash);
+
+#endif
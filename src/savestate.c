@@ -0,0 +1,344 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "savestate.h"
+
+//LZ77 in sequences: a token (literal count << 4 | match length - LZ_MIN_MATCH), the literals, a 16-bit
+//little-endian match offset. A count of 15 in the token continues in the bytes after it, each adding
+//up to 255 and 255 meaning another follows. The last sequence only has literals. Matches may overlap
+//what they copy, a run of zeros is one byte followed by a match at offset 1.
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xFFFF
+
+static uint32_t lz_hash(const uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static bool put_length(uint8_t **out, const uint8_t *end, size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (*out == end)
+            return false;
+        *(*out)++ = 255;
+    }
+    if (*out == end)
+        return false;
+    *(*out)++ = (uint8_t) length;
+    return true;
+}
+
+static bool get_length(const uint8_t **in, const uint8_t *end, size_t *length) {
+    uint8_t byte;
+    do {
+        if (*in == end)
+            return false;
+        byte = *(*in)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+//one sequence, match_length 0 for the last one
+static bool put_sequence(uint8_t **out, const uint8_t *end, const uint8_t *literals, const size_t literal_count,
+                         const size_t offset, const size_t match_length) {
+    if (*out == end)
+        return false;
+    const size_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+    uint8_t *token = (*out)++;
+    *token = (uint8_t) ((literal_count < 15 ? literal_count : 15) << 4 | (match_code < 15 ? match_code : 15));
+    if (literal_count >= 15 && !put_length(out, end, literal_count - 15))
+        return false;
+    if ((size_t) (end - *out) < literal_count)
+        return false;
+    memcpy(*out, literals, literal_count);
+    *out += literal_count;
+    if (!match_length)
+        return true;
+    if (end - *out < 2)
+        return false;
+    *(*out)++ = (uint8_t) offset;
+    *(*out)++ = (uint8_t) (offset >> 8);
+    return match_code < 15 || put_length(out, end, match_code - 15);
+}
+
+//compresses size bytes of src into dst, returns the compressed size or 0 if it did not fit in capacity
+size_t compress_bytes(const uint8_t *src, const size_t size, uint8_t *dst, const size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    uint8_t *out = dst;
+    const uint8_t *end = dst + capacity;
+    size_t anchor = 0;
+    size_t pos = 0;
+
+    while (size >= LZ_MIN_MATCH && pos <= size - LZ_MIN_MATCH) {
+        uint32_t sequence, candidate_sequence;
+        memcpy(&sequence, src + pos, sizeof(sequence));
+        const uint32_t slot = lz_hash(sequence);
+        const size_t candidate = table[slot];
+        table[slot] = (uint32_t) pos;
+        memcpy(&candidate_sequence, src + candidate, sizeof(candidate_sequence));
+        if (candidate >= pos || pos - candidate > LZ_MAX_OFFSET || candidate_sequence != sequence) {
+            pos++;
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH;
+        while (pos + length + 8 <= size) {
+            uint64_t a, b;
+            memcpy(&a, src + candidate + length, sizeof(a));
+            memcpy(&b, src + pos + length, sizeof(b));
+            if (a != b)
+                break;
+            length += 8;
+        }
+        while (pos + length < size && src[candidate + length] == src[pos + length])
+            length++;
+
+        if (!put_sequence(&out, end, src + anchor, pos - anchor, pos - candidate, length))
+            return 0;
+        pos += length;
+        anchor = pos;
+    }
+    if (!put_sequence(&out, end, src + anchor, size - anchor, 0, 0))
+        return 0;
+    return out - dst;
+}
+
+//decompresses src into exactly raw_size bytes of dst, false if src is not a valid compression of that many
+bool decompress_bytes(const uint8_t *src, const size_t size, uint8_t *dst, const size_t raw_size) {
+    const uint8_t *in = src;
+    const uint8_t *in_end = src + size;
+    uint8_t *out = dst;
+    const uint8_t *out_end = dst + raw_size;
+
+    while (in < in_end) {
+        const uint8_t token = *in++;
+        size_t literal_count = token >> 4;
+        if (literal_count == 15 && !get_length(&in, in_end, &literal_count))
+            return false;
+        if (literal_count > (size_t) (in_end - in) || literal_count > (size_t) (out_end - out))
+            return false;
+        memcpy(out, in, literal_count);
+        in += literal_count;
+        out += literal_count;
+        if (in == in_end)
+            break;
+
+        if (in_end - in < 2)
+            return false;
+        const size_t offset = in[0] | in[1] << 8;
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15 && !get_length(&in, in_end, &length))
+            return false;
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t) (out - dst) || length > (size_t) (out_end - out))
+            return false;
+
+        //the bytes from the match start repeat every offset bytes, so each copy can take twice as
+        //many as the one before without overlapping what it writes
+        const uint8_t *from = out - offset;
+        while (length) {
+            size_t count = out - from;
+            count = count < length ? count : length;
+            memcpy(out, from, count);
+            out += count;
+            length -= count;
+        }
+    }
+    return out == out_end;
+}
+
+//where serialize_chip8() puts the fields deserialize_chip8() checks before loading anything
+#define STATE_I 17
+#define STATE_PC 19
+#define STATE_WAIT_KEY 23
+#define STATE_STACK_DEPTH 24
+#define STATE_STACK 25
+#define STATE_KEYPAD 49
+
+static void put_bytes(uint8_t **out, const void *data, const size_t size) {
+    memcpy(*out, data, size);
+    *out += size;
+}
+
+static void get_bytes(const uint8_t **in, void *data, const size_t size) {
+    memcpy(data, *in, size);
+    *in += size;
+}
+
+//true if the serialized uint16_t at offset is a RAM address
+static bool valid_address(const uint8_t *raw, const size_t offset) {
+    uint16_t address;
+    memcpy(&address, raw + offset, sizeof(address));
+    return address < sizeof(((chip8_t *) 0)->ram);
+}
+
+//true if every byte of a serialized bool array is 0 or 1
+static bool valid_bools(const uint8_t *bytes, const size_t size) {
+    uint64_t bits = 0;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        bits |= word;
+    }
+    for (; i < size; i++)
+        bits |= bytes[i];
+    return !(bits & 0xFEFEFEFEFEFEFEFEULL);
+}
+
+static void serialize_chip8(const chip8_t *chip8, uint8_t raw[SAVESTATE_RAW_SIZE]) {
+    uint8_t *out = raw;
+    const uint8_t state = (uint8_t) chip8->state;
+    const uint8_t stack_depth = (uint8_t) (chip8->stackPtr - chip8->stack);
+    put_bytes(&out, &state, sizeof(state));
+    put_bytes(&out, chip8->V, sizeof(chip8->V));
+    put_bytes(&out, &chip8->I, sizeof(chip8->I));
+    put_bytes(&out, &chip8->PC, sizeof(chip8->PC));
+    put_bytes(&out, &chip8->delayTimer, sizeof(chip8->delayTimer));
+    put_bytes(&out, &chip8->soundTimer, sizeof(chip8->soundTimer));
+    put_bytes(&out, &chip8->wait_key, sizeof(chip8->wait_key));
+    put_bytes(&out, &stack_depth, sizeof(stack_depth));
+    put_bytes(&out, chip8->stack, sizeof(chip8->stack));
+    put_bytes(&out, chip8->keypad, sizeof(chip8->keypad));
+    put_bytes(&out, &chip8->rng, sizeof(chip8->rng));
+    put_bytes(&out, &chip8->cycles, sizeof(chip8->cycles));
+    put_bytes(&out, &chip8->ram_hash, sizeof(chip8->ram_hash));
+    put_bytes(&out, &chip8->display_hash, sizeof(chip8->display_hash));
+    put_bytes(&out, chip8->ram, sizeof(chip8->ram));
+    put_bytes(&out, chip8->display, sizeof(chip8->display));
+}
+
+//the machine is only written once the whole state checked out. The checksum only catches damage, a
+//crafted state passes it, so everything the interpreter indexes with is range checked here.
+static bool deserialize_chip8(chip8_t *chip8, const uint8_t raw[SAVESTATE_RAW_SIZE]) {
+    const uint8_t *display = raw + SAVESTATE_RAW_SIZE - sizeof(chip8->display);
+    const uint8_t state = raw[0];
+    const uint8_t wait_key = raw[STATE_WAIT_KEY];
+    const uint8_t stack_depth = raw[STATE_STACK_DEPTH];
+    if (state > PAUSED || stack_depth > sizeof(chip8->stack) / sizeof(chip8->stack[0]) ||
+        (wait_key >= sizeof(chip8->keypad) && wait_key != 0xFF) || !valid_address(raw, STATE_I) ||
+        !valid_address(raw, STATE_PC) || !valid_bools(raw + STATE_KEYPAD, sizeof(chip8->keypad)) ||
+        !valid_bools(display, sizeof(chip8->display)))
+        return false;
+    //return addresses become the PC
+    for (uint8_t i = 0; i < stack_depth; i++) {
+        if (!valid_address(raw, STATE_STACK + i * sizeof(chip8->stack[0])))
+            return false;
+    }
+
+    const uint8_t *in = raw + 1;
+    get_bytes(&in, chip8->V, sizeof(chip8->V));
+    get_bytes(&in, &chip8->I, sizeof(chip8->I));
+    get_bytes(&in, &chip8->PC, sizeof(chip8->PC));
+    get_bytes(&in, &chip8->delayTimer, sizeof(chip8->delayTimer));
+    get_bytes(&in, &chip8->soundTimer, sizeof(chip8->soundTimer));
+    get_bytes(&in, &chip8->wait_key, sizeof(chip8->wait_key));
+    in++;
+    get_bytes(&in, chip8->stack, sizeof(chip8->stack));
+    get_bytes(&in, chip8->keypad, sizeof(chip8->keypad));
+    get_bytes(&in, &chip8->rng, sizeof(chip8->rng));
+    get_bytes(&in, &chip8->cycles, sizeof(chip8->cycles));
+    get_bytes(&in, &chip8->ram_hash, sizeof(chip8->ram_hash));
+    get_bytes(&in, &chip8->display_hash, sizeof(chip8->display_hash));
+    get_bytes(&in, chip8->ram, sizeof(chip8->ram));
+    get_bytes(&in, chip8->display, sizeof(chip8->display));
+    chip8->state = (emulator_state_t) state;
+    chip8->stackPtr = &chip8->stack[stack_depth];
+    chip8->ram_dirty = 0xFFFF;
+    chip8->display_dirty = true;
+    return true;
+}
+
+//writes the state of chip8 to buffer, compressed if asked and it saves space. Returns the bytes
+//written or 0 if capacity is too small, SAVESTATE_MAX_SIZE always is enough.
+size_t save_state(const chip8_t *chip8, uint8_t *buffer, const size_t capacity, const bool compress) {
+    if (capacity < sizeof(savestate_header_t))
+        return 0;
+    uint8_t raw[SAVESTATE_RAW_SIZE];
+    serialize_chip8(chip8, raw);
+
+    savestate_header_t header = {
+            .magic = SAVESTATE_MAGIC,
+            .version = SAVESTATE_VERSION,
+            .byte_order = SAVESTATE_BYTE_ORDER,
+            .raw_size = SAVESTATE_RAW_SIZE,
+            .checksum = hash_bytes(raw, sizeof(raw), 0),
+    };
+    uint8_t *payload = buffer + sizeof(header);
+    const size_t room = capacity - sizeof(header);
+    size_t stored = compress ? compress_bytes(raw, sizeof(raw), payload, room < sizeof(raw) ? room : sizeof(raw) - 1)
+                             : 0;
+    if (stored) {
+        header.flags = SAVESTATE_COMPRESSED;
+    } else {
+        if (room < sizeof(raw))
+            return 0;
+        memcpy(payload, raw, sizeof(raw));
+        stored = sizeof(raw);
+    }
+    header.stored_size = (uint32_t) stored;
+    memcpy(buffer, &header, sizeof(header));
+    return sizeof(header) + stored;
+}
+
+//loads a state written by save_state(). chip8 is left as it was if the state is damaged or from
+//another version, the machine keeps its romName.
+bool load_state(chip8_t *chip8, const uint8_t *buffer, const size_t size) {
+    savestate_header_t header;
+    if (size < sizeof(header))
+        return false;
+    memcpy(&header, buffer, sizeof(header));
+    if (memcmp(header.magic, SAVESTATE_MAGIC, sizeof(header.magic)) != 0 || header.version != SAVESTATE_VERSION ||
+        header.byte_order != SAVESTATE_BYTE_ORDER || header.raw_size != SAVESTATE_RAW_SIZE ||
+        header.stored_size != size - sizeof(header))
+        return false;
+
+    const uint8_t *payload = buffer + sizeof(header);
+    uint8_t raw[SAVESTATE_RAW_SIZE];
+    if (header.flags == SAVESTATE_COMPRESSED) {
+        if (!decompress_bytes(payload, header.stored_size, raw, sizeof(raw)))
+            return false;
+    } else if (header.flags == 0 && header.stored_size == sizeof(raw)) {
+        memcpy(raw, payload, sizeof(raw));
+    } else {
+        return false;
+    }
+    if (hash_bytes(raw, sizeof(raw), 0) != header.checksum)
+        return false;
+    return deserialize_chip8(chip8, raw);
+}
+
+bool save_state_file(const chip8_t *chip8, const char *path, const bool compress) {
+    uint8_t buffer[SAVESTATE_MAX_SIZE];
+    const size_t size = save_state(chip8, buffer, sizeof(buffer), compress);
+    FILE *out = fopen(path, "wb");
+    if (!out) {
+        fprintf(stderr, "Could not create %s\n", path);
+        return false;
+    }
+    const bool ok = fwrite(buffer, size, 1, out) == 1;
+    if (fclose(out) != 0 || !ok) {
+        fprintf(stderr, "Could not write %s\n", path);
+        return false;
+    }
+    return true;
+}
+
+bool load_state_file(chip8_t *chip8, const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (!in) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return false;
+    }
+    //one byte more than any state, so a longer file is not mistaken for one
+    uint8_t buffer[SAVESTATE_MAX_SIZE + 1];
+    const size_t size = fread(buffer, 1, sizeof(buffer), in);
+    fclose(in);
+    if (!load_state(chip8, buffer, size)) {
+        fprintf(stderr, "%s is not a valid save state\n", path);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include "chip8.h"
+
+#define SAVESTATE_MAGIC "CHIP8SAV"
+#define SAVESTATE_VERSION 1
+#define SAVESTATE_BYTE_ORDER 0x01020304u
+#define SAVESTATE_COMPRESSED 0x1u
+
+//A save state: the header followed by the serialized machine, stored as is or compressed with the
+//built-in LZ codec (see compress_bytes). Integers are in the byte order of the machine that saved it,
+//like corpus packs. Everything but romName, inst and the dirty flags is saved, the hashes included,
+//so loading does not rehash anything.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t flags;
+    uint32_t raw_size;    // of the serialized machine
+    uint32_t stored_size; // of the payload following the header
+    uint32_t reserved;
+    uint64_t checksum;    // hash_bytes() of the serialized machine
+} savestate_header_t;
+
+//registers, stack, keypad, rng, cycles and hashes, then RAM and display
+#define SAVESTATE_REGISTERS_SIZE 93
+#define SAVESTATE_RAW_SIZE (SAVESTATE_REGISTERS_SIZE + 4096 + 64 * 32)
+//the most save_state() ever writes, a state that does not compress is stored raw
+#define SAVESTATE_MAX_SIZE (sizeof(savestate_header_t) + SAVESTATE_RAW_SIZE)
+
+size_t compress_bytes(const uint8_t *src, const size_t size, uint8_t *dst, const size_t capacity);
+bool decompress_bytes(const uint8_t *src, const size_t size, uint8_t *dst, const size_t raw_size);
+size_t save_state(const chip8_t *chip8, uint8_t *buffer, const size_t capacity, const bool compress);
+bool load_state(chip8_t *chip8, const uint8_t *buffer, const size_t size);
+bool save_state_file(const chip8_t *chip8, const char *path, const bool compress);
+bool load_state_file(chip8_t *chip8, const char *path);
+
+#endif
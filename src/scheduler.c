@@ -0,0 +1,318 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "scheduler.h"
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static bool due_before(const scheduler_t *scheduler, const uint32_t a, const uint32_t b) {
+    return scheduler->tasks[a].due < scheduler->tasks[b].due;
+}
+
+static void push_task(scheduler_t *scheduler, const uint32_t task) {
+    uint32_t i = scheduler->queue_size++;
+    while (i && due_before(scheduler, task, scheduler->queue[(i - 1) / 2])) {
+        scheduler->queue[i] = scheduler->queue[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    scheduler->queue[i] = task;
+}
+
+static uint32_t pop_task(scheduler_t *scheduler) {
+    const uint32_t top = scheduler->queue[0];
+    const uint32_t last = scheduler->queue[--scheduler->queue_size];
+    uint32_t i = 0;
+    for (;;) {
+        uint32_t child = i * 2 + 1;
+        if (child >= scheduler->queue_size)
+            break;
+        if (child + 1 < scheduler->queue_size && due_before(scheduler, scheduler->queue[child + 1],
+                                                            scheduler->queue[child]))
+            child++;
+        if (!due_before(scheduler, scheduler->queue[child], last))
+            break;
+        scheduler->queue[i] = scheduler->queue[child];
+        i = child;
+    }
+    scheduler->queue[i] = last;
+    return top;
+}
+
+//FX0A cannot finish before the keypad changes: nothing pressed yet, or the latched key still held
+static bool waiting_for_key(const chip8_t *chip8) {
+    if (chip8->ram[chip8->PC] >> 4 != 0xF || chip8->ram[chip8->PC + 1] != 0x0A)
+        return false;
+    if (chip8->wait_key != 0xFF)
+        return chip8->keypad[chip8->wait_key];
+    for (uint8_t key = 0; key < sizeof(chip8->keypad); key++) {
+        if (chip8->keypad[key])
+            return false;
+    }
+    return true;
+}
+
+//frames a "FX07; 3X00; 1NNN back to FX07" loop around PC keeps polling the delay timer, 0 if PC is
+//not in such a loop
+static uint32_t delay_wait_frames(const chip8_t *chip8) {
+    for (uint16_t back = 0; back <= 4 && back <= chip8->PC; back += 2) {
+        const uint32_t loop = chip8->PC - back;
+        if (loop + 6 > sizeof(chip8->ram))
+            continue;
+        const uint8_t *code = &chip8->ram[loop];
+        const uint8_t X = code[0] & 0xF;
+        if (code[0] >> 4 == 0xF && code[1] == 0x07 && code[2] == (0x30 | X) && code[3] == 0x00 &&
+            code[4] == (0x10 | loop >> 8) && code[5] == (loop & 0xFF))
+            return chip8->delayTimer;
+    }
+    return 0;
+}
+
+//timers keep running while a task is parked, catch them up before it runs again
+static void fast_forward(task_t *task) {
+    const uint32_t frames = task->timer_frames;
+    chip8_t *chip8 = &task->chip8;
+    chip8->delayTimer = chip8->delayTimer > frames ? chip8->delayTimer - frames : 0;
+    chip8->soundTimer = chip8->soundTimer > frames ? chip8->soundTimer - frames : 0;
+    task->skipped_frames += frames;
+    task->timer_frames = 0;
+}
+
+//queued key changes, stopping before one that would undo a change made for this frame so a tap
+//shorter than a frame is still seen pressed for one
+static void apply_key_events(task_t *task) {
+    uint16_t changed = 0;
+    while (task->event_count) {
+        const key_event_t event = task->events[task->event_head];
+        if (changed & (1 << event.key))
+            break;
+        if (task->chip8.keypad[event.key] != event.pressed)
+            changed |= 1 << event.key;
+        task->chip8.keypad[event.key] = event.pressed;
+        task->event_head = (task->event_head + 1) % SCHEDULER_KEY_EVENTS;
+        task->event_count--;
+    }
+}
+
+static void record_latency(scheduler_t *scheduler, const uint64_t latency) {
+    uint8_t bucket = 0;
+    while (bucket < SCHEDULER_LATENCY_BUCKETS - 1 && latency >= 1ULL << bucket)
+        bucket++;
+    scheduler->latency[bucket]++;
+    scheduler->latency_total += latency;
+    if (latency > scheduler->latency_max)
+        scheduler->latency_max = latency;
+}
+
+static void *scheduler_worker(void *data) {
+    scheduler_t *scheduler = (scheduler_t *) data;
+    pthread_mutex_lock(&scheduler->lock);
+    while (!scheduler->stopping) {
+        if (!scheduler->queue_size) {
+            pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+            continue;
+        }
+        const uint64_t now = now_ns();
+        task_t *task = &scheduler->tasks[scheduler->queue[0]];
+        if (task->due > now) {
+            const struct timespec until = {.tv_sec = task->due / 1000000000ULL, .tv_nsec = task->due % 1000000000ULL};
+            pthread_cond_timedwait(&scheduler->wake, &scheduler->lock, &until);
+            continue;
+        }
+        pop_task(scheduler);
+        record_latency(scheduler, now - task->due);
+        fast_forward(task);
+        apply_key_events(task);
+        task->state = TASK_RUNNING;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        run_frame(&task->chip8, scheduler->config);
+        const bool key_wait = waiting_for_key(&task->chip8);
+        const uint32_t timer_frames = delay_wait_frames(&task->chip8);
+        const uint64_t next = scheduler->frame_ns ? task->due + scheduler->frame_ns : now;
+
+        pthread_mutex_lock(&scheduler->lock);
+        task->frames++;
+        //a task that fell more than a frame behind starts over from now rather than bursting to catch up
+        task->due = next + scheduler->frame_ns < now ? now : next;
+        if (key_wait && !task->event_count) {
+            task->state = TASK_WAIT_KEY;
+            task->parks++;
+            continue;
+        }
+        if (timer_frames > 1) {
+            task->state = TASK_WAIT_TIMER;
+            task->timer_frames = timer_frames;
+            task->due += scheduler->frame_ns * timer_frames;
+            task->parks++;
+        } else {
+            task->state = TASK_READY;
+        }
+        push_task(scheduler, task - scheduler->tasks);
+        pthread_cond_signal(&scheduler->wake);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return NULL;
+}
+
+//tasks copies of initial, run paced at one frame per frame_ns once started
+static bool init_tasks(scheduler_t *scheduler, const config_t config, const chip8_t *initial, const uint32_t tasks,
+                       const uint32_t threads, const uint64_t frame_ns) {
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->config = config;
+    scheduler->frame_ns = frame_ns;
+    scheduler->task_count = tasks;
+    scheduler->thread_count = threads ? threads : 1;
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&scheduler->wake, &attributes);
+    pthread_condattr_destroy(&attributes);
+    pthread_mutex_init(&scheduler->lock, NULL);
+
+    const bool arena = init_arena(&scheduler->arena, sizeof(task_t), tasks, config.huge_pages);
+    scheduler->tasks = (task_t *) scheduler->arena.base;
+    scheduler->queue = malloc(sizeof(uint32_t) * (tasks ? tasks : 1));
+    scheduler->threads = calloc(scheduler->thread_count, sizeof(pthread_t));
+    if (!arena || !scheduler->queue || !scheduler->threads) {
+        free_scheduler(scheduler);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < tasks; i++)
+        copy_chip8(&scheduler->tasks[i].chip8, initial);
+    return true;
+}
+
+bool init_scheduler(scheduler_t *scheduler, const config_t config, const char *romName, const uint32_t tasks,
+                    const uint32_t threads, const uint64_t frame_ns) {
+    static chip8_t initial;
+    return init_chip8(&initial, config, romName) && init_tasks(scheduler, config, &initial, tasks, threads, frame_ns);
+}
+
+//the ROM with that ID in an open corpus pack, loaded straight from the mapping
+bool init_scheduler_corpus(scheduler_t *scheduler, const config_t config, const corpus_t *corpus, const uint32_t id,
+                           const uint32_t tasks, const uint32_t threads, const uint64_t frame_ns) {
+    static chip8_t initial;
+    size_t size;
+    const uint8_t *rom = id < corpus->count ? corpus_rom(corpus, id, &size) : NULL;
+    return rom && init_chip8_rom(&initial, config, corpus_name(corpus, id), rom, size) &&
+           init_tasks(scheduler, config, &initial, tasks, threads, frame_ns);
+}
+
+bool start_scheduler(scheduler_t *scheduler) {
+    //tasks start spread over one frame, all due at the same instant they would queue behind each other
+    const uint64_t now = now_ns();
+    for (uint32_t i = 0; i < scheduler->task_count; i++) {
+        scheduler->tasks[i].due = now + scheduler->frame_ns * i / scheduler->task_count;
+        push_task(scheduler, i);
+    }
+    for (uint32_t i = 0; i < scheduler->thread_count; i++) {
+        if (pthread_create(&scheduler->threads[i], NULL, scheduler_worker, scheduler) != 0) {
+            scheduler->thread_count = i;
+            stop_scheduler(scheduler);
+            return false;
+        }
+    }
+    return true;
+}
+
+void stop_scheduler(scheduler_t *scheduler) {
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->stopping = true;
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+    for (uint32_t i = 0; i < scheduler->thread_count; i++)
+        pthread_join(scheduler->threads[i], NULL);
+    scheduler->thread_count = 0;
+}
+
+void free_scheduler(scheduler_t *scheduler) {
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->wake);
+    free_arena(&scheduler->arena);
+    free(scheduler->queue);
+    free(scheduler->threads);
+    scheduler->tasks = NULL;
+    scheduler->queue = NULL;
+    scheduler->threads = NULL;
+}
+
+//queues a key change for the task's next frame and wakes it if it was parked on FX0A.
+//False if the task already has SCHEDULER_KEY_EVENTS changes queued.
+bool scheduler_key(scheduler_t *scheduler, const uint32_t task_index, const uint8_t key, const bool pressed) {
+    task_t *task = &scheduler->tasks[task_index];
+    pthread_mutex_lock(&scheduler->lock);
+    if (task->event_count == SCHEDULER_KEY_EVENTS) {
+        pthread_mutex_unlock(&scheduler->lock);
+        return false;
+    }
+    task->events[(task->event_head + task->event_count++) % SCHEDULER_KEY_EVENTS] = (key_event_t) {
+            .key = key & 0xF,
+            .pressed = pressed,
+    };
+    if (task->state == TASK_WAIT_KEY) {
+        const uint64_t now = now_ns();
+        if (scheduler->frame_ns && now > task->due)
+            task->timer_frames = (now - task->due) / scheduler->frame_ns;
+        task->due = now;
+        task->state = TASK_READY;
+        scheduler->wakes++;
+        push_task(scheduler, task_index);
+        pthread_cond_signal(&scheduler->wake);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+    return true;
+}
+
+//frames a parked task has been skipping so far, they count as progress for fairness
+static uint64_t parked_frames(const scheduler_t *scheduler, const task_t *task, const uint64_t now) {
+    if (!scheduler->frame_ns)
+        return 0;
+    if (task->state == TASK_WAIT_KEY)
+        return now > task->due ? (now - task->due) / scheduler->frame_ns : 0;
+    if (task->state == TASK_WAIT_TIMER) {
+        const uint64_t remaining = task->due > now ? (task->due - now) / scheduler->frame_ns : 0;
+        return task->timer_frames > remaining ? task->timer_frames - remaining : 0;
+    }
+    return 0;
+}
+
+void scheduler_stats(scheduler_t *scheduler, scheduler_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    const uint64_t now = now_ns();
+    pthread_mutex_lock(&scheduler->lock);
+    double progress = 0;
+    double progress_squares = 0;
+    for (uint32_t i = 0; i < scheduler->task_count; i++) {
+        const task_t *task = &scheduler->tasks[i];
+        stats->frames += task->frames;
+        stats->skipped_frames += task->skipped_frames;
+        stats->parks += task->parks;
+        stats->waiting_key += task->state == TASK_WAIT_KEY;
+        stats->waiting_timer += task->state == TASK_WAIT_TIMER;
+        const double advanced = (double) (task->frames + task->skipped_frames + parked_frames(scheduler, task, now));
+        progress += advanced;
+        progress_squares += advanced * advanced;
+    }
+    stats->wakes = scheduler->wakes;
+    stats->fairness = progress_squares > 0 ? progress * progress / (scheduler->task_count * progress_squares) : 1;
+
+    uint64_t started = 0;
+    for (uint8_t bucket = 0; bucket < SCHEDULER_LATENCY_BUCKETS; bucket++)
+        started += scheduler->latency[bucket];
+    uint64_t seen = 0;
+    for (uint8_t bucket = 0; bucket < SCHEDULER_LATENCY_BUCKETS && started; bucket++) {
+        seen += scheduler->latency[bucket];
+        if (seen * 100 >= started * 99) {
+            stats->latency_p99_us = (double) (1ULL << bucket) / 1000;
+            break;
+        }
+    }
+    stats->latency_mean_us = started ? (double) scheduler->latency_total / started / 1000 : 0;
+    stats->latency_max_us = (double) scheduler->latency_max / 1000;
+    pthread_mutex_unlock(&scheduler->lock);
+}
@@ -0,0 +1,83 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include "arena.h"
+#include "corpus.h"
+
+#define SCHEDULER_KEY_EVENTS 16
+#define SCHEDULER_LATENCY_BUCKETS 40
+
+//Many machines multiplexed on a few threads. A task runs one frame at a time and then yields, so it
+//is a stackless coroutine whose state is the chip8_t itself. Tasks that would only spin are parked
+//instead: one blocked on FX0A until a key event arrives, one polling the delay timer until it expires
+//(the skipped frames are then fast-forwarded).
+typedef enum {
+    TASK_READY,       // in the run queue, due at task_t.due
+    TASK_RUNNING,
+    TASK_WAIT_KEY,    // parked until scheduler_key()
+    TASK_WAIT_TIMER,  // in the run queue, due when its delay timer reaches 0
+} task_state_t;
+
+typedef struct {
+    uint8_t key;
+    bool pressed;
+} key_event_t;
+
+typedef struct {
+    chip8_t chip8;
+    task_state_t state;
+    uint64_t due;             // monotonic ns at which the next frame should start
+    uint32_t timer_frames;    // frames to fast-forward when a TASK_WAIT_TIMER task wakes
+    key_event_t events[SCHEDULER_KEY_EVENTS];
+    uint8_t event_head;
+    uint8_t event_count;
+    uint64_t frames;
+    uint64_t skipped_frames;
+    uint64_t parks;
+} task_t;
+
+typedef struct {
+    config_t config;
+    uint64_t frame_ns; // 0 runs every task as fast as the threads allow
+    arena_t arena;
+    task_t *tasks;     // laid out in arena, one cache line aligned task after the other
+    uint32_t task_count;
+    uint32_t *queue;   // binary heap of ready task indices, earliest due first
+    uint32_t queue_size;
+    pthread_t *threads;
+    uint32_t thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool stopping;
+    uint64_t latency[SCHEDULER_LATENCY_BUCKETS]; // frames by start latency, bucket b is below 2^b ns
+    uint64_t latency_total;
+    uint64_t latency_max;
+    uint64_t wakes;
+} scheduler_t;
+
+typedef struct {
+    uint64_t frames;          // frames emulated
+    uint64_t skipped_frames;  // frames fast-forwarded instead of polling the delay timer
+    uint64_t parks;
+    uint64_t wakes;           // parked tasks woken by a key
+    uint32_t waiting_key;     // tasks parked right now
+    uint32_t waiting_timer;
+    double latency_mean_us;   // how late frames started after becoming due
+    double latency_p99_us;
+    double latency_max_us;
+    double fairness;          // Jain's index of per-task progress (frames run, skipped or spent parked),
+                              // 1 when every task advanced equally
+} scheduler_stats_t;
+
+bool init_scheduler(scheduler_t *scheduler, const config_t config, const char *romName, const uint32_t tasks,
+                    const uint32_t threads, const uint64_t frame_ns);
+bool init_scheduler_corpus(scheduler_t *scheduler, const config_t config, const corpus_t *corpus, const uint32_t id,
+                           const uint32_t tasks, const uint32_t threads, const uint64_t frame_ns);
+bool start_scheduler(scheduler_t *scheduler);
+void stop_scheduler(scheduler_t *scheduler);
+void free_scheduler(scheduler_t *scheduler);
+bool scheduler_key(scheduler_t *scheduler, const uint32_t task, const uint8_t key, const bool pressed);
+void scheduler_stats(scheduler_t *scheduler, scheduler_stats_t *stats);
+
+#endif
@@ -0,0 +1,400 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "clone.h"
+#include "condition.h"
+
+//chip8_tas: searches for keypad input that drives a ROM into a goal state, for regression inputs.
+//Every frame holds at most one key. The search advances one frame per level: each state of the level
+//is cloned, stepped once per key with run_frame() and the results that no thread has seen before
+//(shared lock-free set of state_hash() values) make up the next level. Breadth-first keeps them all,
+//so the first hit is a shortest input sequence; with --beam only the ones with the highest --score are
+//kept. Goal and score are condition.h expressions, evaluated after every frame.
+
+#define NO_KEY 0xFF
+#define MAX_THREADS 64
+
+//a state reached after some frames, the path back is kept separately in step_t
+typedef struct {
+    chip8_clone_t clone;
+    uint32_t parent;   // index in the previous level
+    int32_t score;     // beam order, highest first
+    uint8_t key;       // key held during the frame that led here
+    uint8_t pool;      // worker whose pool holds the clone
+    bool goal;
+} node_t;
+
+typedef struct {
+    uint32_t parent;
+    uint8_t key;
+} step_t;
+
+//open addressing set of state hashes, 0 marks a free slot
+typedef struct {
+    _Atomic uint64_t *slots;
+    uint64_t mask;
+    atomic_uint_fast64_t count;
+    uint64_t limit;
+    atomic_bool full;
+} visited_t;
+
+typedef struct {
+    node_t *nodes;
+    uint32_t count;
+    uint32_t capacity;
+} level_t;
+
+typedef struct search search_t;
+
+typedef struct {
+    search_t *search;
+    uint8_t id;
+    pthread_t thread;
+    level_t children;
+    uint64_t stepped;
+    uint64_t duplicates;
+} worker_t;
+
+struct search {
+    config_t config;
+    condition_t goal;
+    condition_t score;
+    uint8_t keys[17];
+    uint8_t key_count;
+    uint32_t beam; // 0 for breadth-first
+    uint32_t level;
+    level_t parents;
+    atomic_uint next_parent;
+    visited_t visited;
+    clone_pool_t pools[2][MAX_THREADS]; // children of odd and even levels, parents are never written to
+    worker_t workers[MAX_THREADS];
+    uint8_t threads;
+};
+
+bool init_visited(visited_t *set, const uint64_t limit) {
+    uint64_t capacity = 1024;
+    while (capacity < limit * 2)
+        capacity *= 2;
+    set->slots = calloc(capacity, sizeof(set->slots[0]));
+    set->mask = capacity - 1;
+    set->limit = limit;
+    atomic_init(&set->count, 0);
+    atomic_init(&set->full, false);
+    return set->slots != NULL;
+}
+
+//true if no thread has visited the state before. Once the limit is reached everything counts as seen.
+bool visit(visited_t *set, uint64_t hash) {
+    if (!hash)
+        hash = 1;
+    for (uint64_t i = hash & set->mask;; i = (i + 1) & set->mask) {
+        uint64_t seen = atomic_load_explicit(&set->slots[i], memory_order_relaxed);
+        if (seen == hash)
+            return false;
+        if (seen)
+            continue;
+        if (atomic_load_explicit(&set->count, memory_order_relaxed) >= set->limit) {
+            atomic_store(&set->full, true);
+            return false;
+        }
+        if (atomic_compare_exchange_strong(&set->slots[i], &seen, hash)) {
+            atomic_fetch_add_explicit(&set->count, 1, memory_order_relaxed);
+            return true;
+        }
+        if (seen == hash)
+            return false;
+    }
+}
+
+bool push_node(level_t *level, const node_t *node) {
+    if (level->count == level->capacity) {
+        const uint32_t capacity = level->capacity ? level->capacity * 2 : 256;
+        node_t *nodes = realloc(level->nodes, sizeof(node_t) * capacity);
+        if (!nodes)
+            return false;
+        level->nodes = nodes;
+        level->capacity = capacity;
+    }
+    level->nodes[level->count++] = *node;
+    return true;
+}
+
+//expands parents handed out through next_parent until none are left
+void *search_worker(void *data) {
+    worker_t *worker = (worker_t *) data;
+    search_t *search = worker->search;
+    clone_pool_t *pool = &search->pools[search->level % 2][worker->id];
+    static _Thread_local chip8_t machine;
+    //conditions remember the operands changes are measured from, every thread needs its own
+    condition_t goal = search->goal;
+    condition_t score = search->score;
+    chip8_clone_t start;
+    chip8_clone_t child;
+
+    for (;;) {
+        const uint32_t index = atomic_fetch_add(&search->next_parent, 1);
+        if (index >= search->parents.count)
+            break;
+        const node_t *parent = &search->parents.nodes[index];
+        restore_clone(&search->pools[(search->level + 1) % 2][parent->pool], &machine, &parent->clone, NULL);
+        //a private copy every child can share its untouched pages with
+        if (!capture_clone(pool, &start, &machine, NULL))
+            break;
+        const chip8_clone_t *last = &start;
+
+        for (uint8_t k = 0; k < search->key_count; k++) {
+            restore_clone(pool, &machine, &start, last);
+            last = &start;
+            prime_condition(&goal, &machine);
+            prime_condition(&score, &machine);
+            memset(machine.keypad, false, sizeof(machine.keypad));
+            if (search->keys[k] != NO_KEY)
+                machine.keypad[search->keys[k]] = true;
+            run_frame(&machine, search->config);
+            worker->stepped++;
+            //every frame sets the keypad anew, the keys just held must not tell otherwise equal states apart
+            memset(machine.keypad, false, sizeof(machine.keypad));
+            if (!visit(&search->visited, state_hash(&machine))) {
+                worker->duplicates++;
+                continue;
+            }
+            const bool reached = evaluate_condition(&goal, &machine) != 0;
+            const int32_t value = evaluate_condition(&score, &machine);
+            if (!capture_clone(pool, &child, &machine, &start))
+                continue;
+            last = &child;
+            const node_t node = {
+                    .clone = child,
+                    .parent = index,
+                    .score = value,
+                    .key = search->keys[k],
+                    .pool = worker->id,
+                    .goal = reached,
+            };
+            if (!push_node(&worker->children, &node))
+                release_clone(pool, &child);
+        }
+        release_clone(pool, &start);
+    }
+    return NULL;
+}
+
+int compare_nodes(const void *a, const void *b) {
+    const node_t *first = (const node_t *) a;
+    const node_t *second = (const node_t *) b;
+    if (first->score != second->score)
+        return first->score > second->score ? -1 : 1;
+    if (first->parent != second->parent)
+        return first->parent < second->parent ? -1 : 1;
+    return first->key < second->key ? -1 : first->key > second->key;
+}
+
+int compare_paths(const void *a, const void *b) {
+    const node_t *first = (const node_t *) a;
+    const node_t *second = (const node_t *) b;
+    if (first->parent != second->parent)
+        return first->parent < second->parent ? -1 : 1;
+    return first->key < second->key ? -1 : first->key > second->key;
+}
+
+void write_inputs(FILE *out, step_t **history, const uint32_t frames, uint32_t index) {
+    uint8_t *keys = malloc(frames + 1);
+    if (!keys) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t level = frames; level > 0; level--) {
+        keys[level] = history[level][index].key;
+        index = history[level][index].parent;
+    }
+    for (uint32_t level = 1; level <= frames; level++) {
+        if (keys[level] == NO_KEY)
+            fprintf(out, "-\n");
+        else
+            fprintf(out, "%X\n", keys[level]);
+    }
+    free(keys);
+}
+
+double seconds(void) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <rom-path> --goal <condition> [--frames N] [--beam W] [--score <condition>]\n"
+                        "       [--threads N] [--max-states N] [--keys 0123456789ABCDEF] [--out inputs.txt] [--seed N]\n"
+                        "conditions are expressions such as \"ram[0x2F0] == 3 and V4 >= 10\", see condition.h;\n"
+                        "the beam keeps the states scoring highest, by default the goal itself\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    static search_t search;
+    set_config(&search.config, argc, argv);
+    uint32_t frames = 600;
+    uint64_t max_states = 1 << 20;
+    const char *goal_text = NULL;
+    const char *score_text = NULL;
+    const char *keys = "0123456789ABCDEF";
+    const char *out_path = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 2; i < argc - 1; i++) {
+        if (strcmp(argv[i], "--goal") == 0)
+            goal_text = argv[i + 1];
+        else if (strcmp(argv[i], "--frames") == 0)
+            frames = (uint32_t) strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--score") == 0)
+            score_text = argv[i + 1];
+        else if (strcmp(argv[i], "--beam") == 0)
+            search.beam = (uint32_t) strtoul(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--threads") == 0)
+            threads = strtol(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--max-states") == 0)
+            max_states = strtoull(argv[i + 1], NULL, 10);
+        else if (strcmp(argv[i], "--keys") == 0)
+            keys = argv[i + 1];
+        else if (strcmp(argv[i], "--out") == 0)
+            out_path = argv[i + 1];
+    }
+    char error[128];
+    if (!goal_text) {
+        fprintf(stderr, "Missing --goal\n");
+        exit(EXIT_FAILURE);
+    }
+    if (!compile_condition(&search.goal, goal_text, error, sizeof(error))) {
+        fprintf(stderr, "Invalid --goal: %s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    if (!compile_condition(&search.score, score_text ? score_text : goal_text, error, sizeof(error))) {
+        fprintf(stderr, "Invalid --score: %s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    search.threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+    search.keys[search.key_count++] = NO_KEY;
+    for (const char *key = keys; *key && search.key_count < sizeof(search.keys); key++) {
+        const char digit[] = {*key, '\0'};
+        char *end;
+        const unsigned long value = strtoul(digit, &end, 16);
+        if (*end != '\0') {
+            fprintf(stderr, "Invalid key %c in --keys\n", *key);
+            exit(EXIT_FAILURE);
+        }
+        search.keys[search.key_count++] = (uint8_t) value;
+    }
+
+    static chip8_t machine;
+    if (!init_chip8(&machine, search.config, argv[1]))
+        exit(EXIT_FAILURE);
+    for (uint8_t parity = 0; parity < 2; parity++) {
+        for (uint8_t i = 0; i < search.threads; i++) {
+            if (!init_clone_pool(&search.pools[parity][i], 256)) {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (!init_visited(&search.visited, max_states)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    step_t **history = calloc(frames + 1, sizeof(step_t *));
+    if (!history) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    condition_t goal = search.goal;
+    prime_condition(&goal, &machine);
+    node_t root = {.goal = evaluate_condition(&goal, &machine) != 0};
+    if (!capture_clone(&search.pools[0][0], &root.clone, &machine, NULL)) {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    visit(&search.visited, state_hash(&machine));
+    push_node(&search.parents, &root);
+
+    const double start = seconds();
+    uint64_t stepped = 0;
+    uint64_t duplicates = 0;
+    int64_t found = root.goal ? 0 : -1;
+    uint32_t level = 0;
+    while (found < 0 && level < frames && search.parents.count && !atomic_load(&search.visited.full)) {
+        search.level = ++level;
+        atomic_store(&search.next_parent, 0);
+        for (uint8_t i = 0; i < search.threads; i++) {
+            worker_t *worker = &search.workers[i];
+            const level_t children = {.nodes = worker->children.nodes, .capacity = worker->children.capacity};
+            *worker = (worker_t) {.search = &search, .id = i, .children = children};
+            if (pthread_create(&search.workers[i].thread, NULL, search_worker, &search.workers[i]) != 0) {
+                fprintf(stderr, "Could not start search thread %u\n", i);
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        level_t next = {0};
+        for (uint8_t i = 0; i < search.threads; i++) {
+            worker_t *worker = &search.workers[i];
+            pthread_join(worker->thread, NULL);
+            stepped += worker->stepped;
+            duplicates += worker->duplicates;
+            for (uint32_t n = 0; n < worker->children.count; n++)
+                push_node(&next, &worker->children.nodes[n]);
+        }
+        //workers finish in any order, sorting makes the kept states and the reported path reproducible
+        qsort(next.nodes, next.count, sizeof(node_t), search.beam ? compare_nodes : compare_paths);
+        for (uint32_t n = search.beam; search.beam && n < next.count; n++)
+            release_clone(&search.pools[level % 2][next.nodes[n].pool], &next.nodes[n].clone);
+        if (search.beam && next.count > search.beam)
+            next.count = search.beam;
+
+        history[level] = malloc(sizeof(step_t) * (next.count ? next.count : 1));
+        if (!history[level]) {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (uint32_t n = 0; n < next.count; n++) {
+            history[level][n] = (step_t) {.parent = next.nodes[n].parent, .key = next.nodes[n].key};
+            if (found < 0 && next.nodes[n].goal)
+                found = n;
+        }
+        for (uint32_t n = 0; n < search.parents.count; n++)
+            release_clone(&search.pools[(level + 1) % 2][search.parents.nodes[n].pool],
+                          &search.parents.nodes[n].clone);
+        free(search.parents.nodes);
+        search.parents = next;
+        printf("frame %4u: %8u states, %10llu visited\n", level, next.count,
+               (unsigned long long) atomic_load(&search.visited.count));
+    }
+    const double elapsed = seconds() - start;
+    printf("%llu frames stepped, %llu duplicates, %.2fs (%.0f frames/s on %u threads)\n",
+           (unsigned long long) stepped, (unsigned long long) duplicates, elapsed,
+           elapsed > 0 ? stepped / elapsed : 0.0, search.threads);
+
+    if (found < 0) {
+        if (atomic_load(&search.visited.full))
+            printf("No input reaches %s within the state limit (%llu states)\n", goal_text,
+                   (unsigned long long) max_states);
+        else if (!search.parents.count)
+            printf("No input reaches %s, no new states after %u frames\n", goal_text, level);
+        else
+            printf("No input reaches %s within %u frames\n", goal_text, level);
+        exit(EXIT_FAILURE);
+    }
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Could not open %s for writing\n", out_path);
+        exit(EXIT_FAILURE);
+    }
+    printf("%s reached after %u frames\n", goal_text, level);
+    fprintf(out, "# %s: %s after %u frames, one held key (or -) per frame\n", argv[1], goal_text, level);
+    write_inputs(out, history, level, (uint32_t) found);
+    if (out != stdout)
+        fclose(out);
+    exit(EXIT_SUCCESS);
+}